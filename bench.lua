@@ -0,0 +1,451 @@
+-- benchmarks, run with `lua bench.lua [name...]`
+
+local pb     = require "pb"
+local pbio   = require "pb.io"
+local protoc = require "protoc"
+
+local clock = os.clock
+
+-- best time of n runs, garbage of the previous run is collected first
+local function timeit(name, n, f)
+   local best = math.huge
+   for _ = 1, n do
+      collectgarbage()
+      local start = clock()
+      f()
+      best = math.min(best, clock() - start)
+   end
+   pbio.write(("%-24s %10.3f ms\n"):format(name, best * 1000))
+   return best
+end
+
+-- a descriptor set with many messages, enums, nested and map types
+local function big_schema(count)
+   local src = { 'syntax = "proto3";', "package bench;" }
+   for i = 1, count do
+      src[#src+1] = ([[
+message M%d {
+   enum Kind { NONE = 0; ONE = 1; TWO = 2; }
+   message Inner { string name = 1; repeated int64 ids = 2; Kind kind = 3; }
+   int32 a = 1; string b = 2; double c = 3; bytes d = 4;
+   repeated Inner inners = 5;
+   map<string, Inner> named = 6;
+   oneof value { int64 x = 7; string y = 8; }
+   M%d next = 9;
+}]]):format(i, i % count + 1)
+   end
+   return assert(protoc.new():compile(table.concat(src, "\n"), "bench.proto"))
+end
+
+local benches = {}
+
+function benches.load()
+   local data = big_schema(2000)
+   pbio.write(("descriptor set: %d bytes\n"):format(#data))
+   timeit("pb.load", 30, function()
+      pb.state(nil)
+      assert(pb.load(data))
+   end)
+   timeit("pb.load (lazy_load)", 30, function()
+      pb.state(nil)
+      pb.option "lazy_load"
+      assert(pb.load(data))
+   end)
+   pb.state(nil)
+end
+
+-- plugins loading sets that share a big common file
+function benches.load_overlap()
+   local common = big_schema(500)
+   local sets = {}
+   for i = 1, 10 do
+      sets[i] = common .. assert(protoc.new():compile(
+         ("message Plugin%d { optional int32 id = 1; }"):format(i), ("plugin%d.proto"):format(i)))
+   end
+   timeit("pb.load x10 (overlap)", 10, function()
+      pb.state(nil)
+      for i = 1, #sets do assert(pb.load(sets[i])) end
+   end)
+   pb.state(nil)
+end
+
+-- a message chain over many types, before and after pb.freeze
+function benches.freeze()
+   local data = big_schema(2000)
+   pb.state(nil)
+   assert(pb.load(data))
+   local msg = {}
+   for i = 2000, 1, -1 do
+      msg = { a = i, b = "b", c = 1.5, y = "y", next = i < 2000 and msg or nil,
+              inners = { { name = "n", ids = { 1, 2, 3 }, kind = "ONE" } } }
+   end
+   local bin = pb.encode("bench.M1", msg)
+   local function decode()
+      for _ = 1, 20 do pb.decode("bench.M1", bin) end
+   end
+   timeit("decode", 10, decode)
+   timeit("pb.freeze", 1, pb.freeze)
+   timeit("decode (frozen)", 10, decode)
+   pb.state(nil)
+end
+
+-- lookups of the 5% of a vendor bundle in use, before and after pb.prune
+function benches.prune()
+   local src = { 'syntax = "proto3";', "package vendor;" }
+   for i = 1, 4000 do
+      src[#src+1] = ("message V%d { int32 a = 1; string b = 2; V%d c = 3; }")
+         :format(i, i % 20 == 0 and i or i + 1)
+   end
+   local data = assert(protoc.new():compile(table.concat(src, "\n"), "vendor.proto"))
+   local roots = {}
+   for i = 1, 4000, 20 do roots[#roots+1] = ("vendor.V%d"):format(i + 19) end
+   local function lookup()
+      for _ = 1, 50 do
+         for i = 1, #roots do assert(pb.type(roots[i])) end
+      end
+   end
+   pb.state(nil)
+   assert(pb.load(data))
+   timeit("lookup", 20, lookup)
+   timeit("pb.prune", 1, function() pb.prune(roots) end)
+   timeit("lookup (pruned)", 20, lookup)
+   pb.state(nil)
+end
+
+-- request decoding and response encoding by type name or by method handles
+function benches.method()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      message Req { int32 id = 1; string q = 2; }
+      message Resp { repeated string items = 1; }
+      service Search { rpc Find (Req) returns (Resp); } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local req = pb.encode("bench.Req", { id = 1, q = "q" })
+   local resp = { items = { "a", "b" } }
+   timeit("pb.decode/pb.encode", 10, function()
+      for _ = 1, 100000 do
+         pb.decode("bench.Req", req)
+         pb.encode("bench.Resp", resp)
+      end
+   end)
+   local m = pb.method "bench.Search/Find"
+   timeit("method handles", 10, function()
+      for _ = 1, 100000 do
+         m.decode_request(req)
+         m.encode_response(resp)
+      end
+   end)
+   pb.state(nil)
+end
+
+-- the first decode of every type with default tables, cold and warmed up
+function benches.warmup()
+   local data = big_schema(2000)
+   local function first_decode()
+      pb.state(nil)
+      pb.option "use_default_metatable"
+      assert(pb.load(data))
+      return function()
+         for i = 1, 2000 do pb.decode("bench.M"..i, "") end
+      end
+   end
+   timeit("first decode", 1, first_decode())
+   local decode = first_decode()
+   timeit("pb.warmup", 1, function() pb.warmup() end)
+   timeit("first decode (warmed)", 1, decode)
+   pb.state(nil)
+end
+
+-- small proto3 messages mostly made of default values
+function benches.defaults()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      enum State { IDLE = 0; BUSY = 1; }
+      message Small {
+         int32 id = 1; string name = 2; bool ok = 3; double score = 4;
+         State state = 5; int64 ts = 6; uint32 flags = 7; bytes tag = 8;
+      } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local bin = pb.encode("bench.Small", { id = 1 })
+   timeit("decode 1M with defaults", 3, function()
+      for _ = 1, 1000000 do pb.decode("bench.Small", bin) end
+   end)
+   pb.state(nil)
+end
+
+-- messages with long repeated and map fields, packed or not
+function benches.repeated()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      message Point { int32 x = 1; int32 y = 2; }
+      message Series {
+         repeated int64 ids = 1; repeated double values = 2;
+         repeated string names = 3; repeated Point points = 4;
+         map<int32, string> labels = 5;
+      } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local msg = { ids = {}, values = {}, names = {}, points = {}, labels = {} }
+   for i = 1, 1000 do
+      msg.ids[i], msg.values[i], msg.names[i] = i * 1000, i / 3, "n"..i
+      msg.points[i], msg.labels[i] = { x = i, y = -i }, "l"..i
+   end
+   local bin = pb.encode("bench.Series", msg)
+   timeit("decode 1000 series", 5, function()
+      for _ = 1, 1000 do pb.decode("bench.Series", bin) end
+   end)
+   pb.state(nil)
+end
+
+-- telemetry samples made mostly of enums, single and repeated
+function benches.enums()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      enum Level { DEBUG = 0; INFO = 1; WARN = 2; ERROR = 3; FATAL = 4; }
+      message Sample { Level level = 1; repeated Level history = 2; }
+      message Samples { repeated Sample samples = 1; } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local names = { "DEBUG", "INFO", "WARN", "ERROR", "FATAL" }
+   local msg = { samples = {} }
+   for i = 1, 1000 do
+      local history = {}
+      for j = 1, 32 do history[j] = names[(i + j) % 5 + 1] end
+      msg.samples[i] = { level = names[i % 5 + 1], history = history }
+   end
+   local bin = pb.encode("bench.Samples", msg)
+   timeit("decode 100 batches", 5, function()
+      for _ = 1, 100 do pb.decode("bench.Samples", bin) end
+   end)
+   timeit("encode 100 batches", 5, function()
+      for _ = 1, 100 do pb.encode("bench.Samples", msg) end
+   end)
+   pb.state(nil)
+end
+
+-- decode hooks on the elements of a long array, one by one or batched, and
+-- on types not in the data at all
+function benches.hooks()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      message Point { int32 x = 1; int32 y = 2; }
+      message Path { repeated Point points = 1; string name = 2; }
+      message Other { int32 z = 1; } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local msg = { points = {}, name = "path" }
+   for i = 1, 1000 do msg.points[i] = { x = i, y = -i } end
+   local bin = pb.encode("bench.Path", msg)
+   local function decode()
+      for _ = 1, 200 do pb.decode("bench.Path", bin) end
+   end
+   pb.option "enable_hooks"
+   pb.hook("bench.Other", function(t) return t end)
+   timeit("decode 200 (other hooked)", 5, decode)
+   pb.hook("bench.Point", function(t) t.seen = true end)
+   timeit("decode 200 (hook)", 5, decode)
+   pb.hook("bench.Point", nil)
+   pb.batch_hook("bench.Point", function(list, first)
+      for i = first, #list do list[i].seen = true end
+   end)
+   timeit("decode 200 (batch hook)", 5, decode)
+   pb.option "disable_hooks"
+   pb.state(nil)
+end
+
+-- decoding into objects of a class, by a decode hook or a binding
+function benches.bind()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      message Point { int32 x = 1; int32 y = 2; }
+      message Path { repeated Point points = 1; string name = 2; } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local msg = { points = {}, name = "path" }
+   for i = 1, 1000 do msg.points[i] = { x = i, y = -i } end
+   local bin = pb.encode("bench.Path", msg)
+   local function decode()
+      for _ = 1, 200 do pb.decode("bench.Path", bin) end
+   end
+   local Point = {}
+   Point.__index = Point
+   pb.option "enable_hooks"
+   pb.hook("bench.Point", function(t) return setmetatable(t, Point) end)
+   timeit("decode 200 (hook)", 5, decode)
+   pb.option "disable_hooks"
+   pb.bind("bench.Point", Point)
+   timeit("decode 200 (bind)", 5, decode)
+   pb.state(nil)
+end
+
+-- encoding proxy objects, copied to plain tables first or read through
+-- __index by encode_getters
+function benches.getters()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      message Point { int32 x = 1; int32 y = 2; string tag = 3; }
+      message Path { repeated Point points = 1; string name = 2; } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local fields = { "x", "y", "tag" }
+   local Point = { __index = function(p, k) return p.data[k] end }
+   local msg = { points = {}, name = "path" }
+   for i = 1, 1000 do
+      msg.points[i] = setmetatable({ data = { x = i, y = -i, tag = "t" } }, Point)
+   end
+   timeit("encode 200 (copied)", 5, function()
+      for _ = 1, 200 do
+         local points = {}
+         for i, p in ipairs(msg.points) do
+            local t = {}
+            for _, k in ipairs(fields) do t[k] = p[k] end
+            points[i] = t
+         end
+         pb.encode("bench.Path", { points = points, name = msg.name })
+      end
+   end)
+   pb.option "encode_getters"
+   timeit("encode 200 (getters)", 5, function()
+      for _ = 1, 200 do pb.encode("bench.Path", msg) end
+   end)
+   pb.state(nil)
+end
+
+-- routing on one nested key of a 20 KB envelope
+function benches.get()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      message Header { string trace_id = 1; string route = 2; }
+      message Item { int64 id = 1; string name = 2; repeated double values = 3; }
+      message Envelope { repeated Item items = 1; Header header = 2; } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local msg = { items = {}, header = { trace_id = "t", route = "r" } }
+   for i = 1, 200 do
+      msg.items[i] = { id = i, name = "item"..i, values = { 1, 2, 3, 4, 5, 6, 7, 8 } }
+   end
+   local bin = pb.encode("bench.Envelope", msg)
+   pbio.write(("envelope: %d bytes\n"):format(#bin))
+   timeit("decode 1000", 5, function()
+      for _ = 1, 1000 do assert(pb.decode("bench.Envelope", bin).header.route) end
+   end)
+   timeit("pb.get 1000", 5, function()
+      for _ = 1, 1000 do assert(pb.get("bench.Envelope", bin, "header.route")) end
+   end)
+   pb.state(nil)
+end
+
+-- per-frame decoding of a game state, into new tables or recycled ones
+function benches.recycle()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package bench;
+      message Vec { float x = 1; float y = 2; float z = 3; }
+      message Unit { int32 id = 1; Vec pos = 2; Vec vel = 3; repeated int32 buffs = 4; }
+      message Frame { int64 tick = 1; repeated Unit units = 2; map<string, Vec> marks = 3; } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local frame = { tick = 1, units = {}, marks = { a = { x = 1 }, b = { y = 2 } } }
+   for i = 1, 200 do
+      frame.units[i] = { id = i, pos = { x = i, y = i, z = i }, vel = { x = 1 },
+                         buffs = { 1, 2, 3 } }
+   end
+   local bin = pb.encode("bench.Frame", frame)
+   timeit("decode 1000 frames", 5, function()
+      for _ = 1, 1000 do pb.decode("bench.Frame", bin) end
+   end)
+   pb.option "decode_recycle"
+   local state = {}
+   timeit("decode 1000 frames (recycle)", 5, function()
+      for _ = 1, 1000 do pb.decode("bench.Frame", bin, state) end
+   end)
+   pb.option "no_decode_recycle"
+   pb.state(nil)
+end
+
+-- events with timestamps and wrapped values, as messages or converted in C
+function benches.wellknown()
+   local data = assert(protoc.new():compile [[
+      syntax = "proto3";
+      package google.protobuf;
+      message Timestamp { int64 seconds = 1; int32 nanos = 2; }
+      message DoubleValue { double value = 1; }
+      message Event { Timestamp at = 1; DoubleValue value = 2; }
+      message Events { repeated Event events = 1; } ]])
+   pb.state(nil)
+   assert(pb.load(data))
+   local msg = { events = {} }
+   for i = 1, 1000 do
+      msg.events[i] = { at = { seconds = 1700000000 + i, nanos = i * 1000 },
+                        value = { value = i / 3 } }
+   end
+   local bin = pb.encode("google.protobuf.Events", msg)
+   local function decode()
+      for _ = 1, 200 do pb.decode("google.protobuf.Events", bin) end
+   end
+   timeit("decode 200 (messages)", 5, decode)
+   pb.wellknown("google.protobuf.Timestamp", "number")
+   pb.wellknown("google.protobuf.DoubleValue", "value")
+   timeit("decode 200 (converted)", 5, decode)
+   pb.state(nil)
+end
+
+-- resident memory in KB, from procfs where it exists
+local function rss()
+   local f = io.open "/proc/self/statm"
+   if not f then return 0 end
+   local pages = f:read "*n" and f:read "*n"
+   f:close()
+   return pages * 4
+end
+
+-- load and clear 1M fields sharing a few names, memory must not grow once
+-- the allocator is warmed up by the first round
+function benches.names()
+   local fields = {}
+   for i = 1, 10 do
+      fields[i] = { name = i == 1 and "id" or "f"..i, number = i, label = 1, type = 5 }
+   end
+   local msgs = {}
+   for i = 1, 100000 do msgs[i] = { name = "M"..i, field = fields } end
+   local data = pb.encode(".google.protobuf.FileDescriptorSet",
+      { file = { { name = "names.proto", message_type = msgs } } })
+   msgs = nil
+   local baseline
+   for round = 1, 4 do
+      timeit(("load 1M fields #%d"):format(round), 1, function()
+         assert(pb.load(data))
+      end)
+      assert(pb.field("M100000", "id"))
+      timeit(("clear 1M fields #%d"):format(round), 1, function()
+         for i = 1, 100000 do pb.clear("M"..i) end
+      end)
+      pb.state(nil)
+      protoc.reload()
+      collectgarbage()
+      pbio.write(("rss after clear: %d KB\n"):format(rss()))
+      if round == 2 then baseline = rss() end
+      assert(round <= 2 or rss() <= baseline * 1.05,
+             "memory does not return to baseline")
+   end
+end
+
+local names = { ... }
+if #names == 0 then
+   for name in pairs(benches) do names[#names+1] = name end
+   table.sort(names)
+end
+for _, name in ipairs(names) do
+   protoc.reload()
+   assert(benches[name], "no benchmark named "..name)()
+end
@@ -20,16 +20,53 @@ PB_NS_BEGIN
 #include <stdio.h>
 #include <errno.h>
 
+#if !defined(LPB_NO_THREADS) && (defined(_WIN32) \
+        || !(defined(__unix__) || defined(__APPLE__)))
+# define LPB_NO_THREADS
+#endif
+
+#ifndef LPB_NO_THREADS
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+#if !defined(LPB_NO_MMAP) && (defined(_WIN32) \
+        || !(defined(__unix__) || defined(__APPLE__)))
+# define LPB_NO_MMAP
+#endif
+
+#ifndef LPB_NO_MMAP
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#if !defined(LPB_NO_TRIM) && !defined(__GLIBC__)
+# define LPB_NO_TRIM
+#endif
+
+#ifndef LPB_NO_TRIM
+# include <malloc.h>
+# define lpb_trim() ((void)malloc_trim(0))
+#else
+# define lpb_trim() ((void)0)
+#endif
+
 /* Lua util routines */
 
 #define PB_STATE     "pb.State"
 #define PB_BUFFER    "pb.Buffer"
 #define PB_SLICE     "pb.Slice"
+#define PB_MESSAGE   "pb.Message"
+#define PB_SHARED    "pb.Shared"
 
 #define check_buffer(L,idx) ((pb_Buffer*)luaL_checkudata(L,idx,PB_BUFFER))
 #define test_buffer(L,idx)  ((pb_Buffer*)luaL_testudata(L,idx,PB_BUFFER))
 #define check_slice(L,idx)  ((pb_Slice*)luaL_checkudata(L,idx,PB_SLICE))
 #define test_slice(L,idx)   ((pb_Slice*)luaL_testudata(L,idx,PB_SLICE))
+#define check_message(L,idx) ((lpb_Message*)luaL_checkudata(L,idx,PB_MESSAGE))
+#define test_message(L,idx)  ((lpb_Message*)luaL_testudata(L,idx,PB_MESSAGE))
 #define push_slice(L,s)     lua_pushlstring((L), (s).p, pb_len((s)))
 
 static int lpb_relindex(int idx, int offset) {
@@ -124,22 +161,102 @@ static int lua53_rawgetp(lua_State *L, int idx, const void *p)
 #define lpbS_state(LS)   ((LS)->state)
 #define lpb_name(LS,s)   pb_name(lpbS_state(LS), (s), &(LS)->cache)
 
-static const pb_State *global_state = NULL;
 static const char state_name[] = PB_STATE;
 
 enum lpb_Int64Mode { LPB_NUMBER, LPB_STRING, LPB_HEXSTRING };
 enum lpb_EncodeMode   { LPB_DEFDEF, LPB_COPYDEF, LPB_METADEF, LPB_NODEF };
 
+typedef struct lpb_Shared {
+    pb_State state;
+    int      refs; /* live "pb.Shared" handles, guarded by shared_lock */
+    void    *map;  /* image used in place, see lpb_openimage */
+    size_t   map_size;
+    void    *copy; /* or the moved copy of it */
+} lpb_Shared;
+
+static lpb_Shared *shared_state = NULL; /* last published, not owned */
+
+#ifndef LPB_NO_THREADS
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+# define lpbS_lock()   pthread_mutex_lock(&shared_lock)
+# define lpbS_unlock() pthread_mutex_unlock(&shared_lock)
+#else
+# define lpbS_lock()   ((void)0)
+# define lpbS_unlock() ((void)0)
+#endif
+
+typedef enum lpb_HookKind {
+    LPB_HOOK  = 1, /* pb.hook(), for each decoded value */
+    LPB_BATCH = 2  /* pb.batch_hook(), for each decoded array */
+} lpb_HookKind;
+
+typedef struct lpb_HookEntry {
+    pb_Entry entry;
+    unsigned kinds; /* lpb_HookKind */
+} lpb_HookEntry;
+
+typedef struct lpb_BindEntry {
+    pb_Entry entry;
+    int size; /* hash size of new tables, or -1 */
+} lpb_BindEntry;
+
+typedef enum lpb_WktKind {
+    LPB_WNONE, LPB_WTIMESTAMP, LPB_WDURATION,
+    LPB_WDOUBLE, LPB_WFLOAT, LPB_WINT64, LPB_WUINT64, LPB_WINT32,
+    LPB_WUINT32, LPB_WBOOL, LPB_WSTRING, LPB_WBYTES, /* wrappers */
+    LPB_WSTRUCT, LPB_WVALUE, LPB_WLIST, LPB_WCOUNT
+} lpb_WktKind;
+
+static const char *const lpb_wktnames[LPB_WCOUNT] = {
+    NULL, "google.protobuf.Timestamp", "google.protobuf.Duration",
+    "google.protobuf.DoubleValue", "google.protobuf.FloatValue",
+    "google.protobuf.Int64Value", "google.protobuf.UInt64Value",
+    "google.protobuf.Int32Value", "google.protobuf.UInt32Value",
+    "google.protobuf.BoolValue", "google.protobuf.StringValue",
+    "google.protobuf.BytesValue", "google.protobuf.Struct",
+    "google.protobuf.Value", "google.protobuf.ListValue"
+};
+
+typedef enum lpb_WktMode {
+    LPB_WOFF, LPB_WASNUMBER, LPB_WASSTRING, LPB_WASVALUE
+} lpb_WktMode;
+
+typedef struct lpb_WktEntry {
+    pb_Entry entry;
+    int kind; /* lpb_WktKind */
+} lpb_WktEntry;
+
 typedef struct lpb_State {
     const pb_State *state;
+    lpb_Shared *shared;
+    int shared_ref; /* handle owning our reference of shared */
+    int local_ref;  /* handle pinning local types, see lpbS_pushpin */
     pb_State  local;
+    unsigned  local_version; /* bumped when local types are freed */
     pb_Cache  cache;
     pb_Buffer buffer;
+    pb_Buffer tape;       /* lpb_TapeItem list of two-pass decode */
+    pb_Buffer tapeframes;
+    pb_Buffer slots;      /* lpb_Slot list of recycling decode */
     pb_Type   array_type;
     pb_Type   map_type;
     int defs_index;
+    int tmpls_index;      /* type -> default fields to copy, see lpb_pushtmpl */
+    int pool_index;       /* type -> tables to reuse, see lpbR_pushtable */
+    int enums_index;      /* enum type -> names by value, see lpb_pushenum */
+    int paths_index;      /* type -> resolved paths, see lpb_pushpath */
     int enc_hooks_index;
     int dec_hooks_index;
+    int batch_hooks_index;
+    pb_Table hooked;      /* type -> lpb_HookEntry, see lpb_hookkinds */
+    unsigned hooks_stale   : 1; /* hooked needs a rebuild */
+    int binds_index;      /* type -> { metatable, size }, see Lpb_bind */
+    pb_Table bound;       /* type -> lpb_BindEntry, see lpb_bound */
+    unsigned binds_stale   : 1; /* bound needs a rebuild */
+    pb_Table wkts;        /* type -> lpb_WktEntry, see lpb_wktkind */
+    unsigned char wkt_modes[LPB_WCOUNT]; /* lpb_WktMode of each kind */
+    unsigned wkts_stale    : 1; /* wkts needs a rebuild */
+    unsigned use_wkts      : 1; /* some conversion is enabled */
     unsigned use_dec_hooks : 1;
     unsigned use_enc_hooks : 1;
     unsigned enum_as_value : 1;
@@ -149,8 +266,115 @@ typedef struct lpb_State {
     unsigned decode_default_array   : 1;
     unsigned decode_default_message : 1;
     unsigned encode_order  : 1;
+    unsigned encode_getters : 1;
+    unsigned decode_two_pass : 1;
+    unsigned lazy_load     : 1;
+    unsigned decode_recycle : 1;
+    unsigned pool_user     : 1; /* counted in the users of the worker pool */
 } lpb_State;
 
+static void lpbS_release(lpb_Shared *SS) {
+    int last;
+    lpbS_lock();
+    if ((last = (--SS->refs == 0)) && shared_state == SS)
+        shared_state = NULL;
+    lpbS_unlock();
+    if (!last) return;
+    pb_free(&SS->state);
+#ifndef LPB_NO_MMAP
+    if (SS->map != NULL) munmap(SS->map, SS->map_size);
+#endif
+    free(SS->copy), free(SS);
+}
+
+static int Lshared_delete(lua_State *L) {
+    lpb_Shared **box = (lpb_Shared**)luaL_checkudata(L, 1, PB_SHARED);
+    if (*box != NULL) lpbS_release(*box), *box = NULL;
+    return 0;
+}
+
+static lpb_Shared **lpbS_newbox(lua_State *L) {
+    /* every reference lives in a handle freed by GC, so errors never leak
+     * one, and anything holding the handle keeps the types alive */
+    lpb_Shared **box = (lpb_Shared**)lua_newuserdata(L, sizeof(lpb_Shared*));
+    *box = NULL;
+    if (luaL_newmetatable(L, PB_SHARED)) {
+        lua_pushcfunction(L, Lshared_delete);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    return box;
+}
+
+static void lpb_dropcache(lua_State *L, lpb_State *LS) {
+    /* templates hold values made by the options and the schema at the
+     * time, pools, enum tables and the sets of hooked and converted types
+     * are keyed by types, drop them all when either changes */
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->tmpls_index);
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->pool_index);
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->enums_index);
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->paths_index);
+    LS->tmpls_index = LS->pool_index = LS->enums_index = LUA_NOREF;
+    LS->paths_index = LUA_NOREF;
+    LS->hooks_stale = LS->wkts_stale = LS->binds_stale = 1;
+}
+
+static void lpbS_setshared(lua_State *L, lpb_State *LS) {
+    /* use the handle on top of stack (popped), an empty one detaches */
+    lpb_Shared *SS = *(lpb_Shared**)lua_touserdata(L, -1);
+    int ref = SS ? luaL_ref(L, LUA_REGISTRYINDEX) : (lua_pop(L, 1), LUA_NOREF);
+    luaL_unref(L, LUA_REGISTRYINDEX, LS->shared_ref);
+    LS->shared = SS, LS->shared_ref = ref;
+    LS->state = SS ? &SS->state : &LS->local;
+    lpb_dropcache(L, LS);
+}
+
+static void lpbS_pushpin(lua_State *L, lpb_State *LS) {
+    /* the handle of the version in use, local types get an empty handle
+     * they move into when freed while pinned, see lpbS_freelocal */
+    lpb_Shared **box;
+    if (LS->state != &LS->local)
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LS->shared_ref);
+    else if (LS->local_ref != LUA_NOREF)
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LS->local_ref);
+    else {
+        box = lpbS_newbox(L);
+        lpb_checkmem(L, (*box = (lpb_Shared*)calloc(1, sizeof(lpb_Shared))) != NULL);
+        pb_init(&(*box)->state), (*box)->refs = 1;
+        lua_pushvalue(L, -1);
+        LS->local_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+static void lpbS_freeze(lua_State *L, const pb_State *S) {
+    const pb_Type *t = NULL;
+    /* sort fields now, nothing may write to the state after this */
+    while (pb_nexttype(S, &t))
+        lpb_checkmem(L, t->field_count == 0 || pb_sortedfields(t) != NULL);
+}
+
+static void lpbS_freelocal(lua_State *L, lpb_State *LS) {
+    /* objects made from local types check the version, see lpbM_isstale */
+    lpb_Shared *SS = NULL;
+    if (LS->local_ref != LUA_NOREF) { /* pinned, freed with the last pin */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LS->local_ref);
+        SS = *(lpb_Shared**)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->local_ref);
+        LS->local_ref = LUA_NOREF;
+    }
+    if (SS != NULL) SS->state = LS->local;
+    else pb_free(&LS->local);
+    pb_init(&LS->local);
+    ++LS->local_version;
+    lpb_dropcache(L, LS); /* new types may get the addresses of the old */
+}
+
+static void lpbS_checkmutable(lua_State *L, lpb_State *LS) {
+    if (LS->shared != NULL)
+        luaL_error(L, "state is attached to a shared schema, detach it first");
+}
+
 static int lpb_reftable(lua_State *L, int ref) {
     if (ref != LUA_NOREF) {
         lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
@@ -171,18 +395,42 @@ static void lpb_pushenchooktable(lua_State *L, lpb_State *LS)
 static void lpb_pushdechooktable(lua_State *L, lpb_State *LS)
 { LS->dec_hooks_index = lpb_reftable(L, LS->dec_hooks_index); }
 
+static void lpb_pushbatchhooktable(lua_State *L, lpb_State *LS)
+{ LS->batch_hooks_index = lpb_reftable(L, LS->batch_hooks_index); }
+
+static void lpb_pushbindtable(lua_State *L, lpb_State *LS)
+{ LS->binds_index = lpb_reftable(L, LS->binds_index); }
+
+#ifndef LPB_NO_THREADS
+static void lpb_poolrelease(void);
+#endif
+
 static int Lpb_delete(lua_State *L) {
     lpb_State *LS = (lpb_State*)luaL_testudata(L, 1, PB_STATE);
     if (LS != NULL) {
-        const pb_State *GS = global_state;
-        pb_free(&LS->local);
-        if (&LS->local == GS)
-            global_state = NULL;
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->shared_ref);
+        LS->shared = NULL, LS->shared_ref = LUA_NOREF;
+        lpbS_freelocal(L, LS);
         LS->state = NULL;
         pb_resetbuffer(&LS->buffer);
+        pb_resetbuffer(&LS->tape);
+        pb_resetbuffer(&LS->tapeframes);
+        pb_resetbuffer(&LS->slots);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->tmpls_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->pool_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->enums_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->paths_index);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->enc_hooks_index);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->dec_hooks_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->batch_hooks_index);
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->binds_index);
+        pb_freetable(&LS->hooked);
+        pb_freetable(&LS->bound);
+        pb_freetable(&LS->wkts);
+#ifndef LPB_NO_THREADS
+        if (LS->pool_user) lpb_poolrelease(), LS->pool_user = 0;
+#endif
     }
     return 0;
 }
@@ -198,11 +446,22 @@ LUALIB_API lpb_State *lpb_lstate(lua_State *L) {
         memset(LS, 0, sizeof(lpb_State));
         LS->array_type.is_dead = LS->map_type.is_dead = 1;
         LS->defs_index = LUA_NOREF;
+        LS->tmpls_index = LUA_NOREF;
+        LS->pool_index = LUA_NOREF;
+        LS->enums_index = LUA_NOREF;
+        LS->paths_index = LUA_NOREF;
         LS->enc_hooks_index = LUA_NOREF;
         LS->dec_hooks_index = LUA_NOREF;
+        LS->batch_hooks_index = LUA_NOREF;
+        LS->binds_index = LUA_NOREF;
+        LS->shared_ref = LUA_NOREF;
+        LS->local_ref = LUA_NOREF;
         LS->state = &LS->local;
         pb_init(&LS->local);
         pb_initbuffer(&LS->buffer);
+        pb_inittable(&LS->hooked, sizeof(lpb_HookEntry));
+        pb_inittable(&LS->bound, sizeof(lpb_BindEntry));
+        pb_inittable(&LS->wkts, sizeof(lpb_WktEntry));
         luaL_setmetatable(L, PB_STATE);
         lua_rawsetp(L, LUA_REGISTRYINDEX, state_name);
     }
@@ -861,6 +1120,70 @@ LUALIB_API int luaopen_pb_buffer(lua_State *L) {
     return 1;
 }
 
+static pb_Buffer *lpb_newbuffer(lua_State *L) {
+    pb_Buffer *b = (pb_Buffer*)lua_newuserdata(L, sizeof(pb_Buffer));
+    pb_initbuffer(b);
+    luaopen_pb_buffer(L);
+    lua_setmetatable(L, -2);
+    return b;
+}
+
+/* rope input: a sequence of chunks read without joining them */
+
+typedef struct lpb_Rope {
+    lua_State  *L;
+    int         idx;     /* index of the chunks table */
+    lua_Integer next;    /* next chunk to fetch */
+    pb_Slice    curr;    /* unread part of current chunk, up to limit */
+    const char *end;     /* end of current chunk */
+    size_t      base;    /* rope offset of current chunk */
+    size_t      limit;   /* rope offset where the message being read ends */
+    pb_Buffer  *scratch; /* stitched fields that straddle chunks */
+} lpb_Rope;
+
+#define lpb_ropepos(R) ((R)->base + (size_t)((R)->curr.p - (R)->curr.start))
+
+static void lpb_ropeclip(lpb_Rope *R) {
+    size_t n = R->limit - R->base;
+    R->curr.end = n < (size_t)(R->end - R->curr.start) ?
+        R->curr.start + n : R->end;
+}
+
+static int lpb_ropenext(lpb_Rope *R) {
+    while (R->curr.p >= R->curr.end) {
+        lua_State *L = R->L;
+        if (R->curr.end != R->end) return 0; /* end of the message */
+        if (lua53_rawgeti(L, R->idx, R->next) == LUA_TNIL)
+            return lua_pop(L, 1), 0;
+        R->base += (size_t)(R->end - R->curr.start);
+        R->curr = lpb_toslice(L, -1); /* anchored by the chunks table */
+        if (R->curr.p == NULL)
+            argcheck(L, 0, R->idx, "string/buffer/slice expected at chunk #%d, got %s",
+                    (int)R->next, luaL_typename(L, -1));
+        R->curr.start = R->curr.p, R->end = R->curr.end;
+        lpb_ropeclip(R);
+        lua_pop(L, 1), ++R->next;
+    }
+    return 1;
+}
+
+static void lpb_initrope(lua_State *L, lpb_Rope *R, int idx) {
+    memset(R, 0, sizeof(lpb_Rope));
+    R->L = L, R->idx = idx, R->next = 1;
+    R->limit = ~(size_t)0;
+    R->scratch = lpb_newbuffer(L);
+}
+
+static void lpb_joinrope(lua_State *L, int idx) {
+    lpb_Rope R;
+    lpb_initrope(L, &R, idx);
+    while (lpb_ropenext(&R)) {
+        lpb_checkmem(L, pb_addslice(R.scratch, R.curr));
+        R.curr.p = R.curr.end;
+    }
+    lua_replace(L, idx);
+}
+
 /* protobuf decode routine */
 
 #define LPB_INITSTACKLEN 2
@@ -915,6 +1238,7 @@ static void lpb_initslice(lua_State *L, int idx, lpb_Slice *s, size_t size) {
         s->buff = s->init_buff;
         s->size = LPB_INITSTACKLEN;
     }
+    if (lua_istable(L, idx)) lpb_joinrope(L, idx);
     if (!lua_isnoneornil(L, idx)) {
         pb_Slice base, view = lpb_checkview(L, idx, &base);
         s->curr = base;
@@ -1159,25 +1483,33 @@ typedef enum {USE_FIELD = 1, USE_REPEAT = 2, USE_MESSAGE = 4} lpb_DefFlags;
 
 static void lpb_pushtypetable(lua_State *L, lpb_State *LS, const pb_Type *t);
 static void lpb_pushdefmeta(lua_State *L, lpb_State *LS, const pb_Type *t);
+static const lpb_BindEntry *lpb_bound(lua_State *L, lpb_State *LS, const pb_Type *t);
+static int lpb_wktkind(lua_State *L, lpb_State *LS, const pb_Type *t);
+static void lpb_pushwktzero(lua_State *L, lpb_State *LS, const pb_Type *t, int kind);
 
-static void lpb_newmsgtable(lua_State *L, const pb_Type *t) {
+static void lpb_newmsgtable(lua_State *L, const pb_Type *t, int size) {
     int fieldcnt = t->field_count - t->oneof_field + t->oneof_count*2;
-    lua_createtable(L, 0, fieldcnt > 0 ? fieldcnt : 0);
+    if (size < 0) size = fieldcnt > 0 ? fieldcnt : 0;
+    lua_createtable(L, 0, size);
 }
 
 LUALIB_API const pb_Type *lpb_type(lua_State *L, lpb_State *LS, pb_Slice s) {
+    const pb_Name *name;
     const pb_Type *t;
     if (s.p == NULL || *s.p == '\0' || *s.p == '.')
-        t = pb_type(lpbS_state(LS), lpb_name(LS, s));
+        name = lpb_name(LS, s);
     else {
         pb_Buffer b;
         pb_initbuffer(&b);
         *pb_prepbuffsize(&b, 1) = '.';
         pb_addsize(&b, 1);
         lpb_checkmem(L, pb_addslice(&b, s));
-        t = pb_type(lpbS_state(LS), pb_name(lpbS_state(LS),pb_result(&b),NULL));
+        name = pb_name(lpbS_state(LS), pb_result(&b), NULL);
         pb_resetbuffer(&b);
     }
+    t = pb_type(lpbS_state(LS), name);
+    if ((t == NULL || !t->is_defined) && lpbS_state(LS) == &LS->local)
+        t = pb_loadtype(&LS->local, name); /* build lazily loaded type */
     return t;
 }
 
@@ -1188,14 +1520,31 @@ static const pb_Field *lpb_field(lua_State *L, int idx, const pb_Type *t) {
     return pb_fname(t, lpb_name(LS, lpb_checkslice(L, idx)));
 }
 
+#define lpb_loadfn(LS) ((LS)->lazy_load ? pb_loadlazy : pb_load)
+
+static int lpb_loadresult(lua_State *L, lpb_State *LS, int r, pb_Slice s) {
+    static const char *status[] = { "loaded", "skipped", "replaced" };
+    const pb_Name *name = NULL;
+    int st;
+    lpb_dropcache(L, LS);
+    lua_pushboolean(L, r == PB_OK);
+    lua_pushinteger(L, pb_pos(s)+1);
+    if (r != PB_OK) return 2;
+    lua_newtable(L);
+    while (pb_nextfile(&LS->local, &name, &st)) {
+        lua_pushstring(L, status[st - PB_FLOADED]);
+        lua_setfield(L, -2, (const char*)name);
+    }
+    return 3;
+}
+
 static int Lpb_load(lua_State *L) {
     lpb_State *LS = lpb_lstate(L);
     pb_Slice s = lpb_checkslice(L, 1);
-    int r = pb_load(&LS->local, &s);
-    if (r == PB_OK) global_state = &LS->local;
-    lua_pushboolean(L, r == PB_OK);
-    lua_pushinteger(L, pb_pos(s)+1);
-    return 2;
+    int r;
+    lpbS_checkmutable(L, LS);
+    r = lpb_loadfn(LS)(&LS->local, &s);
+    return lpb_loadresult(L, LS, r, s);
 }
 
 static int Lpb_load_unsafe(lua_State *L) {
@@ -1205,38 +1554,121 @@ static int Lpb_load_unsafe(lua_State *L) {
     pb_Slice s = pb_lslice(data, size);
     int r;
     if (data == NULL) lpb_typeerror(L, 1, "userdata");
-    r = pb_load(&LS->local, &s);
-    if (r == PB_OK) global_state = &LS->local;
-    lua_pushboolean(L, r == PB_OK);
-    lua_pushinteger(L, pb_pos(s)+1);
-    return 2;
+    lpbS_checkmutable(L, LS);
+    r = lpb_loadfn(LS)(&LS->local, &s);
+    return lpb_loadresult(L, LS, r, s);
 }
 
-static int Lpb_loadfile(lua_State *L) {
-    lpb_State *LS = lpb_lstate(L);
-    const char *filename = luaL_checkstring(L, 1);
-    size_t size;
+typedef struct lpb_File {
+    pb_Slice  s;
     pb_Buffer b;
-    pb_Slice s;
-    int ret;
-    FILE *fp = fopen(filename, "rb");
-    if (fp == NULL)
-        return luaL_fileresult(L, 0, filename);
-    pb_initbuffer(&b);
+    void     *map;
+    size_t    size;
+} lpb_File;
+
+static int lpb_openfile(const char *filename, lpb_File *f) {
+    FILE *fp;
+    size_t size;
+    memset(f, 0, sizeof(lpb_File));
+    pb_initbuffer(&f->b);
+#ifndef LPB_NO_MMAP
+    { /* map regular files read-only, read others */
+        struct stat st;
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) return 0;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+                && (f->map = mmap(NULL, (size_t)st.st_size, PROT_READ,
+                        MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+            close(fd);
+            f->size = (size_t)st.st_size;
+            f->s = pb_lslice((const char*)f->map, f->size);
+            return 1;
+        }
+        f->map = NULL;
+        close(fd);
+    }
+#endif
+    if ((fp = fopen(filename, "rb")) == NULL) return 0;
     do {
-        char *d = pb_prepbuffsize(&b, BUFSIZ);
-        if (d == NULL) return fclose(fp), luaL_error(L, "out of memory");
+        char *d = pb_prepbuffsize(&f->b, BUFSIZ);
+        if (d == NULL) return fclose(fp), errno = ENOMEM, 0;
         size = fread(d, 1, BUFSIZ, fp);
-        pb_addsize(&b, size);
+        pb_addsize(&f->b, size);
     } while (size == BUFSIZ);
     fclose(fp);
-    s = pb_result(&b);
-    ret = pb_load(&LS->local, &s);
-    if (ret == PB_OK) global_state = &LS->local;
-    pb_resetbuffer(&b);
-    lua_pushboolean(L, ret == PB_OK);
-    lua_pushinteger(L, pb_pos(s)+1);
-    return 2;
+    f->s = pb_result(&f->b);
+    return 1;
+}
+
+static void lpb_closefile(lpb_File *f) {
+#ifndef LPB_NO_MMAP
+    if (f->map != NULL) munmap(f->map, f->size);
+#endif
+    pb_resetbuffer(&f->b);
+}
+
+static int lpb_loadfile(lua_State *L, int (*load)(pb_State *S, pb_Slice *s)) {
+    lpb_State *LS = lpb_lstate(L);
+    const char *filename = luaL_checkstring(L, 1);
+    lpb_File f;
+    int ret;
+    lpbS_checkmutable(L, LS);
+    if (!lpb_openfile(filename, &f))
+        return luaL_fileresult(L, 0, filename);
+    ret = load(&LS->local, &f.s);
+    lpb_closefile(&f);
+    return lpb_loadresult(L, LS, ret, f.s);
+}
+
+static int Lpb_loadfile(lua_State *L)
+{ return lpb_loadfile(L, lpb_loadfn(lpb_lstate(L))); }
+
+static void lpb_loadall(lua_State *L, lpb_State *LS) {
+    int r = pb_loadall(&LS->local);
+    lpb_checkmem(L, r != PB_ENOMEM);
+    if (r != PB_OK) luaL_error(L, "invalid lazily loaded schema");
+}
+
+static int Lpb_load_snapshot(lua_State *L)
+{ return lpb_loadfile(L, pb_loadsnapshot); }
+
+static int lpb_savefile(lua_State *L, const char *filename, pb_Buffer *b) {
+    FILE *fp;
+    int ok;
+    if ((fp = fopen(filename, "wb")) == NULL)
+        return pb_bufflen(b) = 0, luaL_fileresult(L, 0, filename);
+    ok = fwrite(pb_buffer(b), 1, pb_bufflen(b), fp) == pb_bufflen(b);
+    ok = (fclose(fp) == 0) && ok;
+    pb_bufflen(b) = 0;
+    return luaL_fileresult(L, ok, filename);
+}
+
+static int Lpb_save_snapshot(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const char *filename = luaL_checkstring(L, 1);
+    pb_Buffer *b = &LS->buffer;
+    pb_bufflen(b) = 0;
+    if (lpbS_state(LS) == &LS->local) lpb_loadall(L, LS);
+    lpb_checkmem(L, pb_savesnapshot(lpbS_state(LS), b) == PB_OK);
+    return lpb_savefile(L, filename, b);
+}
+
+static int Lpb_save_image(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const char *filename = luaL_checkstring(L, 1);
+    const pb_State *S;
+    pb_Buffer *b = &LS->buffer;
+    pb_State frozen;
+    int r;
+    pb_bufflen(b) = 0;
+    if (lpbS_state(LS) == &LS->local) lpb_loadall(L, LS);
+    S = lpbS_state(LS);
+    pb_init(&frozen);
+    if (S->frozen != NULL || (r = pb_freeze(&frozen, S)) == PB_OK)
+        r = pb_saveimage(S->frozen != NULL ? S : &frozen, b);
+    pb_free(&frozen);
+    lpb_checkmem(L, r == PB_OK);
+    return lpb_savefile(L, filename, b);
 }
 
 static int lpb_pushtype(lua_State *L, const pb_Type *t) {
@@ -1254,7 +1686,7 @@ static int lpb_pushfield(lua_State *L, const pb_Type *t, const pb_Field *f) {
     lua_pushstring(L, f->type ?
             (const char*)f->type->name :
             pb_typename(f->type_id, "<unknown>"));
-    lua_pushstring(L, (const char*)f->default_value);
+    lua_pushstring(L, (const char*)pb_defaultvalue(t, f));
     lua_pushstring(L, f->repeated ?
             (f->packed ? "packed" : "repeated") :
             "optional");
@@ -1324,15 +1756,16 @@ static int Lpb_enum(lua_State *L) {
     return 1;
 }
 
-static int lpb_pushdeffield(lua_State *L, lpb_State *LS, const pb_Field *f, int is_proto3) {
-    int ret = 0, u = 0;
+static int lpb_pushdeffield(lua_State *L, lpb_State *LS, const pb_Type *t, const pb_Field *f, int is_proto3) {
+    int ret = 0, u = 0, kind;
     const pb_Type *type;
-    char *end;
+    const pb_Default *dv;
     if (f == NULL) return 0;
+    dv = pb_default(t, f);
     switch (f->type_id) {
     case PB_Tenum:
         if ((type = f ? f->type : NULL) == NULL) return 0;
-        if ((f = pb_fname(type, f->default_value)) != NULL)
+        if ((f = pb_fname(type, dv ? dv->text : NULL)) != NULL)
             ret = LS->enum_as_value ?
                 (lpb_pushinteger(L, f->number, 1, LS->int64_mode), 1) :
                 (lua_pushstring(L, (const char*)f->name), 1);
@@ -1341,27 +1774,27 @@ static int lpb_pushdeffield(lua_State *L, lpb_State *LS, const pb_Field *f, int
                 (lua_pushinteger(L, 0), 1) :
                 (lua_pushstring(L, (const char*)f->name), 1);
         break;
-    case PB_Tmessage:
-        ret = (lpb_pushtypetable(L, LS, f->type), 1);
+    case PB_Tmessage: /* converted ones are the value of an empty message */
+        if (f->type && !f->type->is_dead
+                && (kind = lpb_wktkind(L, LS, f->type)) != LPB_WNONE)
+            ret = (lpb_pushwktzero(L, LS, f->type, kind), 1);
+        else ret = (lpb_pushtypetable(L, LS, f->type), 1);
         break;
     case PB_Tbytes: case PB_Tstring:
-        if (f->default_value)
-            ret = (lua_pushstring(L, (const char*)f->default_value), 1);
+        if (dv)
+            ret = (lua_pushstring(L, (const char*)dv->text), 1);
         else if (is_proto3) ret = (lua_pushliteral(L, ""), 1);
         break;
     case PB_Tbool:
-        if (f->default_value) {
-            if (f->default_value == lpb_name(LS, pb_slice("true")))
-                ret = (lua_pushboolean(L, 1), 1);
-            else if (f->default_value == lpb_name(LS, pb_slice("false")))
-                ret = (lua_pushboolean(L, 0), 1);
+        if (dv) {
+            if (dv->is_valid)
+                ret = (lua_pushboolean(L, dv->value.i != 0), 1);
         } else if (is_proto3) ret = (lua_pushboolean(L, 0), 1);
         break;
     case PB_Tdouble: case PB_Tfloat:
-        if (f->default_value) {
-            lua_Number ln = (lua_Number)strtod((const char*)f->default_value, &end);
-            if ((const char*)f->default_value == end) return 0;
-            ret = (lua_pushnumber(L, ln), 1);
+        if (dv) {
+            if (dv->is_valid)
+                ret = (lua_pushnumber(L, (lua_Number)dv->value.d), 1);
         } else if (is_proto3) ret = (lua_pushnumber(L, 0.0), 1);
         break;
 
@@ -1369,21 +1802,26 @@ static int lpb_pushdeffield(lua_State *L, lpb_State *LS, const pb_Field *f, int
         u = 1;
         /* FALLTHROUGH */
     default:
-        if (f->default_value) {
-            lua_Integer li = (lua_Integer)strtol((const char*)f->default_value, &end, 10);
-            if ((const char*)f->default_value == end) return 0;
-            ret = (lpb_pushinteger(L, li, u, LS->int64_mode), 1);
+        if (dv) {
+            if (dv->is_valid)
+                ret = (lpb_pushinteger(L, dv->value.i, u, LS->int64_mode), 1);
         } else if (is_proto3) ret = (lua_pushinteger(L, 0), 1);
     }
     return ret;
 }
 
-static void lpb_fetchtable(lua_State *L, lpb_State *LS, const pb_Field *f, const pb_Type *t) {
-    if (lua53_getfield(L, -1, (const char*)f->name) == LUA_TNIL) {
+static void lpb_fetchtable(lua_State *L, lpb_State *LS, const pb_Field *f, const pb_Type *t, int size) {
+    /* read and written raw, so a table that the __index of a bound
+     * metatable shares is never filled; anything else is replaced */
+    lua_pushstring(L, (const char*)f->name);
+    lua_rawget(L, -2);
+    if (!lua_istable(L, -1)) {
         lua_pop(L, 1);
-        lua_newtable(L);
-        lua_pushvalue(L, -1);
-        lua_setfield(L, -3, (const char*)f->name);
+        if (t == &LS->map_type) lua_createtable(L, 0, size);
+        else lua_createtable(L, size, 0);
+        lua_pushstring(L, (const char*)f->name);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
     }
     if (t->is_dead) return;
     if (lua_getmetatable(L, -1))
@@ -1401,11 +1839,11 @@ static void lpb_setdeffields(lua_State *L, lpb_State *LS, const pb_Type *t, lpb_
             &LS->map_type : &LS->array_type;
         int has_field = f->repeated ?
             (flags & USE_REPEAT) && (t->is_proto3 || LS->decode_default_array)
-            && (lpb_fetchtable(L, LS, f, fetch_type), 1) :
+            && (lpb_fetchtable(L, LS, f, fetch_type, 0), 1) :
             !f->oneof_idx && (f->type_id != PB_Tmessage ?
                     (flags & USE_FIELD) :
                     (flags & USE_MESSAGE) && LS->decode_default_message)
-            && lpb_pushdeffield(L, LS, f, t->is_proto3);
+            && lpb_pushdeffield(L, LS, t, f, t->is_proto3);
         if (has_field) lua_setfield(L, -2, (const char*)f->name);
     }
 }
@@ -1414,7 +1852,7 @@ static void lpb_pushdefmeta(lua_State *L, lpb_State *LS, const pb_Type *t) {
     lpb_pushdeftable(L, LS);
     if (lua53_rawgetp(L, -1, t) != LUA_TTABLE) {
         lua_pop(L, 1);
-        lpb_newmsgtable(L, t);
+        lpb_newmsgtable(L, t, -1);
         lpb_setdeffields(L, LS, t, USE_FIELD);
         lua_pushvalue(L, -1);
         lua_setfield(L, -2, "__index");
@@ -1454,37 +1892,132 @@ static int Lpb_defaults(lua_State *L) {
     return 1;
 }
 
-static int Lpb_hook(lua_State *L) {
+static int lpb_warmtype(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    /* the table on top of stack holds the types already warmed up */
+    const pb_Field *f = NULL;
+    int count = 1;
+    if (t->is_enum || !t->is_defined) return 0;
+    if (lua53_rawgetp(L, -1, t) != LUA_TNIL) return lua_pop(L, 1), 0;
+    lua_pop(L, 1);
+    lua_pushboolean(L, 1);
+    lua_rawsetp(L, -2, t);
+    lpb_checkmem(L, t->field_count == 0 || pb_sortedfields(t) != NULL);
+    lpb_pushdefmeta(L, LS, t);
+    lua_pop(L, 1);
+    while (pb_nextfield(t, &f))
+        if (f->type) count += lpb_warmtype(L, LS, f->type);
+    return count;
+}
+
+static int Lpb_warmup(lua_State *L) {
     lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = NULL;
+    int i, count = 0;
+    if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    lua_newtable(L);
+    if (lua_isnil(L, 1)) {
+        if (lpbS_state(LS) == &LS->local) lpb_loadall(L, LS);
+        while (pb_nexttype(lpbS_state(LS), &t))
+            count += lpb_warmtype(L, LS, t);
+    } else for (i = 1; lua53_rawgeti(L, 1, i) != LUA_TNIL; ++i) {
+        argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1,
+                "type name expected at index %d", i);
+        t = lpb_type(L, LS, lpb_toslice(L, -1));
+        argcheck(L, t != NULL, 1, "type '%s' does not exists",
+                lua_tostring(L, -1));
+        lua_pop(L, 1);
+        count += lpb_warmtype(L, LS, t);
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+static int lpb_hook(lua_State *L, lpb_State *LS, int *pref) {
+    /* get or set the hook of a type in the hook table at *pref */
     const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
     int type = lua_type(L, 2);
     if (t == NULL) luaL_argerror(L, 1, "type not found");
     if (type != LUA_TNONE && type != LUA_TNIL && type != LUA_TFUNCTION)
         lpb_typeerror(L, 2, "function");
     lua_settop(L, 2);
-    lpb_pushdechooktable(L, LS);
+    *pref = lpb_reftable(L, *pref);
     lua_rawgetp(L, 3, t);
     if (type != LUA_TNONE) {
         lua_pushvalue(L, 2);
         lua_rawsetp(L, 3, t);
+        LS->hooks_stale = 1;
     }
     return 1;
 }
 
+static int Lpb_hook(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    return lpb_hook(L, LS, &LS->dec_hooks_index);
+}
+
+static int Lpb_batch_hook(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    return lpb_hook(L, LS, &LS->batch_hooks_index);
+}
+
 static int Lpb_encode_hook(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    return lpb_hook(L, LS, &LS->enc_hooks_index);
+}
+
+static int Lpb_bind(lua_State *L) {
     lpb_State *LS = lpb_lstate(L);
     const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
     int type = lua_type(L, 2);
+    lua_Integer size = luaL_optinteger(L, 3, -1);
     if (t == NULL) luaL_argerror(L, 1, "type not found");
-    if (type != LUA_TNONE && type != LUA_TNIL && type != LUA_TFUNCTION)
-        lpb_typeerror(L, 2, "function");
-    lua_settop(L, 2);
-    lpb_pushenchooktable(L, LS);
-    lua_rawgetp(L, 3, t);
+    argcheck(L, !t->is_enum && !t->is_map, 1, "message type expected");
+    if (type != LUA_TNONE && type != LUA_TNIL && type != LUA_TTABLE)
+        lpb_typeerror(L, 2, "table");
+    argcheck(L, size >= -1 && size <= INT_MAX, 3, "invalid size");
+    lua_settop(L, 3);
+    lpb_pushbindtable(L, LS);
+    if (lua53_rawgetp(L, 4, t) == LUA_TTABLE) {
+        lua_rawgeti(L, 5, 1);
+        lua_rawgeti(L, 5, 2);
+    } else lua_pushnil(L), lua_pushnil(L);
     if (type != LUA_TNONE) {
-        lua_pushvalue(L, 2);
-        lua_rawsetp(L, 3, t);
+        if (type == LUA_TNIL)
+            lua_pushnil(L);
+        else {
+            lua_createtable(L, 2, 0);
+            lua_pushvalue(L, 2);
+            lua_rawseti(L, -2, 1);
+            if (size >= 0) lua_pushinteger(L, size), lua_rawseti(L, -2, 2);
+        }
+        lua_rawsetp(L, 4, t);
+        LS->binds_stale = 1;
     }
+    return 2;
+}
+
+static int Lpb_wellknown(lua_State *L) {
+    static const char *const modes[] = { "number", "string", "value", NULL };
+    lpb_State *LS = lpb_lstate(L);
+    const char *name = luaL_checkstring(L, 1);
+    int i, kind = LPB_WNONE, mode;
+    for (i = 1; i < LPB_WCOUNT; ++i)
+        if (strcmp(name + (*name == '.'), lpb_wktnames[i]) == 0) kind = i;
+    argcheck(L, kind != LPB_WNONE, 1, "'%s' is not a converted well-known type",
+            name);
+    if ((mode = LS->wkt_modes[kind]) == LPB_WOFF) lua_pushnil(L);
+    else lua_pushstring(L, modes[mode - 1]);
+    if (lua_isnone(L, 2)) return 1;
+    mode = lua_toboolean(L, 2) ? luaL_checkoption(L, 2, NULL, modes) + 1
+                               : LPB_WOFF;
+    argcheck(L, mode == LPB_WOFF || (mode == LPB_WASVALUE)
+            == (kind != LPB_WTIMESTAMP && kind != LPB_WDURATION), 2,
+            "invalid mode '%s' for '%s'", lua_tostring(L, 2), name);
+    LS->wkt_modes[kind] = (unsigned char)mode;
+    for (LS->use_wkts = 0, i = 1; i < LPB_WCOUNT; ++i)
+        if (LS->wkt_modes[i] != LPB_WOFF) LS->use_wkts = 1;
+    LS->wkts_stale = 1;
     return 1;
 }
 
@@ -1492,14 +2025,25 @@ static int Lpb_clear(lua_State *L) {
     lpb_State *LS = lpb_lstate(L);
     pb_State *S = (pb_State*)LS->state;
     pb_Type *t;
+    int published;
+    lpbS_lock();
+    published = LS->shared != NULL && shared_state == LS->shared;
+    lpbS_unlock();
+    if (lua_isnoneornil(L, 1) && LS->shared != NULL && !published)
+        lpbS_newbox(L), lpbS_setshared(L, LS); /* drop a reloaded version */
+    lpbS_checkmutable(L, LS);
     if (lua_isnoneornil(L, 1)) {
-        pb_free(&LS->local), pb_init(&LS->local);
+        lpbS_freelocal(L, LS);
         luaL_unref(L, LUA_REGISTRYINDEX, LS->defs_index);
         LS->defs_index = LUA_NOREF;
         luaL_unref(L, LUA_REGISTRYINDEX, LS->enc_hooks_index);
         LS->enc_hooks_index = LUA_NOREF;
         luaL_unref(L, LUA_REGISTRYINDEX, LS->dec_hooks_index);
         LS->dec_hooks_index = LUA_NOREF;
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->batch_hooks_index);
+        LS->batch_hooks_index = LUA_NOREF;
+        luaL_unref(L, LUA_REGISTRYINDEX, LS->binds_index);
+        LS->binds_index = LUA_NOREF;
         return 0;
     }
     LS->state = &LS->local;
@@ -1508,6 +2052,250 @@ static int Lpb_clear(lua_State *L) {
     else pb_delfield(&LS->local, t, (pb_Field*)lpb_field(L, 2, t));
     LS->state = S;
     lpb_cleardefmeta(L, LS, t);
+    lpb_dropcache(L, LS);
+    return 0;
+}
+
+static const char *lpbS_validate(lua_State *L, const pb_State *S) {
+    const pb_Type *t = NULL;
+    while (pb_nexttype(S, &t)) {
+        const pb_Field *f = NULL;
+        while (!t->is_enum && pb_nextfield(t, &f))
+            if (f->type && (!f->type->is_defined
+                        || f->type->is_enum != (f->type_id == PB_Tenum)))
+                return lua_pushfstring(L,
+                        "type '%s' of field '%s.%s' is not defined",
+                        (const char*)f->type->name, (const char*)t->name,
+                        (const char*)f->name);
+    }
+    return NULL;
+}
+
+static void lpbS_filldefs(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    const pb_Field *f = NULL;
+    while (pb_nextfield(t, &f)) { /* keep values in table, add new fields */
+        const char *name = (const char*)f->name;
+        if (f->repeated || f->oneof_idx || f->type_id == PB_Tmessage)
+            continue;
+        if (lua53_getfield(L, -1, name) == LUA_TNIL
+                && lpb_pushdeffield(L, LS, t, f, t->is_proto3))
+            lua_setfield(L, -3, name);
+        lua_pop(L, 1);
+    }
+}
+
+static void lpbS_migrate(lua_State *L, lpb_State *LS, const pb_State *from, int ref, int isdef) {
+    const pb_Type *t = NULL;
+    if (ref == LUA_NOREF) return;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    while (pb_nexttype(from, &t)) {
+        const pb_Type *nt;
+        if (lua53_rawgetp(L, -1, t) == LUA_TNIL) { lua_pop(L, 1); continue; }
+        nt = pb_type(lpbS_state(LS),
+                pb_name(lpbS_state(LS), pb_slice((const char*)t->name), NULL));
+        if (nt != NULL && isdef && lua_istable(L, -1))
+            lpbS_filldefs(L, LS, nt);
+        if (nt != NULL) lua_rawsetp(L, -2, nt);
+        else lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawsetp(L, -2, t);
+    }
+    lua_pop(L, 1);
+}
+
+static int Lpb_reload(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_State *old = lpbS_state(LS);
+    int i, top = lua_gettop(L);
+    lpb_Shared **box;
+    for (i = 1; i <= top; ++i) lpb_checkslice(L, i);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LS->shared_ref); /* keep old version */
+    box = lpbS_newbox(L);
+    lpb_checkmem(L, (*box = (lpb_Shared*)calloc(1, sizeof(lpb_Shared))) != NULL);
+    pb_init(&(*box)->state), (*box)->refs = 1;
+    for (i = 1; i <= top; ++i) {
+        pb_Slice s = lpb_toslice(L, i);
+        if (pb_load(&(*box)->state, &s) != PB_OK) {
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L, "invalid schema at offset %d of chunk #%d",
+                    (int)pb_pos(s)+1, i);
+            return 2;
+        }
+    }
+    if (lpbS_validate(L, &(*box)->state) != NULL)
+        return lua_pushboolean(L, 0), lua_insert(L, -2), 2;
+    lpbS_freeze(L, &(*box)->state);
+    lpbS_lock();
+    if (LS->shared != NULL && shared_state == LS->shared)
+        shared_state = *box; /* republish */
+    lpbS_unlock();
+    lpbS_setshared(L, LS);
+    lpbS_migrate(L, LS, old, LS->enc_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->dec_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->batch_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->binds_index, 0);
+    lpbS_migrate(L, LS, old, LS->defs_index, 1);
+    lpbS_freelocal(L, LS); /* not used again, even by unsafe.detach() */
+    return lua_pushboolean(L, 1), 1;
+}
+
+static int Lpb_freeze(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_State *old;
+    lpb_Shared **box;
+    if (lpbS_state(LS) == &LS->local) lpb_loadall(L, LS);
+    old = lpbS_state(LS);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LS->shared_ref); /* keep old version */
+    box = lpbS_newbox(L);
+    lpb_checkmem(L, (*box = (lpb_Shared*)calloc(1, sizeof(lpb_Shared))) != NULL);
+    pb_init(&(*box)->state), (*box)->refs = 1;
+    lpb_checkmem(L, pb_freeze(&(*box)->state, old) == PB_OK);
+    lpbS_lock();
+    if (LS->shared != NULL && shared_state == LS->shared)
+        shared_state = *box; /* republish */
+    lpbS_unlock();
+    lpbS_setshared(L, LS);
+    lpbS_migrate(L, LS, old, LS->enc_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->dec_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->batch_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->binds_index, 0);
+    lpbS_migrate(L, LS, old, LS->defs_index, 1);
+    if (old == &LS->local) lpbS_freelocal(L, LS);
+    lua_pop(L, 1);
+    lpb_trim(); /* hand the pages of the old version back */
+    return 0;
+}
+
+static int lpb_openimage(const char *filename, lpb_Shared *SS) {
+    /* map the image at the address it was written from and use it in
+     * place, or move a copy elsewhere, -1 and errno if it can't be read */
+    lpb_File f;
+    const char *addr;
+    char *image;
+    size_t align, size;
+    int r;
+    if (!lpb_openfile(filename, &f)) return -1;
+    if ((r = pb_imageinfo(f.s, &addr, &align)) != PB_OK)
+        return lpb_closefile(&f), r;
+#ifndef LPB_NO_MMAP
+    if (f.map != NULL && f.map != (void*)addr) {
+        int fd = open(filename, O_RDONLY);
+        void *map = fd < 0 ? MAP_FAILED :
+            mmap((void*)addr, f.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0) close(fd);
+        if (map == (void*)addr) lpb_closefile(&f), f.map = map;
+        else if (map != MAP_FAILED) munmap(map, f.size);
+    }
+    if (f.map != NULL && f.map == (void*)addr) {
+        SS->map = f.map, SS->map_size = f.size;
+        return pb_useimage(&SS->state, addr, f.size);
+    }
+#endif
+    size = pb_len(f.s);
+    if ((SS->copy = malloc(size + align)) == NULL)
+        return lpb_closefile(&f), PB_ENOMEM;
+    image = (char*)SS->copy
+        + (((uintptr_t)addr - (uintptr_t)SS->copy) & (align - 1));
+    memcpy(image, f.s.p, size);
+    lpb_closefile(&f);
+    if ((r = pb_relocimage(image, size)) != PB_OK) return r;
+    return pb_useimage(&SS->state, image, size);
+}
+
+static int Lpb_load_image(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_State *old = lpbS_state(LS);
+    const char *filename = luaL_checkstring(L, 1);
+    lpb_Shared **box, *SS;
+    int r;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LS->shared_ref); /* keep old version */
+    box = lpbS_newbox(L);
+    lpb_checkmem(L, (*box = (lpb_Shared*)calloc(1, sizeof(lpb_Shared))) != NULL);
+    pb_init(&(*box)->state), (*box)->refs = 1;
+    SS = *box;
+    if ((r = lpb_openimage(filename, SS)) < 0)
+        return luaL_fileresult(L, 0, filename);
+    lpb_checkmem(L, r != PB_ENOMEM);
+    if (r != PB_OK) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: invalid schema image", filename);
+        return 2;
+    }
+    lpbS_lock();
+    if (LS->shared != NULL && shared_state == LS->shared)
+        shared_state = SS; /* republish */
+    lpbS_unlock();
+    lpbS_setshared(L, LS);
+    lpbS_migrate(L, LS, old, LS->enc_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->dec_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->batch_hooks_index, 0);
+    lpbS_migrate(L, LS, old, LS->binds_index, 0);
+    lpbS_migrate(L, LS, old, LS->defs_index, 1);
+    lpbS_freelocal(L, LS); /* replaced, like pb.reload() */
+    lua_pushboolean(L, 1);
+    lua_pushstring(L, SS->map != NULL ? "mapped" : "moved");
+    return 2;
+}
+
+static void lpb_dropstale(lua_State *L, int ref) {
+    /* drop entries of freed types, the set of kept types is on top */
+    if (ref == LUA_NOREF) return;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -4);
+        if (lua_isnil(L, -1)) {
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, -5);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static int Lpb_prune(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_State *S = LS->state;
+    const pb_Entry *e = NULL;
+    const pb_Type **roots;
+    int i, count;
+    lpbS_checkmutable(L, LS);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lpb_loadall(L, LS);
+    count = (int)lua_rawlen(L, 1);
+    roots = (const pb_Type**)lua_newuserdata(L,
+            (count ? count : 1) * sizeof(pb_Type*));
+    for (i = 0; i < count; ++i) {
+        lua_rawgeti(L, 1, i + 1);
+        argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1,
+                "type name expected at index %d", i + 1);
+        LS->state = &LS->local;
+        roots[i] = lpb_type(L, LS, lpb_toslice(L, -1));
+        LS->state = S;
+        argcheck(L, roots[i] != NULL, 1, "type '%s' does not exists",
+                lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    lpb_checkmem(L, pb_prune(&LS->local, roots, (size_t)count) == PB_OK);
+    ++LS->local_version;
+    lpb_dropcache(L, LS);
+    lpb_trim();
+    if (S != &LS->local) return 0; /* hooks are for types of another state */
+    lua_newtable(L);
+    while (pb_nextentry(&LS->local.types, &e)) {
+        lua_pushboolean(L, 1);
+        lua_rawsetp(L, -2, ((const pb_TypeEntry*)e)->value);
+    }
+    lua_pushboolean(L, 1), lua_rawsetp(L, -2, &LS->array_type);
+    lua_pushboolean(L, 1), lua_rawsetp(L, -2, &LS->map_type);
+    lpb_dropstale(L, LS->defs_index);
+    lpb_dropstale(L, LS->enc_hooks_index);
+    lpb_dropstale(L, LS->dec_hooks_index);
+    lpb_dropstale(L, LS->batch_hooks_index);
+    lpb_dropstale(L, LS->binds_index);
     return 0;
 }
 
@@ -1541,6 +2329,44 @@ static int Lpb_typefmt(lua_State *L) {
 
 /* protobuf encode */
 
+/* native message: wire data kept per field number, no Lua tables */
+
+typedef struct lpb_MsgEntry {
+    pb_Entry  entry;
+    pb_Buffer value; /* all occurrences of the field, tags included */
+} lpb_MsgEntry;
+
+typedef struct lpb_Message {
+    const pb_Type *t;
+    lpb_State *LS;
+    const pb_State *S; /* names of t live here */
+    int state_ref;
+    int shared_ref; /* schema version of t */
+    unsigned version; /* LS->local_version when t is a local type */
+    pb_Table fields;
+} lpb_Message;
+
+#define lpbM_isstale(m) ((m)->shared_ref == LUA_NOREF \
+        && (m)->version != (m)->LS->local_version)
+
+static void lpbM_addslice(lua_State *L, pb_Buffer *b, pb_Slice s)
+{ if (pb_len(s)) lpb_checkmem(L, pb_addslice(b, s)); }
+
+static void lpbM_writeto(lua_State *L, const lpb_Message *m, pb_Buffer *b) {
+    pb_Field **list = pb_sortedfields(m->t);
+    const pb_Entry *e = NULL;
+    unsigned i;
+    lpb_checkmem(L, list != NULL || m->t->field_count == 0);
+    for (i = 0; i < m->t->field_count; ++i) {
+        const lpb_MsgEntry *me = (const lpb_MsgEntry*)pb_gettable(
+                &m->fields, list[i]->number);
+        if (me != NULL) lpbM_addslice(L, b, pb_result(&me->value));
+    }
+    while (pb_nextentry(&m->fields, &e)) /* unknown fields */
+        if (pb_field(m->t, (int32_t)e->key) == NULL)
+            lpbM_addslice(L, b, pb_result(&((const lpb_MsgEntry*)e)->value));
+}
+
 typedef enum lpbE_Mode { lpbE_Raw, lpbE_NoZero, lpbE_Full } lpbE_Mode;
 
 typedef struct lpb_Env {
@@ -1568,63 +2394,583 @@ static void lpb_checktable(lua_State *L, int idx, const pb_Field *f) {
             (const char*)f->name, luaL_typename(L, idx));
 }
 
-static void lpb_useenchooks(lpb_Env *e, int idx, const pb_Type *t) {
-    lua_State *L = e->L;
-    lpb_pushenchooktable(L, e->LS);
-    if (lua53_rawgetp(L, -1, t) != LUA_TNIL) {
-        lua_pushvalue(L, lpb_relindex(idx, 2));
-        lua_call(L, 1, 1);
-        if (!lua_isnil(L, -1)) {
-            lua_pushvalue(L, -1);
-            lua_replace(L, lpb_relindex(idx, 3));
+#define lpbE_isobject(e,idx) \
+    ((e)->LS->encode_getters && lua_type((e)->L, (idx)) == LUA_TUSERDATA)
+
+/* well-known types converted in C, see Lpb_wellknown() */
+
+#define LPB_MINTIME     (-(int64_t)62135596*1000 - 800) /* 0001-01-01 */
+#define LPB_MAXTIME     ((int64_t)253402300*1000 + 799) /* 9999-12-31 */
+#define LPB_MAXDURATION ((int64_t)315576*1000000)       /* 10000 years */
+#define LPB_NANOS       1000000000
+
+#define lpb_isdigit(c)  ((c) >= '0' && (c) <= '9')
+
+static int lpb_wktkind(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    /* the lpb_WktKind that values of t are converted as */
+    const lpb_WktEntry *we;
+    if (!LS->use_wkts) return LPB_WNONE;
+    if (LS->wkts_stale) {
+        int kind;
+        pb_freetable(&LS->wkts);
+        for (kind = 1; kind < LPB_WCOUNT; ++kind) {
+            const pb_Type *wt;
+            lpb_WktEntry *ne;
+            if (LS->wkt_modes[kind] == LPB_WOFF) continue;
+            wt = lpb_type(L, LS, pb_slice(lpb_wktnames[kind]));
+            if (wt == NULL || !wt->is_defined) continue;
+            ne = (lpb_WktEntry*)pb_settable(&LS->wkts, (pb_Key)wt);
+            lpb_checkmem(L, ne != NULL);
+            ne->kind = kind;
         }
+        LS->wkts_stale = 0;
     }
-    lua_pop(L, 2);
+    we = (const lpb_WktEntry*)pb_gettable(&LS->wkts, (pb_Key)t);
+    return we ? we->kind : LPB_WNONE;
+}
+
+static int64_t lpb_daysfromcivil(int y, int m, int d) {
+    /* days since 1970-01-01 of a proleptic Gregorian date */
+    int era, yoe, doy;
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    return (int64_t)era * 146097 + yoe * 365 + yoe/4 - yoe/100 + doy - 719468;
+}
+
+static void lpb_civilfromdays(int64_t z, int *py, int *pm, int *pd) {
+    int64_t era;
+    int doe, yoe, doy, mp;
+    z += 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = (int)(z - era * 146097);
+    yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    doy = doe - (365*yoe + yoe/4 - yoe/100);
+    mp = (5*doy + 2) / 153;
+    *pd = doy - (153*mp + 2)/5 + 1;
+    *pm = mp < 10 ? mp + 3 : mp - 9;
+    *py = (int)(yoe + era * 400) + (*pm <= 2);
+}
+
+static char *lpb_putdigits(char *p, unsigned v, int width) {
+    int i;
+    for (i = width; i > 0; --i, v /= 10)
+        p[i-1] = (char)('0' + v % 10);
+    return p + width;
 }
 
-static uint64_t lpbE_readenum(lpb_Env *e, int idx, const pb_Field *f) {
-    lua_State *L = e->L;
-    int type = lua_type(L, idx);
-    if (type == LUA_TNUMBER) return (uint64_t)lua_tonumber(L, idx);
-    if (type == LUA_TSTRING) {
-        size_t len;
-        const char *s = lua_tolstring(L, idx, &len);
-        const pb_Field *ev = pb_fname(f->type,
-                lpb_name(e->LS, pb_lslice(s, len)));
-        uint64_t v;
-        if (ev != NULL) return (uint64_t)ev->number;
-        v = lpb_tointegerx(L, idx, &type);
-        if (!type) argcheck(L, 0, 2,
-                "can not encode unknown enum '%s' at field '%s'",
-                lua_tostring(L, -1), (const char*)f->name);
-        return v;
+static char *lpb_putnanos(char *p, unsigned nanos) {
+    /* 0, 3, 6 or 9 digits, like the JSON mapping of protobuf */
+    int width = 9;
+    if (nanos == 0) return p;
+    for (; nanos % 1000 == 0; width -= 3) nanos /= 1000;
+    *p = '.';
+    return lpb_putdigits(p + 1, nanos, width);
+}
+
+static int lpb_getdigits(const char **ps, int width, int *pv) {
+    const char *s = *ps;
+    int i;
+    for (*pv = 0, i = 0; i < width; ++i) {
+        if (!lpb_isdigit(s[i])) return 0;
+        *pv = *pv * 10 + (s[i] - '0');
     }
-    return argcheck(L, 0, 2, "number/string expected at enum field '%s', got %s",
-            (const char*)f->name, luaL_typename(L, idx));
+    return *ps = s + width, 1;
 }
 
-static void lpbE_field(lpb_Env *e, int idx, const pb_Field *f, lpbE_Mode m) {
-    lua_State *L = e->L;
-    size_t oldlen, len;
-    lpb_Value v;
-    int r;
-    switch (f->type_id) {
-    case PB_Tenum:
-        if (e->LS->use_enc_hooks) lpb_useenchooks(e, idx, f->type);
-        v.u64 = lpbE_readenum(e, idx, f);
-        if (m == lpbE_NoZero && v.u64 == 0) return;
+static int lpb_getnanos(const char **ps, int32_t *pnanos) {
+    const char *s = *ps;
+    int i;
+    *pnanos = 0;
+    if (*s != '.') return 1;
+    for (++s, i = 0; i < 9 && lpb_isdigit(*s); ++i, ++s)
+        *pnanos = *pnanos * 10 + (*s - '0');
+    if (i == 0 || lpb_isdigit(*s)) return 0;
+    for (; i < 9; ++i) *pnanos *= 10;
+    return *ps = s, 1;
+}
+
+static void lpb_pushtimestamp(lua_State *L, int64_t sec, int32_t nanos) {
+    /* as RFC 3339 in UTC, "1970-01-01T00:00:00Z" */
+    char buff[32], *p = buff;
+    int64_t days = sec / 86400;
+    int rem = (int)(sec % 86400), y, m, d;
+    if (rem < 0) rem += 86400, --days;
+    if (sec < LPB_MINTIME || sec > LPB_MAXTIME
+            || nanos < 0 || nanos >= LPB_NANOS)
+        luaL_error(L, "timestamp out of range");
+    lpb_civilfromdays(days, &y, &m, &d);
+    p = lpb_putdigits(p, (unsigned)y, 4), *p++ = '-';
+    p = lpb_putdigits(p, (unsigned)m, 2), *p++ = '-';
+    p = lpb_putdigits(p, (unsigned)d, 2), *p++ = 'T';
+    p = lpb_putdigits(p, (unsigned)rem / 3600, 2), *p++ = ':';
+    p = lpb_putdigits(p, (unsigned)rem / 60 % 60, 2), *p++ = ':';
+    p = lpb_putdigits(p, (unsigned)rem % 60, 2);
+    p = lpb_putnanos(p, (unsigned)nanos), *p++ = 'Z';
+    lua_pushlstring(L, buff, p - buff);
+}
+
+static int lpb_totimestamp(const char *s, int64_t *psec, int32_t *pnanos) {
+    static const char mdays[] = { 31,28,31,30,31,30,31,31,30,31,30,31 };
+    int y, mo, d, h, mi, sec, oh = 0, om = 0, sign = 0;
+    if (!lpb_getdigits(&s, 4, &y) || *s++ != '-'
+            || !lpb_getdigits(&s, 2, &mo) || *s++ != '-'
+            || !lpb_getdigits(&s, 2, &d)
+            || (*s != 'T' && *s != 't' && *s != ' ')
+            || (++s, !lpb_getdigits(&s, 2, &h)) || *s++ != ':'
+            || !lpb_getdigits(&s, 2, &mi) || *s++ != ':'
+            || !lpb_getdigits(&s, 2, &sec) || !lpb_getnanos(&s, pnanos))
+        return 0;
+    if (*s == 'Z' || *s == 'z')
+        ++s;
+    else if (*s == '+' || *s == '-') {
+        sign = *s++ == '-' ? -1 : 1;
+        if (!lpb_getdigits(&s, 2, &oh) || *s++ != ':'
+                || !lpb_getdigits(&s, 2, &om) || oh > 23 || om > 59)
+            return 0;
+    } else return 0;
+    if (*s != '\0' || mo < 1 || mo > 12 || d < 1 || h > 23 || mi > 59
+            || sec > 59 || d > mdays[mo-1] + (mo == 2 && y % 4 == 0
+                && (y % 100 != 0 || y % 400 == 0)))
+        return 0;
+    *psec = lpb_daysfromcivil(y, mo, d) * 86400 + h*3600 + mi*60 + sec
+        - sign * (oh*3600 + om*60);
+    return *psec >= LPB_MINTIME && *psec <= LPB_MAXTIME;
+}
+
+static void lpb_pushduration(lua_State *L, int64_t sec, int32_t nanos) {
+    /* as "-1.5s", seconds and nanos have the same sign */
+    char buff[40], *p = buff + 20, *end;
+    int neg = sec < 0 || nanos < 0;
+    uint64_t usec = sec < 0 ? ~(uint64_t)sec + 1 : (uint64_t)sec;
+    if (usec > (uint64_t)LPB_MAXDURATION || nanos <= -LPB_NANOS
+            || nanos >= LPB_NANOS || (sec < 0 && nanos > 0)
+            || (sec > 0 && nanos < 0))
+        luaL_error(L, "duration out of range");
+    end = lpb_putnanos(p, (unsigned)(nanos < 0 ? -nanos : nanos));
+    *end++ = 's';
+    do *--p = (char)('0' + usec % 10); while ((usec /= 10) != 0);
+    if (neg) *--p = '-';
+    lua_pushlstring(L, p, end - p);
+}
+
+static int lpb_toduration(const char *s, int64_t *psec, int32_t *pnanos) {
+    int neg = *s == '-', n = 0;
+    int64_t sec = 0;
+    for (s += neg; lpb_isdigit(*s) && n < 12; ++s, ++n)
+        sec = sec * 10 + (*s - '0');
+    if (n == 0 || !lpb_getnanos(&s, pnanos) || *s != 's' || s[1] != '\0'
+            || sec > LPB_MAXDURATION)
+        return 0;
+    if (neg) sec = -sec, *pnanos = -*pnanos;
+    return *psec = sec, 1;
+}
+
+static void lpb_numbertotime(lua_State *L, int idx, int kind, int64_t *psec, int32_t *pnanos) {
+    lua_Number n, fl;
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, idx)) {
+        *psec = (int64_t)lua_tointeger(L, idx), *pnanos = 0;
+        return;
+    }
+#endif
+    n = lua_tonumber(L, idx);
+    if (!(n > (lua_Number)INT64_MIN && n < (lua_Number)INT64_MAX))
+        luaL_error(L, "number has no integer representation");
+    if ((fl = (lua_Number)(int64_t)n) > n) fl -= 1;
+    *psec = (int64_t)fl;
+    *pnanos = (int32_t)((n - fl) * LPB_NANOS + 0.5);
+    if (*pnanos >= LPB_NANOS) ++*psec, *pnanos -= LPB_NANOS;
+    if (kind == LPB_WDURATION && *psec < 0 && *pnanos > 0)
+        ++*psec, *pnanos -= LPB_NANOS;
+}
+
+static void lpbD_time(lpb_Env *e, int kind, pb_Slice s) {
+    lua_State *L = e->L;
+    uint64_t sec = 0, nanos = 0, *pv;
+    uint32_t tag;
+    while (pb_readvarint32(&s, &tag)) {
+        if (tag == pb_pair(1, PB_TVARINT)) pv = &sec;
+        else if (tag == pb_pair(2, PB_TVARINT)) pv = &nanos;
+        else { pb_skipvalue(&s, tag); continue; }
+        if (pb_readvarint64(&s, pv) == 0)
+            luaL_error(L, "invalid varint value at offset %d", pb_pos(s)+1);
+    }
+    if (e->LS->wkt_modes[kind] == LPB_WASSTRING) {
+        if (kind == LPB_WTIMESTAMP)
+            lpb_pushtimestamp(L, (int64_t)sec, (int32_t)nanos);
+        else lpb_pushduration(L, (int64_t)sec, (int32_t)nanos);
+    } else if ((int32_t)nanos == 0)
+        lpb_pushinteger(L, (int64_t)sec, 0, LPB_NUMBER);
+    else
+        lua_pushnumber(L, (lua_Number)(int64_t)sec
+                + (lua_Number)(int32_t)nanos / LPB_NANOS);
+}
+
+static void lpbD_wrapper(lpb_Env *e, const pb_Type *t, pb_Slice s) {
+    /* the value field of a wrapper, a zero value if absent */
+    lua_State *L = e->L;
+    const pb_Field *f = pb_field(t, 1);
+    uint32_t tag;
+    if (!lpb_pushdeffield(L, e->LS, t, f, 1)) lua_pushnil(L);
+    while (pb_readvarint32(&s, &tag)) {
+        if (f == NULL || tag != pb_pair(1, pb_wtypebytype(f->type_id)))
+            pb_skipvalue(&s, tag);
+        else
+            lpb_pushvalue(L, e->LS, f->type_id, &s), lua_replace(L, -2);
+    }
+}
+
+static void lpbD_list(lpb_Env *e, pb_Slice s);
+static void lpbD_struct(lpb_Env *e, pb_Slice s);
+
+static void lpbD_value(lpb_Env *e, pb_Slice s) {
+    /* google.protobuf.Value as a Lua value, pb.null if no kind is set */
+    lua_State *L = e->L;
+    pb_Slice v;
+    uint64_t u64;
+    uint32_t tag;
+    lua_pushlightuserdata(L, NULL);
+    while (pb_readvarint32(&s, &tag)) {
+        switch (tag) {
+        case pb_pair(1, PB_TVARINT): case pb_pair(4, PB_TVARINT):
+            if (pb_readvarint64(&s, &u64) == 0)
+                luaL_error(L, "invalid varint value at offset %d", pb_pos(s)+1);
+            if (tag == pb_pair(1, PB_TVARINT)) lua_pushlightuserdata(L, NULL);
+            else lua_pushboolean(L, u64 != 0);
+            break;
+        case pb_pair(2, PB_T64BIT):
+            if (pb_readfixed64(&s, &u64) == 0)
+                luaL_error(L, "invalid fixed64 value at offset %d", pb_pos(s)+1);
+            lua_pushnumber(L, pb_decode_double(u64));
+            break;
+        case pb_pair(3, PB_TBYTES):
+            lpb_readbytes(L, &s, &v), push_slice(L, v);
+            break;
+        case pb_pair(5, PB_TBYTES):
+            lpb_readbytes(L, &s, &v), lpbD_struct(e, v);
+            break;
+        case pb_pair(6, PB_TBYTES):
+            lpb_readbytes(L, &s, &v), lpbD_list(e, v);
+            break;
+        default:
+            pb_skipvalue(&s, tag);
+            continue;
+        }
+        lua_replace(L, -2); /* last one wins */
+    }
+}
+
+static void lpbD_struct(lpb_Env *e, pb_Slice s) {
+    lua_State *L = e->L;
+    pb_Slice entry, v;
+    uint32_t tag;
+    luaL_checkstack(L, 5, "too many levels");
+    lua_newtable(L);
+    while (pb_readvarint32(&s, &tag)) {
+        if (tag != pb_pair(1, PB_TBYTES)) {
+            pb_skipvalue(&s, tag);
+            continue;
+        }
+        lpb_readbytes(L, &s, &entry);
+        lua_pushliteral(L, "");
+        lua_pushlightuserdata(L, NULL);
+        while (pb_readvarint32(&entry, &tag)) {
+            if (tag == pb_pair(1, PB_TBYTES))
+                lpb_readbytes(L, &entry, &v), push_slice(L, v), lua_replace(L, -3);
+            else if (tag == pb_pair(2, PB_TBYTES))
+                lpb_readbytes(L, &entry, &v), lpbD_value(e, v), lua_replace(L, -2);
+            else
+                pb_skipvalue(&entry, tag);
+        }
+        lua_rawset(L, -3);
+    }
+}
+
+static void lpbD_list(lpb_Env *e, pb_Slice s) {
+    lua_State *L = e->L;
+    pb_Slice v;
+    uint32_t tag;
+    int len = 0;
+    luaL_checkstack(L, 5, "too many levels");
+    lua_newtable(L);
+    while (pb_readvarint32(&s, &tag)) {
+        if (tag != pb_pair(1, PB_TBYTES)) {
+            pb_skipvalue(&s, tag);
+            continue;
+        }
+        lpb_readbytes(L, &s, &v);
+        lpbD_value(e, v);
+        lua_rawseti(L, -2, ++len);
+    }
+}
+
+static void lpbD_wkt(lpb_Env *e, const pb_Type *t, int kind, pb_Slice s) {
+    /* push the message of t at s converted to a Lua value */
+    switch (kind) {
+    case LPB_WTIMESTAMP: case LPB_WDURATION: lpbD_time(e, kind, s); break;
+    case LPB_WSTRUCT: lpbD_struct(e, s); break;
+    case LPB_WVALUE:  lpbD_value(e, s); break;
+    case LPB_WLIST:   lpbD_list(e, s); break;
+    default:          lpbD_wrapper(e, t, s);
+    }
+}
+
+static void lpb_pushwktzero(lua_State *L, lpb_State *LS, const pb_Type *t, int kind) {
+    lpb_Env e;
+    e.L = L, e.LS = LS, e.b = NULL, e.s = NULL;
+    lpbD_wkt(&e, t, kind, pb_lslice(NULL, 0));
+}
+
+static size_t lpbE_begin(lpb_Env *e, int number) {
+    /* write the tag of a length delimited field, see lpbE_end() */
+    lpb_checkmem(e->L, pb_addvarint32(e->b, pb_pair(number, PB_TBYTES)));
+    lpb_checkmem(e->L, pb_addvarint32(e->b, 0));
+    return pb_bufflen(e->b);
+}
+
+static void lpbE_end(lpb_Env *e, size_t len)
+{ lpb_checkmem(e->L, pb_addlength(e->b, len, 1)); }
+
+static void lpbE_value(lpb_Env *e, int idx);
+
+static void lpbE_struct(lpb_Env *e, int idx) {
+    lua_State *L = e->L;
+    luaL_checkstack(L, 5, "message too many levels");
+    lua_pushnil(L);
+    while (lua_next(L, lpb_relindex(idx, 1))) {
+        size_t len, vlen;
+        argcheck(L, lua_type(L, -2) == LUA_TSTRING, 2,
+                "string key expected for google.protobuf.Struct, got %s",
+                luaL_typename(L, -2));
+        len = lpbE_begin(e, 1);
+        lpb_checkmem(L, pb_addvarint32(e->b, pb_pair(1, PB_TBYTES)));
+        lpb_checkmem(L, pb_addbytes(e->b, lpb_toslice(L, -2)));
+        vlen = lpbE_begin(e, 2);
+        lpbE_value(e, -1);
+        lpbE_end(e, vlen);
+        lpbE_end(e, len);
+        lua_pop(L, 1);
+    }
+}
+
+static void lpbE_list(lpb_Env *e, int idx) {
+    lua_State *L = e->L;
+    int i;
+    luaL_checkstack(L, 5, "message too many levels");
+    for (i = 1; lua53_rawgeti(L, idx, i) != LUA_TNIL; ++i) {
+        size_t len = lpbE_begin(e, 1);
+        lpbE_value(e, -1);
+        lpbE_end(e, len);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static void lpbE_value(lpb_Env *e, int idx) {
+    /* a Lua value as google.protobuf.Value, tables with an array part
+     * are lists and other tables are structs */
+    lua_State *L = e->L;
+    pb_Buffer *b = e->b;
+    size_t len;
+    switch (lua_type(L, idx)) {
+    case LUA_TLIGHTUSERDATA:
+        if (lua_touserdata(L, idx) != NULL) break;
+        lpb_checkmem(L, pb_addvarint32(b, pb_pair(1, PB_TVARINT)));
+        lpb_checkmem(L, pb_addvarint32(b, 0));
+        return;
+    case LUA_TBOOLEAN:
+        lpb_checkmem(L, pb_addvarint32(b, pb_pair(4, PB_TVARINT)));
+        lpb_checkmem(L, pb_addvarint32(b, lua_toboolean(L, idx)));
+        return;
+    case LUA_TNUMBER:
+        lpb_checkmem(L, pb_addvarint32(b, pb_pair(2, PB_T64BIT)));
+        lpb_checkmem(L, pb_addfixed64(b,
+                    pb_encode_double((double)lua_tonumber(L, idx))));
+        return;
+    case LUA_TSTRING:
+        lpb_checkmem(L, pb_addvarint32(b, pb_pair(3, PB_TBYTES)));
+        lpb_checkmem(L, pb_addbytes(b, lpb_toslice(L, idx)));
+        return;
+    case LUA_TTABLE:
+        if (lua_rawlen(L, idx) > 0)
+            len = lpbE_begin(e, 6), lpbE_list(e, idx);
+        else
+            len = lpbE_begin(e, 5), lpbE_struct(e, idx);
+        lpbE_end(e, len);
+        return;
+    }
+    argcheck(L, 0, 2, "can not encode %s as google.protobuf.Value",
+            luaL_typename(L, idx));
+}
+
+static void lpbE_time(lpb_Env *e, int idx, const pb_Field *f, int kind) {
+    lua_State *L = e->L;
+    int64_t sec = 0;
+    int32_t nanos = 0;
+    int type = lua_type(L, idx);
+    if (type == LUA_TNUMBER)
+        lpb_numbertotime(L, idx, kind, &sec, &nanos);
+    else if (type != LUA_TSTRING)
+        argcheck(L, 0, 2, "number/string expected for field '%s', got %s",
+                (const char*)f->name, luaL_typename(L, idx));
+    else if (!(kind == LPB_WTIMESTAMP ?
+                lpb_totimestamp(lua_tostring(L, idx), &sec, &nanos) :
+                lpb_toduration(lua_tostring(L, idx), &sec, &nanos)))
+        argcheck(L, 0, 2, "invalid %s '%s' for field '%s'",
+                lpb_wktnames[kind] + 16, lua_tostring(L, idx),
+                (const char*)f->name);
+    if (sec != 0) {
+        lpb_checkmem(L, pb_addvarint32(e->b, pb_pair(1, PB_TVARINT)));
+        lpb_checkmem(L, pb_addvarint64(e->b, (uint64_t)sec));
+    }
+    if (nanos != 0) {
+        lpb_checkmem(L, pb_addvarint32(e->b, pb_pair(2, PB_TVARINT)));
+        lpb_checkmem(L, pb_addvarint64(e->b, (uint64_t)(int64_t)nanos));
+    }
+}
+
+static void lpbE_wrapper(lpb_Env *e, int idx, const pb_Field *f, const pb_Type *t) {
+    lua_State *L = e->L;
+    const pb_Field *vf = pb_field(t, 1);
+    lpb_Value v;
+    int r;
+    if (vf == NULL) return;
+    r = lpb_readvalue(L, idx, vf->type_id, &v);
+    if (r < 0) argcheck(L, 0, 2, "%s expected for field '%s', got %s",
+            lpb_expected(vf->type_id),
+            (const char*)f->name, luaL_typename(L, idx));
+    if (r == 0) return;
+    lpbE_writetag(e, vf);
+    lpb_checkmem(L, lpb_writevalue(e->b, vf->type_id, v));
+}
+
+static int lpbE_wktkind(lpb_Env *e, int idx, const pb_Type *t) {
+    /* like lpb_wktkind(), but tables of times and wrappers are messages */
+    int kind = lpb_wktkind(e->L, e->LS, t);
+    return kind < LPB_WSTRUCT && lua_istable(e->L, idx) ? LPB_WNONE : kind;
+}
+
+static void lpbE_wkt(lpb_Env *e, int idx, const pb_Field *f, int kind) {
+    /* encode the Lua value at idx as the message of f */
+    switch (kind) {
+    case LPB_WTIMESTAMP: case LPB_WDURATION: lpbE_time(e, idx, f, kind); break;
+    case LPB_WSTRUCT:
+        lpb_checktable(e->L, idx, f);
+        lpbE_struct(e, idx);
+        break;
+    case LPB_WVALUE: lpbE_value(e, idx); break;
+    case LPB_WLIST:
+        lpb_checktable(e->L, idx, f);
+        lpbE_list(e, idx);
+        break;
+    default: lpbE_wrapper(e, idx, f, f->type);
+    }
+}
+
+static void lpb_useenchooks(lpb_Env *e, int idx, const pb_Type *t) {
+    lua_State *L = e->L;
+    lpbS_pushpin(L, e->LS); /* a hook may reload the schema */
+    lpb_pushenchooktable(L, e->LS);
+    if (lua53_rawgetp(L, -1, t) != LUA_TNIL) {
+        lua_pushvalue(L, lpb_relindex(idx, 3));
+        lua_call(L, 1, 1);
+        if (!lua_isnil(L, -1)) {
+            lua_pushvalue(L, -1);
+            lua_replace(L, lpb_relindex(idx, 4));
+        }
+    }
+    lua_pop(L, 3);
+}
+
+static void lpb_pushenum(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    /* the names of enum t as { [number] = name }, with the name pb_field()
+     * finds for a number; repeated enums are decoded with it to skip the
+     * lookup in the schema and the interning of the name */
+    pb_Field **list;
+    unsigned i, narr = 0;
+    LS->enums_index = lpb_reftable(L, LS->enums_index);
+    if (lua53_rawgetp(L, -1, t) == LUA_TTABLE) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+    list = pb_sortedfields(t);
+    lpb_checkmem(L, t->field_count == 0 || list != NULL);
+    for (i = 0; i < t->field_count; ++i) /* dense values go to array part */
+        narr += list[i]->number > 0
+            && (unsigned)list[i]->number <= t->field_count;
+    lua_createtable(L, (int)narr, (int)(t->field_count - narr));
+    for (i = 0; i < t->field_count; ++i) {
+        const pb_Field *f = list[i];
+        if (pb_field(t, f->number) != f) continue; /* alias */
+        lua_pushstring(L, (const char*)f->name);
+        lua_rawseti(L, -2, f->number);
+    }
+    if (t->is_defined) { /* placeholders may be defined later */
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, -3, t);
+    }
+    lua_remove(L, -2);
+}
+
+static uint64_t lpbE_readenum(lpb_Env *e, int idx, const pb_Field *f) {
+    lua_State *L = e->L;
+    int type = lua_type(L, idx);
+    if (type == LUA_TNUMBER) return (uint64_t)lua_tonumber(L, idx);
+    if (type == LUA_TSTRING) {
+        size_t len;
+        const char *s = lua_tolstring(L, idx, &len);
+        const pb_Field *ev = pb_fname(f->type,
+                lpb_name(e->LS, pb_lslice(s, len)));
+        uint64_t v;
+        if (ev != NULL) return (uint64_t)ev->number;
+        v = lpb_tointegerx(L, idx, &type);
+        if (!type) argcheck(L, 0, 2,
+                "can not encode unknown enum '%s' at field '%s'",
+                lua_tostring(L, -1), (const char*)f->name);
+        return v;
+    }
+    return argcheck(L, 0, 2, "number/string expected at enum field '%s', got %s",
+            (const char*)f->name, luaL_typename(L, idx));
+}
+
+static void lpbE_field(lpb_Env *e, int idx, const pb_Field *f, lpbE_Mode m) {
+    lua_State *L = e->L;
+    const lpb_Message *msg;
+    size_t oldlen, len;
+    lpb_Value v;
+    int r, kind = LPB_WNONE;
+    switch (f->type_id) {
+    case PB_Tenum:
+        if (e->LS->use_enc_hooks) lpb_useenchooks(e, idx, f->type);
+        v.u64 = lpbE_readenum(e, idx, f);
+        if (m == lpbE_NoZero && v.u64 == 0) return;
         else if (m != lpbE_Raw) lpbE_writetag(e, f);
         len = pb_addvarint64(e->b, v.u64);
         break;
     case PB_Tmessage:
         if (e->LS->use_enc_hooks) lpb_useenchooks(e, idx, f->type);
-        lpb_checktable(L, idx, f);
+        if ((msg = test_message(L, idx)) == NULL
+                && (kind = lpbE_wktkind(e, idx, f->type)) == LPB_WNONE
+                && !lpbE_isobject(e, idx))
+            lpb_checktable(L, idx, f);
+        else if (msg) argcheck(L, !lpbM_isstale(msg), 2,
+                "message for field '%s' is stale, its types were freed",
+                (const char*)f->name);
+        if (msg) argcheck(L, msg->t == f->type, 2,
+                "message '%s' expected for field '%s', got '%s'",
+                f->type ? (const char*)f->type->name : "?",
+                (const char*)f->name, (const char*)msg->t->name);
         oldlen = pb_bufflen(e->b);
         assert(m != lpbE_Raw);
         lpbE_writetag(e, f);
         lpb_checkmem(L, pb_addvarint32(e->b, 0));
         len = pb_bufflen(e->b); /* len != 0 because tag written */
-        lpbE_encode(e, idx, f->type);
+        if (msg) lpbM_writeto(L, msg, e->b);
+        else if (kind) lpbE_wkt(e, idx, f, kind);
+        else lpbE_encode(e, idx, f->type);
         if (m == lpbE_NoZero && len == pb_bufflen(e->b))
             pb_bufflen(e->b) = oldlen;
         else
@@ -1693,14 +3039,49 @@ static void lpb_encode_onefield(lpb_Env *e, int idx, const pb_Type *t, const pb_
         lpbE_field(e, idx, f, lpbE_ignorezero(e, t, f) ? lpbE_NoZero : lpbE_Full);
 }
 
+typedef enum {LPB_NEXT, LPB_RAW, LPB_INDEX} lpb_ReadMode;
+
+static int lpbE_readmode(lpb_Env *e, int idx, const pb_Type *t) {
+    /* how the fields of the message at idx are read: with lua_next()
+     * (LPB_NEXT), or by the fields of t, raw (LPB_RAW) or through __index
+     * (LPB_INDEX); objects of bound types hold their fields raw, what
+     * their metatable adds is never encoded */
+    lua_State *L = e->L;
+    int mode = LPB_NEXT;
+    if (lua_type(L, idx) != LUA_TTABLE)
+        return LPB_INDEX; /* userdata, see encode_getters */
+    if (e->LS->encode_order)
+        return lpb_bound(L, e->LS, t) ? LPB_RAW : LPB_INDEX;
+    if (!e->LS->encode_getters || !lua_getmetatable(L, idx))
+        return LPB_NEXT;
+    lua_pushliteral(L, "__index");
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1) && !lpb_bound(L, e->LS, t)) {
+        /* not for the default metatable, defaults are not fields */
+        lpb_pushdeftable(L, e->LS);
+        lua53_rawgetp(L, -1, t);
+        if (!lua_rawequal(L, -1, -4)) mode = LPB_INDEX;
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 2);
+    return mode;
+}
+
 static void lpbE_encode(lpb_Env *e, int idx, const pb_Type *t) {
     lua_State *L = e->L;
+    int mode;
     luaL_checkstack(L, 5, "message too many levels");
-    if (e->LS->encode_order) {
+    if ((mode = lpbE_readmode(e, idx, t)) != LPB_NEXT) {
+        int raw = mode == LPB_RAW;
         const pb_Field *f = NULL;
         while (pb_nextfield(t, &f)) {
-            if (lua53_getfield(L, idx, (const char*)f->name) != LUA_TNIL)
-                lpb_encode_onefield(e, -1, t, f);
+            if (!raw)
+                lua_getfield(L, idx, (const char*)f->name);
+            else {
+                lua_pushstring(L, (const char*)f->name);
+                lua_rawget(L, lpb_relindex(idx, 1));
+            }
+            if (!lua_isnil(L, -1)) lpb_encode_onefield(e, -1, t, f);
             lua_pop(L, 1);
         }
     } else {
@@ -1734,18 +3115,23 @@ static void lpb_pushbuffer(lua_State *L, pb_Buffer *B) {
 }
 #endif
 
+static int lpbE_encodeto(lua_State *L, lpb_State *LS, const pb_Type *t, int idx) {
+    /* encode the table at idx, into the buffer at idx+1 if any */
+    lpb_Env e;
+    e.L = L, e.LS = LS, e.b = test_buffer(L, idx+1);
+    if (!lpbE_isobject(&e, idx)) luaL_checktype(L, idx, LUA_TTABLE);
+    if (e.b == NULL) e.b = &LS->buffer, pb_resetbuffer(e.b);
+    if (e.LS->use_enc_hooks) lpb_useenchooks(&e, idx, t);
+    lpbE_encode(&e, idx, t);
+    if (e.b != &LS->buffer) return lua_settop(L, idx+1), 1;
+    return lpb_pushbuffer(L, &LS->buffer), 1;
+}
+
 static int Lpb_encode(lua_State *L) {
     lpb_State *LS = lpb_lstate(L);
     const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
-    lpb_Env e;
     argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
-    luaL_checktype(L, 2, LUA_TTABLE);
-    e.L = L, e.LS = LS, e.b = test_buffer(L, 3);
-    if (e.b == NULL) e.b = &LS->buffer, pb_resetbuffer(e.b);
-    if (e.LS->use_enc_hooks) lpb_useenchooks(&e, 2, t);
-    lpbE_encode(&e, 2, t);
-    if (e.b != &LS->buffer) return lua_settop(L, 3), 1;
-    return lpb_pushbuffer(L, &LS->buffer), 1;
+    return lpbE_encodeto(L, LS, t, 2);
 }
 
 static int lpbE_pack(lpb_Env* e, int idx, const pb_Type* t) {
@@ -1777,42 +3163,213 @@ static int Lpb_pack(lua_State* L) {
 
 /* protobuf decode */
 
-#define lpb_withinput(e,ns,stmt) ((e)->s = (ns), (stmt), (e)->s = s)
+/* run stmt with e reading ns, then give e back its input os */
+#define lpb_withinput(e,ns,os,stmt) ((e)->s = (ns), (stmt), (e)->s = (os))
+
+static int lpbD_message(lpb_Env *e, const pb_Type *t, int tables);
+static int lpbR_pushtable(lpb_Env *e, const pb_Type *t);
+static void lpbR_message(lpb_Env *e, const pb_Type *t, int fresh);
 
-static int lpbD_message(lpb_Env *e, const pb_Type *t);
+#define lpb_recycling(LS) ((LS)->decode_recycle && !(LS)->use_dec_hooks)
+
+static void lpb_scanhooks(lua_State *L, lpb_State *LS, int ref, unsigned kind) {
+    if (ref == LUA_NOREF) return;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lpb_HookEntry *he = (lpb_HookEntry*)pb_settable(&LS->hooked,
+                (pb_Key)lua_touserdata(L, -2));
+        lpb_checkmem(L, he != NULL);
+        he->kinds |= kind;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static unsigned lpb_hookkinds(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    /* the lpb_HookKind set of t, most types have no hooks and are told
+     * apart here without looking into the hook tables */
+    const lpb_HookEntry *he;
+    if (LS->hooks_stale) {
+        pb_freetable(&LS->hooked);
+        lpb_scanhooks(L, LS, LS->dec_hooks_index, LPB_HOOK);
+        lpb_scanhooks(L, LS, LS->batch_hooks_index, LPB_BATCH);
+        LS->hooks_stale = 0;
+    }
+    he = (const lpb_HookEntry*)pb_gettable(&LS->hooked, (pb_Key)t);
+    return he ? he->kinds : 0;
+}
 
 static void lpb_usedechooks(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    if (!(lpb_hookkinds(L, LS, t) & LPB_HOOK)) return;
+    lpbS_pushpin(L, LS); /* a hook may reload the schema */
     lpb_pushdechooktable(L, LS);
-    if (lua53_rawgetp(L, -1, t) != LUA_TNIL) {
-        lua_pushvalue(L, -3);
-        lua_call(L, 1, 1);
-        if (!lua_isnil(L, -1)) {
-            lua_pushvalue(L, -1);
-            lua_replace(L, -4);
+    lua53_rawgetp(L, -1, t);
+    lua_pushvalue(L, -4);
+    lua_call(L, 1, 1);
+    if (!lua_isnil(L, -1)) {
+        lua_pushvalue(L, -1);
+        lua_replace(L, -5);
+    }
+    lua_pop(L, 3);
+}
+
+static void lpb_usebatchhooks(lua_State *L, lpb_State *LS, const pb_Type *t, int first) {
+    /* pass the array on top to the batch hook of t, with the index of its
+     * first new element */
+    if (t == NULL || !(lpb_hookkinds(L, LS, t) & LPB_BATCH)) return;
+    lpbS_pushpin(L, LS);
+    lpb_pushbatchhooktable(L, LS);
+    lua53_rawgetp(L, -1, t);
+    lua_pushvalue(L, -4);
+    lua_pushinteger(L, first);
+    lua_call(L, 2, 0);
+    lua_pop(L, 2);
+}
+
+static const lpb_BindEntry *lpb_bound(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    /* the binding of t, most types have none and are told apart here
+     * without looking into the bind table */
+    if (LS->binds_index == LUA_NOREF) return NULL;
+    if (LS->binds_stale) {
+        pb_freetable(&LS->bound);
+        lpb_pushbindtable(L, LS);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            lpb_BindEntry *be = (lpb_BindEntry*)pb_settable(&LS->bound,
+                    (pb_Key)lua_touserdata(L, -2));
+            lpb_checkmem(L, be != NULL);
+            lua_rawgeti(L, -1, 2);
+            be->size = lua_isnil(L, -1) ? -1 : (int)lua_tointeger(L, -1);
+            lua_pop(L, 2);
+        }
+        lua_pop(L, 1);
+        LS->binds_stale = 0;
+    }
+    return (const lpb_BindEntry*)pb_gettable(&LS->bound, (pb_Key)t);
+}
+
+static void lpb_setbound(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    /* set the metatable bound to t on the table on top */
+    lpb_pushbindtable(L, LS);
+    lua53_rawgetp(L, -1, t);
+    lua_rawgeti(L, -1, 1);
+    lua_setmetatable(L, -4);
+    lua_pop(L, 2);
+}
+
+static void lpb_pushtmpl(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    /* the default fields of t as { tables, name1, value1, ... }, where
+     * tables tells which tables lpb_setdeffields() still has to add */
+    const pb_Field *f = NULL;
+    int n = 1, tables = 0;
+    LS->tmpls_index = lpb_reftable(L, LS->tmpls_index);
+    if (lua53_rawgetp(L, -1, t) == LUA_TTABLE) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+    lua_newtable(L);
+    while (pb_nextfield(t, &f)) {
+        if (f->repeated) {
+            if (t->is_proto3 || LS->decode_default_array)
+                tables |= USE_REPEAT;
+        } else if (f->oneof_idx)
+            continue;
+        else if (f->type_id == PB_Tmessage) {
+            if (LS->decode_default_message) tables |= USE_MESSAGE;
+        }
+        else if (lpb_pushdeffield(L, LS, t, f, t->is_proto3)) {
+            lua_pushstring(L, (const char*)f->name);
+            lua_rawseti(L, -3, n + 1);
+            lua_rawseti(L, -2, n + 2);
+            n += 2;
         }
     }
+    lua_pushinteger(L, tables);
+    lua_rawseti(L, -2, 1);
+    if (t->is_defined) { /* placeholders may be defined later */
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, -3, t);
+    }
+    lua_remove(L, -2);
+}
+
+static int lpb_copytmpl(lua_State *L, lpb_State *LS, const pb_Type *t, int tables) {
+    int i, n, has;
+    lpb_pushtmpl(L, LS, t);
+    n = (int)lua_rawlen(L, -1);
+    for (i = 2; i < n; i += 2) {
+        lua_rawgeti(L, -1, i);
+        lua_rawgeti(L, -2, i + 1);
+        lua_rawset(L, -4);
+    }
+    lua_rawgeti(L, -1, 1);
+    has = (int)lua_tointeger(L, -1);
     lua_pop(L, 2);
+    if (has & tables) lpb_setdeffields(L, LS, t, (lpb_DefFlags)(has & tables));
+    return has & ~tables;
 }
 
-static void lpb_pushtypetable(lua_State *L, lpb_State *LS, const pb_Type *t) {
+static int lpb_defarrays(lpb_State *LS, const pb_Type *t) {
+    /* lpb_initmsg() adds empty arrays and maps for the repeated fields */
     int mode = LS->encode_mode;
-    luaL_checkstack(L, 5, "too many levels");
-    lpb_newmsgtable(L, t);
-    switch (t->is_proto3 && mode == LPB_DEFDEF ? LPB_COPYDEF : mode) {
+    if (t->is_proto3 && mode == LPB_DEFDEF) mode = LPB_COPYDEF;
+    return (t->is_proto3 || LS->decode_default_array)
+        && (mode == LPB_COPYDEF || mode == LPB_METADEF
+                || LS->decode_default_array || LS->decode_default_message);
+}
+
+static int lpb_initmsg(lua_State *L, lpb_State *LS, const pb_Type *t, int tables) {
+    /* add default fields to the empty table on top, with the default
+     * tables in tables (USE_REPEAT and USE_MESSAGE), then set its bound
+     * metatable; returns the other default tables that t may have */
+    int mode = LS->encode_mode, bound = lpb_bound(L, LS, t) != NULL;
+    if (t->is_proto3 && mode == LPB_DEFDEF) mode = LPB_COPYDEF;
+    switch (mode) {
     case LPB_COPYDEF:
-        lpb_setdeffields(L, LS, t,
-                (lpb_DefFlags)(USE_FIELD|USE_REPEAT|USE_MESSAGE));
-        break;
+        tables = lpb_copytmpl(L, LS, t, tables);
+        if (bound) lpb_setbound(L, LS, t);
+        return tables;
     case LPB_METADEF:
-        lpb_setdeffields(L, LS, t, (lpb_DefFlags)(USE_REPEAT|USE_MESSAGE));
+        lpb_setdeffields(L, LS, t, (lpb_DefFlags)tables);
+        if (bound) break; /* the bound metatable replaces the default one */
         lpb_pushdefmeta(L, LS, t);
         lua_setmetatable(L, -2);
         break;
     default:
         if (LS->decode_default_array || LS->decode_default_message)
-            lpb_setdeffields(L, LS, t, (lpb_DefFlags)(USE_REPEAT|USE_MESSAGE));
+            lpb_setdeffields(L, LS, t, (lpb_DefFlags)tables);
         break;
     }
+    if (bound) lpb_setbound(L, LS, t);
+    return lpb_defarrays(LS, t) ? USE_REPEAT & ~tables : 0;
+}
+
+static void lpb_pushtypetablex(lua_State *L, lpb_State *LS, const pb_Type *t, int size) {
+    int mode = LS->encode_mode;
+    const lpb_BindEntry *be = lpb_bound(L, LS, t);
+    if (t->is_proto3 && mode == LPB_DEFDEF) mode = LPB_COPYDEF;
+    if (mode == LPB_COPYDEF || mode == LPB_METADEF
+            || LS->decode_default_array || LS->decode_default_message)
+        size = -1; /* default fields are added */
+    luaL_checkstack(L, 5, "too many levels");
+    lpb_newmsgtable(L, t, be && be->size >= 0 ? be->size : size);
+    lpb_initmsg(L, LS, t, USE_REPEAT|USE_MESSAGE);
+}
+
+static void lpb_pushtypetable(lua_State *L, lpb_State *LS, const pb_Type *t)
+{ lpb_pushtypetablex(L, LS, t, -1); }
+
+static int lpbD_newtable(lua_State *L, lpb_State *LS, const pb_Type *t) {
+    /* a new table to decode into, without the default arrays and maps:
+     * they are added after the fields when the returned flags are passed
+     * to lpbD_message(), so the decoded ones are made by lpbD_fields() at
+     * their exact sizes */
+    const lpb_BindEntry *be = lpb_bound(L, LS, t);
+    luaL_checkstack(L, 5, "too many levels");
+    lpb_newmsgtable(L, t, be ? be->size : -1);
+    return lpb_initmsg(L, LS, t, USE_MESSAGE);
 }
 
 static void lpbD_field(lpb_Env *e, const pb_Field *f) {
@@ -1820,23 +3377,30 @@ static void lpbD_field(lpb_Env *e, const pb_Field *f) {
     pb_Slice sv, *s = e->s;
     const pb_Field *ev = NULL;
     uint64_t u64;
+    int tables, kind;
     switch (f->type_id) {
     case PB_Tenum:
         if (pb_readvarint64(s, &u64) == 0)
             luaL_error(L, "invalid varint value at offset %d", pb_pos(*s)+1);
-        if (!lpb_lstate(L)->enum_as_value)
+        if (!e->LS->enum_as_value)
             ev = pb_field(f->type, (int32_t)u64);
         if (ev) lua_pushstring(L, (const char*)ev->name);
-        else lpb_pushinteger(L, (lua_Integer)u64, 1, lpb_lstate(L)->int64_mode);
+        else lpb_pushinteger(L, (lua_Integer)u64, 1, e->LS->int64_mode);
         if (e->LS->use_dec_hooks) lpb_usedechooks(L, e->LS, f->type);
         break;
     case PB_Tmessage:
         lpb_readbytes(L, s, &sv);
         if (f->type == NULL || f->type->is_dead)
             lua_pushnil(L);
+        else if ((kind = lpb_wktkind(L, e->LS, f->type)) != LPB_WNONE) {
+            lpbD_wkt(e, f->type, kind, sv);
+            if (e->LS->use_dec_hooks) lpb_usedechooks(L, e->LS, f->type);
+        } else if (lpb_recycling(e->LS))
+            lpb_withinput(e, &sv, s,
+                    lpbR_message(e, f->type, lpbR_pushtable(e, f->type)));
         else {
-            lpb_pushtypetable(L, e->LS, f->type);
-            lpb_withinput(e, &sv, lpbD_message(e, f->type));
+            tables = lpbD_newtable(L, e->LS, f->type);
+            lpb_withinput(e, &sv, s, lpbD_message(e, f->type, tables));
         }
         break;
     default:
@@ -1844,19 +3408,23 @@ static void lpbD_field(lpb_Env *e, const pb_Field *f) {
     }
 }
 
-static void lpbD_checktype(lpb_Env *e, const pb_Field *f, uint32_t tag) {
-    if (pb_wtypebytype(f->type_id) == (int)pb_gettype(tag)) return;
-    luaL_error(e->L,
+static const char *lpb_pushmismatch(lua_State *L, const pb_Field *f, uint32_t tag, size_t pos) {
+    return lua_pushfstring(L,
             "type mismatch for %s%sfield '%s' at offset %d, "
             "%s expected for type %s, got %s",
             f->packed ? "packed " : "", f->repeated ? "repeated " : "",
             (const char*)f->name,
-            pb_pos(*e->s)+1,
+            (int)pos+1,
             pb_wtypename(pb_wtypebytype(f->type_id), NULL),
             pb_typename(f->type_id, NULL),
             pb_wtypename(pb_gettype(tag), NULL));
 }
 
+static void lpbD_checktype(lpb_Env *e, const pb_Field *f, uint32_t tag) {
+    if (pb_wtypebytype(f->type_id) == (int)pb_gettype(tag)) return;
+    luaL_error(e->L, "%s", lpb_pushmismatch(e->L, f, tag, pb_pos(*e->s)));
+}
+
 static void lpbD_map(lpb_Env *e, const pb_Field *f) {
     lua_State *L = e->L;
     pb_Slice p, *s = e->s;
@@ -1872,57 +3440,172 @@ static void lpbD_map(lpb_Env *e, const pb_Field *f) {
             const pb_Field *vf = pb_field(f->type, n);
             if (vf == NULL) continue;
             mask |= n;
-            lpb_withinput(e, &p,
+            lpb_withinput(e, &p, s,
                     (lpbD_checktype(e, vf, tag), lpbD_field(e, vf)));
             lua_replace(L, top+n);
         }
     }
-    if (!(mask & 1) && lpb_pushdeffield(L, e->LS, pb_field(f->type, 1), 1))
+    if (!(mask & 1) && lpb_pushdeffield(L, e->LS, f->type, pb_field(f->type, 1), 1))
         lua_replace(L, top + 1), mask |= 1;
-    if (!(mask & 2) && lpb_pushdeffield(L, e->LS, pb_field(f->type, 2), 1))
+    if (!(mask & 2) && lpb_pushdeffield(L, e->LS, f->type, pb_field(f->type, 2), 1))
         lua_replace(L, top + 2), mask |= 2;
     if (mask == 3) lua_rawset(L, -3); else lua_pop(L, 2);
 }
 
-static void lpbD_repeated(lpb_Env *e, const pb_Field *f, uint32_t tag) {
+static int lpbD_append(lpb_Env *e, const pb_Field *f, uint32_t tag, int len) {
+    /* append the value of f to the array on top holding len elements,
+     * returns the new length */
     lua_State *L = e->L;
     if (pb_gettype(tag) != PB_TBYTES
             || (!f->packed && pb_wtypebytype(f->type_id) == PB_TBYTES)) {
         lpbD_checktype(e, f, tag), lpbD_field(e, f);
-        lua_rawseti(L, -2, (int)lua_rawlen(L, -2) + 1);
+        if (lua_isnil(L, -1)) lua_pop(L, 1); /* message of dead type */
+        else lua_rawseti(L, -2, ++len);
     } else {
-        int len = (int)lua_rawlen(L, -1);
         pb_Slice p, *s = e->s;
         lpb_readbytes(L, s, &p);
         while (p.p < p.end) {
-            lpb_withinput(e, &p, lpbD_field(e, f));
+            lpb_withinput(e, &p, s, lpbD_field(e, f));
             lua_rawseti(L, -2, ++len);
         }
     }
+    return len;
+}
+
+static void lpbD_repeated(lpb_Env *e, const pb_Field *f, uint32_t tag)
+{ lpbD_append(e, f, tag, (int)lua_rawlen(e->L, -1)); }
+
+static size_t lpbD_packedcount(const pb_Field *f, pb_Slice p) {
+    size_t n = 0;
+    switch (pb_wtypebytype(f->type_id)) {
+    case PB_T32BIT: return pb_len(p) / 4;
+    case PB_T64BIT: return pb_len(p) / 8;
+    }
+    for (; p.p < p.end; ++p.p) /* one terminating byte per varint */
+        n += (*(const unsigned char*)p.p & 0x80) == 0;
+    return n;
 }
 
-static int lpbD_message(lpb_Env *e, const pb_Type *t) {
+static int *lpbD_count(lpb_Env *e, const pb_Type *t, uint32_t tag) {
+    /* count the elements of all repeated fields of t from the value at
+     * e->s to the end of the message in one scan, into a userdata put
+     * under the message table; bad data is left for the decoder */
     lua_State *L = e->L;
-    pb_Slice *s = e->s;
-    uint32_t tag;
-    luaL_checkstack(L, 5, "not enough stack space for fields");
-    while (pb_readvarint32(s, &tag)) {
+    pb_Slice s = *e->s;
+    int *counts;
+    lpb_checkmem(L, pb_sortedfields(t) != NULL);
+    counts = (int*)lua_newuserdata(L, t->field_count * sizeof(int));
+    memset(counts, 0, t->field_count * sizeof(int));
+    lua_insert(L, -2);
+    do {
         const pb_Field *f = pb_field(t, pb_gettag(tag));
-        if (f == NULL)
-            pb_skipvalue(s, tag);
-        else if (f->type && f->type->is_map) {
-            lpb_fetchtable(L, e->LS, f, &e->LS->map_type);
-            lpbD_checktype(e, f, tag);
-            lpbD_map(e, f);
-            lua_pop(L, 1);
-        } else if (f->repeated) {
-            lpb_fetchtable(L, e->LS, f, &e->LS->array_type);
-            lpbD_repeated(e, f, tag);
-            lua_pop(L, 1);
+        size_t n = 1;
+        pb_Slice p;
+        if (f == NULL || !f->repeated || pb_gettype(tag) != PB_TBYTES
+                || pb_wtypebytype(f->type_id) == PB_TBYTES) {
+            if (pb_skipvalue(&s, tag) == 0) break;
         } else {
-            lua_pushstring(L, (const char*)f->name);
-            if (f->oneof_idx) {
-                lua_pushstring(L, (const char*)pb_oneofname(t, f->oneof_idx));
+            if (pb_readbytes(&s, &p) == 0) break;
+            n = lpbD_packedcount(f, p);
+        }
+        if (f != NULL && f->repeated) {
+            int *c = &counts[f->sorted_idx - 1];
+            *c = n > (size_t)(INT_MAX - *c) ? INT_MAX : *c + (int)n;
+        }
+    } while (pb_readvarint32(&s, &tag));
+    return counts;
+}
+
+static int lpbD_fetchtable(lpb_Env *e, const pb_Type *t, const pb_Field *f, uint32_t tag, int **pcounts) {
+    /* push the array or map of f, a new one is sized for all elements
+     * left in the message; returns the length of an old array */
+    lua_State *L = e->L;
+    int ismap = f->type && f->type->is_map, size = 0, old;
+    lua_pushstring(L, (const char*)f->name);
+    lua_rawget(L, -2);
+    old = lua_istable(L, -1);
+    lua_pop(L, 1);
+    if (!old) {
+        if (*pcounts == NULL) *pcounts = lpbD_count(e, t, tag);
+        size = (*pcounts)[f->sorted_idx - 1];
+    }
+    lpb_fetchtable(L, e->LS, f, ismap ?
+            &e->LS->map_type : &e->LS->array_type, size);
+    return size || ismap ? 0 : (int)lua_rawlen(L, -1);
+}
+
+static int lpbD_nexttag(pb_Slice *s, const pb_Field *f, uint32_t *ptag) {
+    /* read the next tag if it is of f too */
+    const char *p = s->p;
+    if (pb_readvarint32(s, ptag) && pb_gettag(*ptag) == (uint32_t)f->number)
+        return 1;
+    s->p = p;
+    return 0;
+}
+
+#define lpb_enumnames(LS,f) ((f)->type_id == PB_Tenum && (f)->type \
+        && !(LS)->enum_as_value && !(LS)->use_dec_hooks)
+
+static int lpbD_enum(lpb_Env *e, pb_Slice *s, int len) {
+    /* append the enum at s to the array under the enum table on top */
+    lua_State *L = e->L;
+    uint64_t u64;
+    if (pb_readvarint64(s, &u64) == 0)
+        luaL_error(L, "invalid varint value at offset %d", pb_pos(*s)+1);
+    if (lua53_rawgeti(L, -1, (int32_t)u64) != LUA_TSTRING) {
+        lua_pop(L, 1);
+        lpb_pushinteger(L, (lua_Integer)u64, 1, e->LS->int64_mode);
+    }
+    lua_rawseti(L, -3, ++len);
+    return len;
+}
+
+static void lpbD_enums(lpb_Env *e, const pb_Field *f, uint32_t tag, int len) {
+    /* append the run of enums of f like lpbD_append(), with the names from
+     * the enum table */
+    pb_Slice p, *s = e->s;
+    lpb_pushenum(e->L, e->LS, f->type);
+    do {
+        if (pb_gettype(tag) != PB_TBYTES)
+            lpbD_checktype(e, f, tag), len = lpbD_enum(e, s, len);
+        else {
+            lpb_readbytes(e->L, s, &p);
+            while (p.p < p.end) len = lpbD_enum(e, &p, len);
+        }
+    } while (lpbD_nexttag(s, f, &tag));
+    lua_pop(e->L, 1);
+}
+
+static void lpbD_fields(lpb_Env *e, const pb_Type *t) {
+    lua_State *L = e->L;
+    pb_Slice *s = e->s;
+    int *counts = NULL; /* see lpbD_count */
+    uint32_t tag;
+    while (pb_readvarint32(s, &tag)) {
+        const pb_Field *f = pb_field(t, pb_gettag(tag));
+        if (f == NULL)
+            pb_skipvalue(s, tag);
+        else if (f->type && f->type->is_map) {
+            lpbD_fetchtable(e, t, f, tag, &counts);
+            do lpbD_checktype(e, f, tag), lpbD_map(e, f);
+            while (lpbD_nexttag(s, f, &tag));
+            lua_pop(L, 1);
+        } else if (f->repeated) {
+            int first = lpbD_fetchtable(e, t, f, tag, &counts) + 1;
+            int len = first - 1;
+            if (lpb_enumnames(e->LS, f))
+                lpbD_enums(e, f, tag, len);
+            else {
+                do len = lpbD_append(e, f, tag, len);
+                while (lpbD_nexttag(s, f, &tag));
+                if (e->LS->use_dec_hooks && len >= first)
+                    lpb_usebatchhooks(L, e->LS, f->type, first);
+            }
+            lua_pop(L, 1);
+        } else {
+            lua_pushstring(L, (const char*)f->name);
+            if (f->oneof_idx) {
+                lua_pushstring(L, (const char*)pb_oneofname(t, f->oneof_idx));
                 lua_pushvalue(L, -2);
                 lua_rawset(L, -4);
             }
@@ -1930,30 +3613,1193 @@ static int lpbD_message(lpb_Env *e, const pb_Type *t) {
             lua_rawset(L, -3);
         }
     }
+    if (counts != NULL) lua_remove(L, -2);
+}
+
+static int lpbD_message(lpb_Env *e, const pb_Type *t, int tables) {
+    /* decode into the table on top, then add the default tables */
+    luaL_checkstack(e->L, 6, "not enough stack space for fields");
+    lpbD_fields(e, t);
+    if (tables) lpb_setdeffields(e->L, e->LS, t, (lpb_DefFlags)tables);
+    if (e->LS->use_dec_hooks) lpb_usedechooks(e->L, e->LS, t);
+    return 1;
+}
+
+/* recycling decode: reuse the tables of the old result in place */
+
+#define LPB_POOLSIZE 64 /* max tables kept for each type */
+
+typedef struct lpb_Slot {
+    int idx;         /* stack index of the old table of the field, or 0 */
+    int used;        /* the old table is in the new result */
+    int len, oldlen; /* elements written, and in the old array */
+} lpb_Slot;
+
+#define lpbR_slot(e,base,f) \
+    ((lpb_Slot*)pb_buffer(&(e)->LS->slots) + (base) + (f)->sorted_idx - 1)
+
+#define lpbR_istable(e,f) ((f)->repeated || lpbR_msgtype(e, f) != NULL)
+
+static const pb_Type *lpbR_msgtype(lpb_Env *e, const pb_Field *f) {
+    /* the type of tables to reuse for f, converted values are not */
+    const pb_Type *t = f->type_id == PB_Tmessage ? f->type : NULL;
+    return t && !t->is_dead && !t->is_map
+        && lpb_wktkind(e->L, e->LS, t) == LPB_WNONE ? t : NULL;
+}
+
+static void lpb_pushpooltable(lua_State *L, lpb_State *LS)
+{ LS->pool_index = lpb_reftable(L, LS->pool_index); }
+
+static int lpbR_pushtable(lpb_Env *e, const pb_Type *t) {
+    /* push a pooled table of t (returns 0), or a new one (returns 1) */
+    lua_State *L = e->L;
+    int n;
+    lpb_pushpooltable(L, e->LS);
+    if (lua53_rawgetp(L, -1, t) == LUA_TTABLE
+            && (n = (int)lua_rawlen(L, -1)) > 0) {
+        lua_rawgeti(L, -1, n);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, n);
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 2);
+    lpb_pushtypetable(L, e->LS, t);
+    return 1;
+}
+
+static void lpbR_free(lpb_Env *e, const pb_Type *t) {
+    /* give the table on top (popped) to the pool of t */
+    lua_State *L = e->L;
+    int n;
+    lpb_pushpooltable(L, e->LS);
+    if (lua53_rawgetp(L, -1, t) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, -3, t);
+    }
+    if ((n = (int)lua_rawlen(L, -1)) < LPB_POOLSIZE) {
+        lua_pushvalue(L, -3);
+        lua_rawseti(L, -2, n + 1);
+    }
+    lua_pop(L, 3);
+}
+
+static void lpbR_clear(lpb_Env *e, const pb_Type *t, int ti, size_t base) {
+    /* empty the old table, moving the tables of its fields to the stack */
+    lua_State *L = e->L;
+    size_t i;
+    for (i = 0; i < t->field_count; ++i) {
+        const pb_Field *f = t->sorted_fields[i];
+        lpb_Slot *sl;
+        if (!lpbR_istable(e, f)) continue;
+        lua_pushstring(L, (const char*)f->name);
+        lua_rawget(L, ti);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        luaL_checkstack(L, 5, "too many fields");
+        sl = lpbR_slot(e, base, f);
+        sl->idx = lua_gettop(L);
+        sl->oldlen = (int)lua_rawlen(L, -1);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, ti)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, ti);
+    }
+}
+
+static void lpbR_adopt(lpb_Env *e, const pb_Field *f, int ti, lpb_Slot *sl) {
+    /* put the old array or map of f back, old maps are emptied */
+    lua_State *L = e->L;
+    const pb_Type *vt = NULL;
+    sl->used = 1;
+    lua_pushvalue(L, sl->idx);
+    lua_pushstring(L, (const char*)f->name);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, ti);
+    if (f->type && f->type->is_map) {
+        if ((f = pb_field(f->type, 2)) != NULL) vt = lpbR_msgtype(e, f);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            if (vt && lua_istable(L, -1)) lpbR_free(e, vt);
+            else lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, -4);
+        }
+    }
+    lua_pop(L, 1);
+}
+
+static void lpbR_fetch(lpb_Env *e, const pb_Field *f, int ti, size_t base) {
+    /* push the array or map of f, the old one when first seen */
+    lua_State *L = e->L;
+    lpb_Slot *sl = lpbR_slot(e, base, f);
+    if (sl->idx != 0 && !sl->used) lpbR_adopt(e, f, ti, sl);
+    lua_pushvalue(L, ti);
+    lpb_fetchtable(L, e->LS, f, f->type && f->type->is_map ?
+            &e->LS->map_type : &e->LS->array_type, 0);
+    lua_remove(L, -2);
+}
+
+static void lpbR_element(lpb_Env *e, const pb_Field *f, size_t base) {
+    /* write the next element of the old array on top */
+    lua_State *L = e->L;
+    lpb_Slot *sl = lpbR_slot(e, base, f);
+    const pb_Type *t = lpbR_msgtype(e, f);
+    int i = ++sl->len;
+    if (t && i <= sl->oldlen && lua53_rawgeti(L, -1, i) == LUA_TTABLE) {
+        pb_Slice sv, *s = e->s;
+        lpb_readbytes(L, s, &sv);
+        lpb_withinput(e, &sv, s, lpbR_message(e, t, 0));
+    } else {
+        if (t && i <= sl->oldlen) lua_pop(L, 1);
+        lpbD_field(e, f);
+        if (lua_isnil(L, -1)) { /* message of dead type */
+            lua_pop(L, 1);
+            --lpbR_slot(e, base, f)->len;
+            return;
+        }
+    }
+    lua_rawseti(L, -2, i);
+}
+
+static void lpbR_repeated(lpb_Env *e, const pb_Field *f, uint32_t tag, size_t base) {
+    lua_State *L = e->L;
+    if (!lpbR_slot(e, base, f)->used)
+        lpbD_repeated(e, f, tag);
+    else if (pb_gettype(tag) != PB_TBYTES
+            || (!f->packed && pb_wtypebytype(f->type_id) == PB_TBYTES))
+        lpbD_checktype(e, f, tag), lpbR_element(e, f, base);
+    else {
+        pb_Slice p, *s = e->s;
+        lpb_readbytes(L, s, &p);
+        while (p.p < p.end)
+            lpb_withinput(e, &p, s, lpbR_element(e, f, base));
+    }
+}
+
+static void lpbR_fields(lpb_Env *e, const pb_Type *t, int ti, size_t base) {
+    lua_State *L = e->L;
+    pb_Slice sv, *s = e->s;
+    uint32_t tag;
+    while (pb_readvarint32(s, &tag)) {
+        const pb_Field *f = pb_field(t, pb_gettag(tag));
+        lpb_Slot *sl;
+        if (f == NULL)
+            pb_skipvalue(s, tag);
+        else if (f->type && f->type->is_map) {
+            lpbR_fetch(e, f, ti, base);
+            lpbD_checktype(e, f, tag);
+            lpbD_map(e, f);
+            lua_pop(L, 1);
+        } else if (f->repeated) {
+            lpbR_fetch(e, f, ti, base);
+            lpbR_repeated(e, f, tag, base);
+            lua_pop(L, 1);
+        } else {
+            lua_pushstring(L, (const char*)f->name);
+            if (f->oneof_idx) {
+                lua_pushstring(L, (const char*)pb_oneofname(t, f->oneof_idx));
+                lua_pushvalue(L, -2);
+                lua_rawset(L, ti);
+            }
+            lpbD_checktype(e, f, tag);
+            if (lpbR_istable(e, f) && (sl = lpbR_slot(e, base, f))->idx
+                    && !sl->used) {
+                sl->used = 1;
+                lpb_readbytes(L, s, &sv);
+                lua_pushvalue(L, sl->idx);
+                lpb_withinput(e, &sv, s, lpbR_message(e, f->type, 0));
+            } else lpbD_field(e, f);
+            lua_rawset(L, ti);
+        }
+    }
+}
+
+static void lpbR_release(lpb_Env *e, const pb_Type *t, size_t base) {
+    /* pool the old tables not in the new result, and cut old arrays */
+    lua_State *L = e->L;
+    size_t i;
+    for (i = 0; i < t->field_count; ++i) {
+        const pb_Field *f = t->sorted_fields[i];
+        const lpb_Slot *sl = lpbR_slot(e, base, f);
+        const pb_Type *et = lpbR_msgtype(e, f);
+        int j;
+        if (sl->idx == 0 || (f->type && f->type->is_map)) continue;
+        if (!f->repeated) {
+            if (!sl->used && et) lua_pushvalue(L, sl->idx), lpbR_free(e, et);
+            continue;
+        }
+        for (j = sl->oldlen; j > (sl->used ? sl->len : 0); --j) {
+            if (et && lua53_rawgeti(L, sl->idx, j) == LUA_TTABLE)
+                lpbR_free(e, et);
+            else if (et) lua_pop(L, 1);
+            if (sl->used) lua_pushnil(L), lua_rawseti(L, sl->idx, j);
+        }
+    }
+}
+
+static void lpbR_message(lpb_Env *e, const pb_Type *t, int fresh) {
+    /* decode into the table on top, a new one if fresh */
+    lua_State *L = e->L;
+    pb_Buffer *b = &e->LS->slots;
+    size_t base = pb_bufflen(b) / sizeof(lpb_Slot);
+    size_t fsize = t->field_count * sizeof(lpb_Slot);
+    int ti = lua_gettop(L);
+    size_t i;
+    char *p;
+    luaL_checkstack(L, 5, "not enough stack space for fields");
+    lpb_checkmem(L, t->field_count == 0 || pb_sortedfields(t) != NULL);
+    if (fsize) {
+        lpb_checkmem(L, (p = pb_prepbuffsize(b, fsize)) != NULL);
+        memset(p, 0, fsize), pb_addsize(b, fsize);
+    }
+    if (!fresh) {
+        lpbR_clear(e, t, ti, base);
+        for (i = 0; lpb_defarrays(e->LS, t) && i < t->field_count; ++i) {
+            const pb_Field *f = t->sorted_fields[i];
+            lpb_Slot *sl = lpbR_slot(e, base, f);
+            if (f->repeated && sl->idx != 0) lpbR_adopt(e, f, ti, sl);
+        }
+        lua_pushvalue(L, ti);
+        lpb_initmsg(L, e->LS, t, USE_REPEAT|USE_MESSAGE);
+        lua_pop(L, 1);
+    }
+    lpbR_fields(e, t, ti, base);
+    lpbR_release(e, t, base);
+    lua_settop(L, ti);
+    pb_bufflen(b) = (unsigned)(base * sizeof(lpb_Slot));
+}
+
+static int lpbR_decode(lua_State *L, lpb_State *LS, const pb_Type *t, pb_Slice s, int start) {
+    lpb_Env e;
+    int fresh = !lua_istable(L, start);
+    if (fresh) {
+        lua_pop(L, 1);
+        lpb_pushtypetable(L, LS, t);
+    }
+    pb_bufflen(&LS->slots) = 0; /* left by errors */
+    e.L = L, e.LS = LS, e.b = NULL, e.s = &s;
+    lpbR_message(&e, t, fresh);
+    return 1;
+}
+
+static size_t lpb_ropewant(pb_Slice s) {
+    const char *p = s.p;
+    uint32_t tag;
+    uint64_t len;
+    if (pb_readvarint32(&s, &tag) == 0)
+        return pb_len(s) + 20; /* enough for tag and length */
+    switch (pb_gettype(tag)) {
+    case PB_TVARINT: return (s.p - p) + 10;
+    case PB_T64BIT:  return (s.p - p) + 8;
+    case PB_T32BIT:  return (s.p - p) + 4;
+    case PB_TBYTES:
+        if (pb_readvarint64(&s, &len) == 0) return (s.p - p) + 10;
+        return len > PB_MAX_SIZET ? PB_MAX_SIZET : (s.p - p) + (size_t)len;
+    }
+    return 0; /* unknown length (e.g. groups), take whole chunks */
+}
+
+static int lpb_ropeskip(pb_Slice *s, int head) {
+    /* skip the field in s, or only its tag and length if head */
+    uint32_t tag;
+    uint64_t len;
+    if (!pb_readvarint32(s, &tag)) return 0;
+    if (!head) return pb_skipvalue(s, tag) != 0;
+    return pb_gettype(tag) != PB_TBYTES || pb_readvarint64(s, &len) != 0;
+}
+
+static pb_Slice lpb_ropestitch(lpb_Rope *R, int head) {
+    /* append the rest of the field in scratch from the next chunks */
+    pb_Buffer *b = R->scratch;
+    while (lpb_ropenext(R)) {
+        pb_Slice s = pb_result(b);
+        size_t want = lpb_ropewant(s), n;
+        n = want > pb_bufflen(b) ? want - pb_bufflen(b) : pb_len(R->curr);
+        if (n > pb_len(R->curr)) n = pb_len(R->curr);
+        lpb_checkmem(R->L, pb_addslice(b, pb_lslice(R->curr.p, n)));
+        R->curr.p += n;
+        s = pb_result(b);
+        if (lpb_ropeskip(&s, head)) {
+            R->curr.p -= pb_len(s); /* give back bytes of the next field */
+            pb_bufflen(b) -= (unsigned)pb_len(s);
+            break;
+        }
+    }
+    return pb_result(b);
+}
+
+static pb_Slice lpb_roperest(lpb_Rope *R, pb_Slice head);
+
+static int lpb_ropefield(lpb_Rope *R, pb_Slice *pv) {
+    /* read the next fields in this chunk, or only the tag and length of
+     * bytes that straddle chunks, then returns 2 with the rope at them */
+    pb_Slice s;
+    const char *end = NULL;
+    uint32_t tag;
+    uint64_t len;
+    if (!lpb_ropenext(R)) return 0;
+    s = R->curr;
+    while (lpb_ropeskip(&s, 0)) end = s.p;
+    if (end != NULL) {
+        *pv = R->curr, pv->end = R->curr.p = end;
+        return 1;
+    }
+    s = R->curr;
+    if (lpb_ropeskip(&s, 1))
+        *pv = R->curr, pv->end = R->curr.p = s.p;
+    else {
+        pb_bufflen(R->scratch) = 0;
+        lpb_checkmem(R->L, pb_addslice(R->scratch, R->curr));
+        R->curr.p = R->curr.end;
+        *pv = lpb_ropestitch(R, 1);
+    }
+    s = *pv;
+    if (!pb_readvarint32(&s, &tag)) return 1; /* truncated */
+    if (pb_gettype(tag) == PB_TBYTES) return pb_readvarint64(&s, &len) ? 2 : 1;
+    *pv = lpb_roperest(R, *pv);
+    return 1;
+}
+
+static pb_Slice lpb_roperest(lpb_Rope *R, pb_Slice head) {
+    /* stitch the value after the head read by lpb_ropefield() */
+    pb_Buffer *b = R->scratch;
+    if (head.p != pb_buffer(b)) {
+        pb_bufflen(b) = 0;
+        lpb_checkmem(R->L, pb_addslice(b, head));
+    }
+    return lpb_ropestitch(R, 0);
+}
+
+static int lpbD_rope(lpb_Env *e, const pb_Type *t, lpb_Rope *R, int tables);
+
+static int lpbD_ropemsg(lpb_Env *e, const pb_Type *t, lpb_Rope *R, pb_Slice head) {
+    /* decode a message that straddles chunks from the rope itself, so
+     * only its own fields that straddle them are stitched */
+    lua_State *L = e->L;
+    const pb_Field *f;
+    size_t pos = lpb_ropepos(R), limit = R->limit;
+    uint32_t tag;
+    uint64_t len;
+    int tables, n = 0;
+    pb_readvarint32(&head, &tag), pb_readvarint64(&head, &len);
+    f = pb_field(t, pb_gettag(tag));
+    if (f == NULL || f->type_id != PB_Tmessage || f->type == NULL
+            || f->type->is_dead || f->type->is_map
+            || lpb_wktkind(L, e->LS, f->type) != LPB_WNONE)
+        return 0;
+    if (len > limit - pos)
+        luaL_error(L, "invalid bytes length: %d (at offset %d)",
+                (int)len, (int)pos+1);
+    if (f->repeated) {
+        lpb_fetchtable(L, e->LS, f, &e->LS->array_type, 0);
+        n = (int)lua_rawlen(L, -1);
+    } else {
+        lua_pushstring(L, (const char*)f->name);
+        if (f->oneof_idx) {
+            lua_pushstring(L, (const char*)pb_oneofname(t, f->oneof_idx));
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
+        }
+    }
+    tables = lpbD_newtable(L, e->LS, f->type);
+    R->limit = pos + (size_t)len, lpb_ropeclip(R);
+    lpbD_rope(e, f->type, R, tables);
+    if (lpb_ropepos(R) != R->limit)
+        luaL_error(L, "unfinished bytes (len %d at offset %d)",
+                (int)len, (int)pos+1);
+    R->limit = limit, lpb_ropeclip(R);
+    if (!f->repeated) return lua_rawset(L, -3), 1;
+    lua_rawseti(L, -2, n + 1);
+    if (e->LS->use_dec_hooks) lpb_usebatchhooks(L, e->LS, f->type, n + 1);
+    return lua_pop(L, 1), 1;
+}
+
+static int lpbD_rope(lpb_Env *e, const pb_Type *t, lpb_Rope *R, int tables) {
+    pb_Slice s;
+    int r;
+    luaL_checkstack(e->L, 8, "not enough stack space for fields");
+    while ((r = lpb_ropefield(R, &s)) != 0) {
+        if (r == 2 && lpbD_ropemsg(e, t, R, s)) continue;
+        if (r == 2) s = lpb_roperest(R, s);
+        e->s = &s, lpbD_fields(e, t);
+    }
+    if (tables) lpb_setdeffields(e->L, e->LS, t, (lpb_DefFlags)tables);
+    if (e->LS->use_dec_hooks) lpb_usedechooks(e->L, e->LS, t);
+    return 1;
+}
+
+/* two-pass decode: validate data into a flat tape, then build tables */
+
+typedef enum lpb_TapeKind {
+    LPB_KSCALAR, LPB_KPACKED, LPB_KMAP, LPB_KMESSAGE, LPB_KEND
+} lpb_TapeKind;
+
+typedef enum lpb_TapeError {
+    LPB_TOK, LPB_TNOMEM, LPB_TVARINT, LPB_TFIXED32, LPB_TFIXED64,
+    LPB_TBYTESLEN, LPB_TUNFINISHED, LPB_TMISMATCH, LPB_TUNKNOWN, LPB_TDEPTH
+} lpb_TapeError;
+
+#define LPB_MAXDEPTH 100 /* nested messages, parsing does not check stacks */
+
+typedef struct lpb_TapeItem {
+    const pb_Field *f; /* NULL for the root message and ends */
+    const char *p;     /* value data, tag excluded */
+    size_t   len;
+    unsigned size;     /* exact hash size of a message table */
+    unsigned count;    /* elements of a repeated field, in its first item */
+    unsigned kind;     /* lpb_TapeKind */
+} lpb_TapeItem;
+
+typedef struct lpb_Tape {
+    pb_Buffer *items;
+    pb_Buffer *frames; /* first item of each field of parsing messages */
+    int error;         /* lpb_TapeError */
+    int depth;         /* messages being parsed */
+    const pb_Field *ef;
+    uint32_t etag;
+    size_t   epos;
+    uint64_t elen;
+} lpb_Tape;
+
+#define lpbT_count(T)   (pb_bufflen((T)->items)/sizeof(lpb_TapeItem))
+#define lpbT_item(T,i)  ((lpb_TapeItem*)pb_buffer((T)->items) + (i))
+#define lpbT_frame(T,i) ((unsigned*)pb_buffer((T)->frames) + (i))
+
+static int lpbT_message(lpb_Tape *T, const pb_Type *t, const pb_Field *pf, pb_Slice s, int emit);
+
+static int lpbT_error(lpb_Tape *T, int code, const pb_Field *f, pb_Slice s, uint64_t len, uint32_t tag) {
+    T->error = code, T->ef = f, T->etag = tag;
+    T->epos = pb_pos(s), T->elen = len;
+    return 0;
+}
+
+static int lpbT_push(lpb_Tape *T, int kind, const pb_Field *f, const char *p, size_t len) {
+    lpb_TapeItem *it = (lpb_TapeItem*)pb_prepbuffsize(T->items, sizeof(lpb_TapeItem));
+    if (it == NULL) return lpbT_error(T, LPB_TNOMEM, f, pb_lslice(p, 0), 0, 0);
+    it->f = f, it->p = p, it->len = len;
+    it->size = it->count = 0, it->kind = kind;
+    pb_addsize(T->items, sizeof(lpb_TapeItem));
+    return 1;
+}
+
+static int lpbT_readbytes(lpb_Tape *T, pb_Slice *s, pb_Slice *pv) {
+    uint64_t len = 0;
+    if (pb_readvarint64(s, &len) == 0 || len > PB_MAX_SIZET)
+        return lpbT_error(T, LPB_TBYTESLEN, NULL, *s, len, 0);
+    if (pb_readslice(s, (size_t)len, pv) == 0 && len != 0)
+        return lpbT_error(T, LPB_TUNFINISHED, NULL, *s, len, 0);
+    return 1;
+}
+
+static int lpbT_checktype(lpb_Tape *T, const pb_Field *f, uint32_t tag, pb_Slice s) {
+    if (pb_wtypebytype(f->type_id) == (int)pb_gettype(tag)) return 1;
+    return lpbT_error(T, LPB_TMISMATCH, f, s, 0, tag);
+}
+
+static int lpbT_value(lpb_Tape *T, const pb_Field *f, pb_Slice *s) {
+    pb_Slice sv;
+    uint64_t u64;
+    uint32_t u32;
+    switch (f->type_id) {
+    case PB_Tmessage:
+        if (!lpbT_readbytes(T, s, &sv)) return 0;
+        return f->type == NULL || f->type->is_dead
+            || lpbT_message(T, f->type, f, sv, 0);
+    case PB_Tbytes: case PB_Tstring:
+        return lpbT_readbytes(T, s, &sv);
+    case PB_Tbool:  case PB_Tenum:
+    case PB_Tint32: case PB_Tuint32: case PB_Tsint32:
+    case PB_Tint64: case PB_Tuint64: case PB_Tsint64:
+        return pb_readvarint64(s, &u64) ? 1 :
+            lpbT_error(T, LPB_TVARINT, f, *s, 0, 0);
+    case PB_Tfloat: case PB_Tfixed32: case PB_Tsfixed32:
+        return pb_readfixed32(s, &u32) ? 1 :
+            lpbT_error(T, LPB_TFIXED32, f, *s, 0, 0);
+    case PB_Tdouble: case PB_Tfixed64: case PB_Tsfixed64:
+        return pb_readfixed64(s, &u64) ? 1 :
+            lpbT_error(T, LPB_TFIXED64, f, *s, 0, 0);
+    }
+    return lpbT_error(T, LPB_TUNKNOWN, f, *s, 0, 0);
+}
+
+static int lpbT_field(lpb_Tape *T, const pb_Field *f, uint32_t tag, pb_Slice *s, int emit, size_t *pn) {
+    const char *p = s->p;
+    pb_Slice v;
+    *pn = 1;
+    if (f->type && f->type->is_map) { /* same as lpbD_map() */
+        uint32_t etag;
+        if (!lpbT_checktype(T, f, tag, *s) || !lpbT_readbytes(T, s, &v))
+            return 0;
+        while (pb_readvarint32(&v, &etag)) {
+            int n = (int)pb_gettag(etag);
+            const pb_Field *vf;
+            if ((n != 1 && n != 2) || (vf = pb_field(f->type, n)) == NULL)
+                continue;
+            if (!lpbT_checktype(T, vf, etag, v) || !lpbT_value(T, vf, &v))
+                return 0;
+        }
+        return !emit || lpbT_push(T, LPB_KMAP, f, p, s->p - p);
+    }
+    if (f->repeated && pb_gettype(tag) == PB_TBYTES
+            && (f->packed || pb_wtypebytype(f->type_id) != PB_TBYTES)) {
+        if (!lpbT_readbytes(T, s, &v)) return 0;
+        for (p = v.p, *pn = 0; v.p < v.end; ++*pn)
+            if (!lpbT_value(T, f, &v)) return 0;
+        return !emit || lpbT_push(T, LPB_KPACKED, f, p, v.end - p);
+    }
+    if (!lpbT_checktype(T, f, tag, *s)) return 0;
+    if (f->type_id == PB_Tmessage && f->type && !f->type->is_dead) {
+        if (!lpbT_readbytes(T, s, &v)) return 0;
+        return lpbT_message(T, f->type, f, v, emit);
+    }
+    return lpbT_value(T, f, s)
+        && (!emit || lpbT_push(T, LPB_KSCALAR, f, p, s->p - p));
+}
+
+static int lpbT_fields(lpb_Tape *T, const pb_Type *t, const pb_Field *pf, pb_Slice s, int emit) {
+    size_t head = lpbT_count(T), base = pb_bufflen(T->frames);
+    size_t fsize = t->field_count * sizeof(unsigned);
+    unsigned nhash = 0;
+    uint32_t tag;
+    if (emit) {
+        char *frame;
+        if (!lpbT_push(T, LPB_KMESSAGE, pf, s.p, pb_len(s))) return 0;
+        if (fsize && (pb_sortedfields(t) == NULL
+                    || (frame = pb_prepbuffsize(T->frames, fsize)) == NULL))
+            return lpbT_error(T, LPB_TNOMEM, pf, s, 0, 0);
+        if (fsize) memset(frame, 0, fsize), pb_addsize(T->frames, fsize);
+    }
+    while (pb_readvarint32(&s, &tag)) {
+        const pb_Field *f = pb_field(t, pb_gettag(tag));
+        size_t i = lpbT_count(T), n;
+        unsigned *first;
+        if (f == NULL) {
+            pb_skipvalue(&s, tag);
+            continue;
+        }
+        if (!lpbT_field(T, f, tag, &s, emit, &n)) return 0;
+        if (!emit || lpbT_count(T) == i) continue; /* dead types */
+        first = lpbT_frame(T, base/sizeof(unsigned) + f->sorted_idx - 1);
+        if (*first == 0) {
+            *first = (unsigned)i + 1;
+            nhash += f->oneof_idx ? 2 : 1;
+        }
+        lpbT_item(T, *first - 1)->count += (unsigned)n;
+    }
+    if (!emit) return 1;
+    lpbT_item(T, head)->size = nhash;
+    pb_bufflen(T->frames) = (unsigned)base;
+    return lpbT_push(T, LPB_KEND, NULL, s.p, 0);
+}
+
+static int lpbT_message(lpb_Tape *T, const pb_Type *t, const pb_Field *pf, pb_Slice s, int emit) {
+    int ok;
+    if (T->depth >= LPB_MAXDEPTH)
+        return lpbT_error(T, LPB_TDEPTH, pf, s, 0, 0);
+    ++T->depth, ok = lpbT_fields(T, t, pf, s, emit), --T->depth;
+    return ok;
+}
+
+static int lpbT_parse(lpb_Tape *T, const pb_Type *t, pb_Slice s) {
+    T->error = LPB_TOK, T->depth = 0;
+    return lpbT_message(T, t, NULL, s, 1);
+}
+
+static int lpbT_raise(lua_State *L, const lpb_Tape *T, int idx) {
+    int pos = (int)T->epos + 1, len = (int)T->elen;
+    switch (T->error) {
+    case LPB_TVARINT:
+        lua_pushfstring(L, "invalid varint value at offset %d", pos); break;
+    case LPB_TFIXED32:
+        lua_pushfstring(L, "invalid fixed32 value at offset %d", pos); break;
+    case LPB_TFIXED64:
+        lua_pushfstring(L, "invalid fixed64 value at offset %d", pos); break;
+    case LPB_TBYTESLEN:
+        lua_pushfstring(L, "invalid bytes length: %d (at offset %d)", len, pos);
+        break;
+    case LPB_TUNFINISHED:
+        lua_pushfstring(L, "unfinished bytes (len %d at offset %d)", len, pos);
+        break;
+    case LPB_TMISMATCH:
+        lpb_pushmismatch(L, T->ef, T->etag, T->epos); break;
+    case LPB_TDEPTH:
+        lua_pushfstring(L, "message nested too deeply at offset %d", pos);
+        break;
+    case LPB_TUNKNOWN:
+        lua_pushfstring(L, "unknown type %s (%d)",
+                pb_typename(T->ef->type_id, NULL), T->ef->type_id);
+        break;
+    default: lua_pushliteral(L, "out of memory");
+    }
+    if (idx == 0) return luaL_error(L, "%s", lua_tostring(L, -1));
+    return luaL_error(L, "%s in message #%d", lua_tostring(L, -1), idx);
+}
+
+static size_t lpbT_build(lpb_Env *e, const lpb_Tape *T, const pb_Type *t, size_t i);
+
+static size_t lpbT_skip(const lpb_Tape *T, size_t i) {
+    /* the item after the message starting at item i */
+    int depth = 0;
+    do {
+        unsigned kind = lpbT_item(T, i++)->kind;
+        depth += kind == LPB_KMESSAGE ? 1 : kind == LPB_KEND ? -1 : 0;
+    } while (depth > 0);
+    return i;
+}
+
+static size_t lpbT_pushvalue(lpb_Env *e, const lpb_Tape *T, size_t i) {
+    const lpb_TapeItem *it = lpbT_item(T, i);
+    pb_Slice s = pb_lslice(it->p, it->len);
+    int kind;
+    if (it->kind != LPB_KMESSAGE)
+        return e->s = &s, lpbD_field(e, it->f), i + 1;
+    if ((kind = lpb_wktkind(e->L, e->LS, it->f->type)) != LPB_WNONE) {
+        lpbD_wkt(e, it->f->type, kind, s);
+        if (e->LS->use_dec_hooks) lpb_usedechooks(e->L, e->LS, it->f->type);
+        return lpbT_skip(T, i);
+    }
+    lpb_pushtypetablex(e->L, e->LS, it->f->type, (int)it->size);
+    return lpbT_build(e, T, it->f->type, i + 1);
+}
+
+static size_t lpbT_repeated(lpb_Env *e, const lpb_Tape *T, size_t i) {
+    lua_State *L = e->L;
+    const lpb_TapeItem *it = lpbT_item(T, i);
+    const pb_Field *f = it->f;
+    int first, len;
+    lpb_fetchtable(L, e->LS, f, f->type && f->type->is_map ?
+            &e->LS->map_type : &e->LS->array_type, (int)it->count);
+    first = (len = (int)lua_rawlen(L, -1)) + 1;
+    do {
+        pb_Slice s = pb_lslice(it->p, it->len);
+        e->s = &s;
+        if (it->kind == LPB_KMAP)
+            lpbD_map(e, f), ++i;
+        else if (it->kind != LPB_KPACKED)
+            i = lpbT_pushvalue(e, T, i), lua_rawseti(L, -2, ++len);
+        else {
+            while (s.p < s.end)
+                lpbD_field(e, f), lua_rawseti(L, -2, ++len);
+            ++i;
+        }
+    } while ((it = lpbT_item(T, i))->f == f);
+    if (e->LS->use_dec_hooks && len >= first)
+        lpb_usebatchhooks(L, e->LS, f->type, first);
+    lua_pop(L, 1);
+    return i;
+}
+
+static size_t lpbT_build(lpb_Env *e, const lpb_Tape *T, const pb_Type *t, size_t i) {
+    lua_State *L = e->L;
+    const lpb_TapeItem *it;
+    luaL_checkstack(L, 5, "not enough stack space for fields");
+    while ((it = lpbT_item(T, i))->kind != LPB_KEND) {
+        const pb_Field *f = it->f;
+        if ((f->type && f->type->is_map) || f->repeated) {
+            i = lpbT_repeated(e, T, i);
+            continue;
+        }
+        lua_pushstring(L, (const char*)f->name);
+        if (f->oneof_idx) {
+            lua_pushstring(L, (const char*)pb_oneofname(t, f->oneof_idx));
+            lua_pushvalue(L, -2);
+            lua_rawset(L, -4);
+        }
+        i = lpbT_pushvalue(e, T, i);
+        lua_rawset(L, -3);
+    }
     if (e->LS->use_dec_hooks) lpb_usedechooks(L, e->LS, t);
+    return i + 1;
+}
+
+static int lpbT_decode(lua_State *L, lpb_State *LS, const pb_Type *t, pb_Slice s, int start) {
+    lpb_Tape T;
+    lpb_Env e;
+    memset(&T, 0, sizeof(lpb_Tape));
+    if (LS->use_dec_hooks) /* hooks may decode again, use a private tape */
+        T.items = lpb_newbuffer(L), T.frames = lpb_newbuffer(L);
+    else
+        T.items = &LS->tape, T.frames = &LS->tapeframes;
+    pb_bufflen(T.items) = pb_bufflen(T.frames) = 0;
+    if (!lpbT_parse(&T, t, s)) return lpbT_raise(L, &T, 0);
+    if (lua_istable(L, start))
+        lua_pushvalue(L, start);
+    else
+        lpb_pushtypetablex(L, LS, t, (int)lpbT_item(&T, 0)->size);
+    e.L = L, e.LS = LS, e.b = NULL, e.s = &s;
+    lpbT_build(&e, &T, t, 1);
     return 1;
 }
 
-static int lpbD_decode(lua_State *L, pb_Slice s, int start) {
-    lpb_State *LS = lpb_lstate(L);
-    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+static int lpbD_decodeto(lua_State *L, lpb_State *LS, const pb_Type *t, pb_Slice s, int start) {
+    /* decode into the table at start, or a new one */
     lpb_Env e;
-    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    int tables = 0;
     lua_settop(L, start);
+    if (lpb_recycling(LS)) return lpbR_decode(L, LS, t, s, start);
+    if (LS->decode_two_pass) return lpbT_decode(L, LS, t, s, start);
     if (!lua_istable(L, start)) {
         lua_pop(L, 1);
-        lpb_pushtypetable(L, LS, t);
+        tables = lpbD_newtable(L, LS, t);
     }
     e.L = L, e.LS = LS, e.s = &s;
-    return lpbD_message(&e, t);
+    return lpbD_message(&e, t, tables);
+}
+
+static int lpbD_decode(lua_State *L, pb_Slice s, int start) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    return lpbD_decodeto(L, LS, t, s, start);
+}
+
+static int lpbD_decoderope(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    lpb_Env e;
+    lpb_Rope R;
+    int tables = 0;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    lua_settop(L, 3);
+    lpb_initrope(L, &R, 2);
+    if (lua_istable(L, 3))
+        lua_pushvalue(L, 3);
+    else
+        tables = lpbD_newtable(L, LS, t);
+    e.L = L, e.LS = LS, e.s = NULL;
+    return lpbD_rope(&e, t, &R, tables);
 }
 
 static int Lpb_decode(lua_State *L) {
+    if (lua_istable(L, 2)) return lpbD_decoderope(L);
     return lpbD_decode(L, lua_isnoneornil(L, 2) ?
             pb_lslice(NULL, 0) :
             lpb_checkslice(L, 2), 3);
 }
 
+/* single field extraction, see Lpb_get() */
+
+#define LPB_MAXPATH 64
+
+static const pb_Field *lpb_pathfield(lua_State *L, const pb_Type *t, const pb_Field *f, const char *name, int last) {
+    argcheck(L, f != NULL, 3, "field '%s' does not exists in '%s'",
+            name, (const char*)t->name);
+    argcheck(L, last || (!f->repeated && f->type_id == PB_Tmessage
+                && f->type != NULL), 3,
+            "field '%s' is not a single message", (const char*)f->name);
+    return f;
+}
+
+static int lpb_pushpath(lua_State *L, lpb_State *LS, const pb_Type *t, const pb_Field **path) {
+    /* resolve the path at index 3 to the fields in path, and push them
+     * packed in a string; paths given as strings are cached by type */
+    int n = 0, ispath = lua_type(L, 3) == LUA_TSTRING;
+    if (ispath) {
+        LS->paths_index = lpb_reftable(L, LS->paths_index);
+        if (lua53_rawgetp(L, -1, t) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, -3, t);
+        }
+        lua_pushvalue(L, 3);
+        lua_rawget(L, -2);
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            n = (int)(lua_rawlen(L, -1) / sizeof(pb_Field*));
+            memcpy((void*)path, lua_tostring(L, -1), n * sizeof(pb_Field*));
+            lua_replace(L, -3);
+            lua_pop(L, 1);
+            return n;
+        }
+        lua_pop(L, 1);
+    }
+    if (ispath) {
+        pb_Slice s = lpb_toslice(L, 3);
+        const char *dot;
+        do {
+            pb_Slice name = s;
+            if ((dot = (const char*)memchr(s.p, '.', pb_len(s))) != NULL)
+                name.end = dot, s.p = dot + 1;
+            argcheck(L, n < LPB_MAXPATH, 3, "path too long");
+            lua_pushlstring(L, name.p, pb_len(name));
+            path[n] = lpb_pathfield(L, t, pb_fname(t, lpb_name(LS, name)),
+                    lua_tostring(L, -1), dot == NULL);
+            lua_pop(L, 1);
+            t = path[n++]->type;
+        } while (dot != NULL);
+    } else {
+        int i, len = (int)lua_rawlen(L, 3);
+        argcheck(L, len > 0, 3, "empty path");
+        argcheck(L, len <= LPB_MAXPATH, 3, "path too long");
+        for (i = 1; i <= len; ++i, ++n) {
+            const pb_Field *f;
+            lua_rawgeti(L, 3, i);
+            f = lpb_field(L, -1, t);
+            path[n] = lpb_pathfield(L, t, f, lua_tostring(L, -1), i == len);
+            lua_pop(L, 1);
+            t = path[n]->type;
+        }
+    }
+    lua_pushlstring(L, (const char*)path, n * sizeof(pb_Field*));
+    if (ispath) {
+        lua_pushvalue(L, 3);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+    }
+    return n;
+}
+
+static void lpbD_path(lpb_Env *e, const pb_Field **path, int n) {
+    /* look for path[0] in the message of e->s, entering only the last
+     * occurrence of each message along the path as pb.decode() keeps only
+     * that one; values of the last field go to the value on top */
+    const pb_Field *f = path[0];
+    pb_Slice last = pb_lslice(NULL, 0), *s = e->s;
+    uint32_t tag;
+    while (pb_readvarint32(s, &tag)) {
+        if (pb_gettag(tag) != (uint32_t)f->number)
+            pb_skipvalue(s, tag);
+        else if (n > 1)
+            lpbD_checktype(e, f, tag), lpb_readbytes(e->L, s, &last);
+        else if (f->type && f->type->is_map)
+            lpbD_checktype(e, f, tag), lpbD_map(e, f);
+        else if (f->repeated)
+            lpbD_repeated(e, f, tag);
+        else {
+            lpbD_checktype(e, f, tag), lpbD_field(e, f);
+            lua_replace(e->L, -2); /* the last one wins */
+        }
+    }
+    if (last.p != NULL)
+        lpb_withinput(e, &last, s, lpbD_path(e, path + 1, n - 1));
+}
+
+static int Lpb_get(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    pb_Slice s = lpb_checkslice(L, 2);
+    const pb_Field *path[LPB_MAXPATH], *f;
+    lpb_Env e;
+    int n;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    if (lua_type(L, 3) != LUA_TSTRING && !lua_istable(L, 3))
+        lpb_typeerror(L, 3, "string or table");
+    lua_settop(L, 3);
+    n = lpb_pushpath(L, LS, t, path);
+    f = path[n - 1];
+    if (f->repeated) lua_newtable(L);
+    else lua_pushnil(L);
+    e.L = L, e.LS = LS, e.b = NULL, e.s = &s;
+    lpbD_path(&e, path, n);
+    return 1;
+}
+
+/* service methods: request and response handles */
+
+static const pb_Type *lpb_handletype(lua_State *L, lpb_State **pLS) {
+    /* upvalues: type, pin of a shared version, state, local version */
+    lpb_State *LS = (lpb_State*)lua_touserdata(L, lua_upvalueindex(3));
+    if (lua_isnil(L, lua_upvalueindex(2)) && LS->local_version
+            != (unsigned)lua_tointeger(L, lua_upvalueindex(4)))
+        luaL_error(L, "method handle is stale, its types were freed");
+    *pLS = LS;
+    return (const pb_Type*)lua_touserdata(L, lua_upvalueindex(1));
+}
+
+static int Lmethod_decode(lua_State *L) {
+    lpb_State *LS;
+    const pb_Type *t = lpb_handletype(L, &LS);
+    return lpbD_decodeto(L, LS, t, lua_isnoneornil(L, 1) ?
+            pb_lslice(NULL, 0) : lpb_checkslice(L, 1), 2);
+}
+
+static int Lmethod_encode(lua_State *L) {
+    lpb_State *LS;
+    const pb_Type *t = lpb_handletype(L, &LS);
+    return lpbE_encodeto(L, LS, t, 1);
+}
+
+static const pb_Type *lpb_methodtype(lpb_State *LS, const pb_Type *t) {
+    const pb_Type *lt = NULL;
+    if (!t->is_defined && lpbS_state(LS) == &LS->local)
+        lt = pb_loadtype(&LS->local, t->name); /* build lazily loaded type */
+    return lt ? lt : t;
+}
+
+static void lpb_pushhandle(lua_State *L, lpb_State *LS, const pb_Type *t, lua_CFunction f, const char *field) {
+    lua_pushlightuserdata(L, (void*)t);
+    lua_pushvalue(L, -4); /* the pin keeps a shared version alive */
+    lua_pushvalue(L, -4);
+    lua_pushinteger(L, (lua_Integer)LS->local_version);
+    lua_pushcclosure(L, f, 4);
+    lua_setfield(L, -2, field);
+}
+
+static int Lpb_method(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    pb_Slice s = lpb_checkslice(L, 1);
+    const pb_Method *m;
+    const pb_Type *in, *out;
+    pb_Buffer b;
+    if (s.p == s.end) return 0;
+    pb_initbuffer(&b);
+    if (*s.p != '.') { /* "pkg.Svc/Method" or "/pkg.Svc/Method" */
+        *pb_prepbuffsize(&b, 1) = '.', pb_addsize(&b, 1);
+        if (*s.p == '/') ++s.p;
+    }
+    lpb_checkmem(L, pb_addslice(&b, s));
+    m = pb_method(lpbS_state(LS), pb_name(lpbS_state(LS), pb_result(&b), NULL));
+    pb_resetbuffer(&b);
+    if (m == NULL) return 0;
+    in  = lpb_methodtype(LS, m->input);
+    out = lpb_methodtype(LS, m->output);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LS->shared_ref);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, state_name);
+    lua_createtable(L, 0, 9);
+    lua_pushstring(L, (const char*)m->name);
+    lua_setfield(L, -2, "name");
+    lua_pushstring(L, (const char*)in->name);
+    lua_setfield(L, -2, "input");
+    lua_pushstring(L, (const char*)out->name);
+    lua_setfield(L, -2, "output");
+    lua_pushboolean(L, m->client_streaming);
+    lua_setfield(L, -2, "client_streaming");
+    lua_pushboolean(L, m->server_streaming);
+    lua_setfield(L, -2, "server_streaming");
+    lpb_pushhandle(L, LS, in,  Lmethod_decode, "decode_request");
+    lpb_pushhandle(L, LS, in,  Lmethod_encode, "encode_request");
+    lpb_pushhandle(L, LS, out, Lmethod_decode, "decode_response");
+    lpb_pushhandle(L, LS, out, Lmethod_encode, "encode_response");
+    return 1;
+}
+
+/* batch decode: parse on worker threads, build tables on this one */
+
+#define LPB_MAXTHREADS 64
+
+typedef struct lpb_BatchItem {
+    pb_Slice s;
+    lpb_Tape tape;
+    size_t   head; /* index of the root item in the tape */
+} lpb_BatchItem;
+
+typedef struct lpb_Batch {
+    const pb_Type *t;
+    lpb_BatchItem *items;
+    size_t count, next;
+#ifndef LPB_NO_THREADS
+    pthread_mutex_t lock;
+#endif
+} lpb_Batch;
+
+typedef struct lpb_Worker {
+    lpb_Batch *B;
+    pb_Buffer *items;
+    pb_Buffer *frames;
+} lpb_Worker;
+
+static void *lpb_worker(void *ud) {
+    lpb_Worker *w = (lpb_Worker*)ud;
+    lpb_Batch *B = w->B;
+    for (;;) {
+        lpb_BatchItem *bi;
+        size_t i;
+#ifndef LPB_NO_THREADS
+        pthread_mutex_lock(&B->lock);
+        i = B->next++;
+        pthread_mutex_unlock(&B->lock);
+#else
+        i = B->next++;
+#endif
+        if (i >= B->count) break;
+        bi = &B->items[i];
+        bi->tape.items = w->items, bi->tape.frames = w->frames;
+        bi->head = lpbT_count(&bi->tape);
+        lpbT_parse(&bi->tape, B->t, bi->s);
+    }
+    return NULL;
+}
+
+#ifndef LPB_NO_THREADS
+/* the worker threads are started on first use and kept for later batches,
+ * until the last state that used them is closed */
+
+typedef struct lpb_Pool {
+    pthread_t threads[LPB_MAXTHREADS];
+    int nthreads;            /* started threads, worker i+1 is threads[i] */
+    int users;               /* states that used the pool */
+    int owned;               /* a batch or a shutdown owns the pool */
+    int quit;
+    unsigned job;            /* bumped for each posted job */
+    lpb_Worker *ws;          /* workers of the posted job */
+    int nws, busy;           /* and how many of the threads still work */
+} lpb_Pool;
+
+static lpb_Pool pool; /* guarded by pool_lock */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_wake = PTHREAD_COND_INITIALIZER; /* job or quit */
+static pthread_cond_t  pool_done = PTHREAD_COND_INITIALIZER; /* busy is 0 */
+
+static void *lpb_poolthread(void *ud) {
+    int id = (int)(size_t)ud;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!pool.quit && pool.job == seen)
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        if (pool.quit) break;
+        seen = pool.job;
+        if (id >= pool.nws) continue;
+        pthread_mutex_unlock(&pool_lock);
+        lpb_worker(&pool.ws[id]);
+        pthread_mutex_lock(&pool_lock);
+        if (--pool.busy == 0) pthread_cond_signal(&pool_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+static void lpb_poolrelease(void) {
+    /* stop the threads with the last user, as the library may be unloaded
+     * after it */
+    int i, n;
+    pthread_mutex_lock(&pool_lock);
+    if (--pool.users > 0 || pool.owned) {
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+    pool.owned = pool.quit = 1, n = pool.nthreads;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 0; i < n; ++i)
+        pthread_join(pool.threads[i], NULL);
+    pthread_mutex_lock(&pool_lock);
+    pool.nthreads = pool.quit = pool.owned = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
+#endif
+
+static void lpb_runworkers(lpb_State *LS, lpb_Batch *B, lpb_Worker *ws, int n) {
+#ifndef LPB_NO_THREADS
+    int posted = 0;
+    pthread_mutex_init(&B->lock, NULL);
+    pthread_mutex_lock(&pool_lock);
+    if (n > 1 && !pool.owned) { /* else this thread works alone */
+        if (!LS->pool_user) LS->pool_user = 1, ++pool.users;
+        for (; pool.nthreads < n - 1; ++pool.nthreads)
+            if (pthread_create(&pool.threads[pool.nthreads], NULL,
+                        lpb_poolthread, (void*)(size_t)(pool.nthreads + 1)))
+                break;
+        if (n > pool.nthreads + 1) n = pool.nthreads + 1;
+        pool.owned = posted = 1;
+        pool.ws = ws, pool.nws = n, pool.busy = n - 1, ++pool.job;
+        pthread_cond_broadcast(&pool_wake);
+    }
+    pthread_mutex_unlock(&pool_lock);
+#else
+    (void)LS, (void)B, (void)n;
+#endif
+    lpb_worker(&ws[0]); /* this thread works too */
+#ifndef LPB_NO_THREADS
+    if (posted) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool.busy > 0)
+            pthread_cond_wait(&pool_done, &pool_lock);
+        pool.owned = 0, pool.ws = NULL, pool.nws = 0;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    pthread_mutex_destroy(&B->lock);
+#endif
+}
+
+static int lpb_cpucount(void) {
+#if !defined(LPB_NO_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > LPB_MAXTHREADS ? LPB_MAXTHREADS : (int)n;
+#else
+    return 1;
+#endif
+}
+
+static void lpbT_prepare(lua_State *L, const pb_Type *t) {
+    const pb_Field *f = NULL;
+    if (lua53_rawgetp(L, -1, t) != LUA_TNIL) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    lua_pushboolean(L, 1);
+    lua_rawsetp(L, -2, t);
+    /* workers read fields in sorted order, sort them here */
+    lpb_checkmem(L, t->field_count == 0 || pb_sortedfields(t) != NULL);
+    while (pb_nextfield(t, &f))
+        if (f->type && !f->type->is_enum) lpbT_prepare(L, f->type);
+}
+
+static int Lpb_decode_batch(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    int i, n, count, nthreads = (int)luaL_optinteger(L, 3, 0);
+    lpb_Worker *ws;
+    lpb_Batch B;
+    lpb_Env e;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 3);
+    count = (int)lua_rawlen(L, 2);
+    memset(&B, 0, sizeof(lpb_Batch));
+    B.t = t, B.count = (size_t)count;
+    B.items = (lpb_BatchItem*)lua_newuserdata(L, /* 4 */
+            (count ? count : 1) * sizeof(lpb_BatchItem));
+    lua_createtable(L, count, 0); /* 5: keep data alive until done */
+    for (i = 0; i < count; ++i) {
+        lua53_rawgeti(L, 2, i+1);
+        B.items[i].s = lpb_toslice(L, -1);
+        argcheck(L, B.items[i].s.p != NULL, 2,
+                "string/buffer/slice expected at #%d, got %s",
+                i+1, luaL_typename(L, -1));
+        lua_rawseti(L, 5, i+1);
+    }
+    lua_newtable(L);
+    lpbT_prepare(L, t);
+    lua_pop(L, 1);
+    if (nthreads <= 0) nthreads = lpb_cpucount();
+    n = nthreads < count ? nthreads : count > 0 ? count : 1;
+    if (n > LPB_MAXTHREADS) n = LPB_MAXTHREADS;
+    ws = (lpb_Worker*)lua_newuserdata(L, n * sizeof(lpb_Worker)); /* 6 */
+    for (i = 0; i < n; ++i) { /* buffers are freed by GC, even on errors */
+        ws[i].B = &B;
+        ws[i].items = lpb_newbuffer(L);
+        ws[i].frames = lpb_newbuffer(L);
+    }
+    lpb_runworkers(LS, &B, ws, n);
+    for (i = 0; i < count; ++i)
+        if (B.items[i].tape.error != LPB_TOK)
+            return lpbT_raise(L, &B.items[i].tape, i+1);
+    lua_createtable(L, count, 0);
+    e.L = L, e.LS = LS, e.b = NULL;
+    for (i = 0; i < count; ++i) {
+        lpb_BatchItem *bi = &B.items[i];
+        e.s = &bi->s;
+        lpb_pushtypetablex(L, LS, t, (int)lpbT_item(&bi->tape, bi->head)->size);
+        lpbT_build(&e, &bi->tape, t, bi->head + 1);
+        lua_rawseti(L, -2, i+1);
+    }
+    return 1;
+}
+
 void lpb_pushunpackdef(lua_State* L, lpb_State* LS, const pb_Type* t, pb_Field** l, int top) {
     int mode = t->is_proto3 && LS->encode_mode == LPB_DEFDEF ?
         LPB_COPYDEF : LS->encode_mode;
@@ -1961,7 +4807,7 @@ void lpb_pushunpackdef(lua_State* L, lpb_State* LS, const pb_Type* t, pb_Field**
     if (mode != LPB_COPYDEF && mode != LPB_METADEF) return;
     for (i = 0; i < t->field_count; i++) {
         int idx = top + i + 1;
-        if (lua_isnoneornil(L, idx) && lpb_pushdeffield(L, LS, l[i], t->is_proto3))
+        if (lua_isnoneornil(L, idx) && lpb_pushdeffield(L, LS, t, l[i], t->is_proto3))
             lua_replace(L, idx);
     }
 }
@@ -2016,6 +4862,239 @@ static int Lpb_unpack(lua_State* L) {
     return lpbD_unpack(&e, t);
 }
 
+/* native message objects */
+
+#define lpbM_name(m,s) pb_name((m)->S, (s), &(m)->LS->cache)
+
+static lpb_Message *lpbM_new(lua_State *L, const pb_Type *t, const lpb_Message *parent) {
+    lpb_Message *m = (lpb_Message*)lua_newuserdata(L, sizeof(lpb_Message));
+    m->t = t, m->LS = NULL;
+    m->state_ref = m->shared_ref = LUA_NOREF;
+    pb_inittable(&m->fields, sizeof(lpb_MsgEntry));
+    luaL_setmetatable(L, PB_MESSAGE);
+    if (parent == NULL)
+        lua_rawgetp(L, LUA_REGISTRYINDEX, state_name);
+    else
+        lua_rawgeti(L, LUA_REGISTRYINDEX, parent->state_ref);
+    m->LS = (lpb_State*)lua_touserdata(L, -1);
+    m->S = parent ? parent->S : lpbS_state(m->LS);
+    m->version = parent ? parent->version : m->LS->local_version;
+    m->state_ref = luaL_ref(L, LUA_REGISTRYINDEX); /* pin types */
+    lua_rawgeti(L, LUA_REGISTRYINDEX,
+            parent ? parent->shared_ref : m->LS->shared_ref);
+    if (lua_isnil(L, -1)) lua_pop(L, 1);
+    else m->shared_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return m;
+}
+
+static pb_Buffer *lpbM_slot(lua_State *L, lpb_Message *m, int32_t number) {
+    lpb_MsgEntry *me = (lpb_MsgEntry*)pb_settable(&m->fields, number);
+    lpb_checkmem(L, me != NULL);
+    return &me->value;
+}
+
+static void lpbM_clearoneof(lpb_Message *m, const pb_Field *f) {
+    const pb_Field *of = NULL;
+    while (pb_nextfield(m->t, &of)) {
+        lpb_MsgEntry *me;
+        if (of == f || of->oneof_idx != f->oneof_idx) continue;
+        me = (lpb_MsgEntry*)pb_gettable(&m->fields, of->number);
+        if (me != NULL) pb_bufflen(&me->value) = 0;
+    }
+}
+
+static void lpbM_parse(lua_State *L, lpb_Message *m, pb_Slice s) {
+    const char *p = s.p;
+    uint32_t tag;
+    while (pb_readvarint32(&s, &tag)) {
+        int32_t number = (int32_t)pb_gettag(tag);
+        const pb_Field *f = pb_field(m->t, number);
+        if (number == 0 || pb_skipvalue(&s, tag) == 0)
+            luaL_error(L, "invalid field at offset %d", (int)(p-s.start)+1);
+        if (f && f->oneof_idx) lpbM_clearoneof(m, f);
+        lpbM_addslice(L, lpbM_slot(L, m, number), pb_lslice(p, s.p - p));
+        p = s.p;
+    }
+    if (s.p < s.end)
+        luaL_error(L, "invalid varint value at offset %d", pb_pos(s)+1);
+}
+
+static int lpbM_pushfield(lua_State *L, lpb_Message *m, const pb_Field *f) {
+    const lpb_MsgEntry *me = (const lpb_MsgEntry*)pb_gettable(
+            &m->fields, f->number);
+    pb_Slice s = me ? pb_result(&me->value) : pb_lslice(NULL, 0);
+    lpb_Env e;
+    uint32_t tag;
+    if (m->LS->use_dec_hooks && pb_len(s)) { /* hooks may modify m */
+        push_slice(L, s);
+        s = lpb_toslice(L, -1);
+    }
+    e.L = L, e.LS = m->LS, e.b = NULL, e.s = &s;
+    if ((f->type && f->type->is_map) || f->repeated) {
+        int len = 0;
+        lua_newtable(L);
+        while (pb_readvarint32(&s, &tag)) {
+            if (!f->type || !f->type->is_map)
+                len = lpbD_append(&e, f, tag, len);
+            else
+                lpbD_checktype(&e, f, tag), lpbD_map(&e, f);
+        }
+        if (m->LS->use_dec_hooks && len)
+            lpb_usebatchhooks(L, m->LS, f->type, 1);
+    } else if (f->type_id == PB_Tmessage
+            && lpb_wktkind(L, m->LS, f->type) == LPB_WNONE) {
+        pb_Slice v = pb_lslice(NULL, 0);
+        if (pb_len(s) == 0 || f->type == NULL || f->type->is_dead)
+            return lua_pushnil(L), 1;
+        while (pb_readvarint32(&s, &tag)) /* the last one wins */
+            lpbD_checktype(&e, f, tag), lpb_readbytes(L, &s, &v);
+        lpbM_parse(L, lpbM_new(L, f->type, m), v);
+    } else if (pb_len(s) == 0) {
+        if (!lpb_pushdeffield(L, m->LS, m->t, f, m->t->is_proto3))
+            lua_pushnil(L);
+    } else {
+        lua_pushnil(L);
+        while (pb_readvarint32(&s, &tag)) /* last one wins */
+            lpbD_checktype(&e, f, tag), lpbD_field(&e, f), lua_replace(L, -2);
+    }
+    return 1;
+}
+
+static int lpbM_pushoneof(lua_State *L, const lpb_Message *m, pb_Slice name) {
+    const pb_Name *n = lpbM_name(m, name);
+    const pb_Entry *e = NULL;
+    while (n != NULL && pb_nextentry(&m->t->oneof_index, &e)) {
+        const pb_Field *f = NULL;
+        if (((const pb_OneofEntry*)e)->name != n) continue;
+        while (pb_nextfield(m->t, &f)) {
+            const lpb_MsgEntry *me;
+            if (f->oneof_idx != (uint32_t)e->key) continue;
+            me = (const lpb_MsgEntry*)pb_gettable(&m->fields, f->number);
+            if (me != NULL && pb_bufflen(&me->value) != 0)
+                return lua_pushstring(L, (const char*)f->name), 1;
+        }
+    }
+    return lua_pushnil(L), 1;
+}
+
+static void lpbM_setfield(lua_State *L, lpb_Message *m, const pb_Field *f, int idx) {
+    pb_Buffer *b;
+    lpb_Env e;
+    e.L = L, e.LS = m->LS, e.b = &m->LS->buffer, e.s = NULL;
+    pb_bufflen(e.b) = 0;
+    if (!lua_isnil(L, idx)) lpb_encode_onefield(&e, idx, m->t, f);
+    if (f->oneof_idx && pb_bufflen(e.b)) lpbM_clearoneof(m, f);
+    b = lpbM_slot(L, m, f->number);
+    pb_bufflen(b) = 0;
+    lpbM_addslice(L, b, pb_result(e.b));
+}
+
+static lpb_Message *lpbM_check(lua_State *L, int idx) {
+    lpb_Message *m = check_message(L, idx);
+    if (lpbM_isstale(m))
+        luaL_error(L, "pb.Message is stale, its types were freed");
+    return m;
+}
+
+static int Lmsg_delete(lua_State *L) {
+    lpb_Message *m = test_message(L, 1);
+    if (m != NULL) {
+        const pb_Entry *e = NULL;
+        while (pb_nextentry(&m->fields, &e))
+            pb_resetbuffer(&((lpb_MsgEntry*)e)->value);
+        pb_freetable(&m->fields);
+        luaL_unref(L, LUA_REGISTRYINDEX, m->state_ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, m->shared_ref);
+        m->state_ref = m->shared_ref = LUA_NOREF;
+    }
+    return 0;
+}
+
+static int Lmsg_tostring(lua_State *L) {
+    lpb_Message *m = lpbM_check(L, 1);
+    return (void)lua_pushfstring(L, "pb.Message(%s): %p",
+            (const char*)m->t->name, m), 1;
+}
+
+static int Lmsg_index(lua_State *L) {
+    lpb_Message *m = lpbM_check(L, 1);
+    const pb_Field *f;
+    pb_Slice name;
+    if (lua_type(L, 2) != LUA_TSTRING) return lua_pushnil(L), 1;
+    name = lpb_toslice(L, 2); /* fields shadow the methods */
+    if ((f = pb_fname(m->t, lpbM_name(m, name))) != NULL)
+        return lpbM_pushfield(L, m, f);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (!lua_isnil(L, -1)) return 1;
+    return lpbM_pushoneof(L, m, name);
+}
+
+static int Lmsg_newindex(lua_State *L) {
+    lpb_Message *m = lpbM_check(L, 1);
+    const pb_Field *f;
+    luaL_checktype(L, 2, LUA_TSTRING);
+    f = pb_fname(m->t, lpbM_name(m, lpb_toslice(L, 2)));
+    argcheck(L, f != NULL, 2, "field '%s' does not exist in type '%s'",
+            lua_tostring(L, 2), (const char*)m->t->name);
+    lua_settop(L, 3);
+    lpbM_setfield(L, m, f, 3);
+    return 0;
+}
+
+static int Lmsg_encode(lua_State *L) {
+    lpb_Message *m = lpbM_check(L, 1);
+    pb_Buffer *b = test_buffer(L, 2);
+    if (b != NULL) return lpbM_writeto(L, m, b), lua_settop(L, 2), 1;
+    b = &m->LS->buffer, pb_bufflen(b) = 0;
+    lpbM_writeto(L, m, b);
+    return lpb_pushbuffer(L, b), 1;
+}
+
+static int Lmsg_totable(lua_State *L) {
+    lpb_Message *m = lpbM_check(L, 1);
+    pb_Buffer *b = &m->LS->buffer;
+    pb_Slice s;
+    lpb_Env e;
+    int tables;
+    pb_bufflen(b) = 0;
+    lpbM_writeto(L, m, b);
+    lua_pushlstring(L, pb_buffer(b), pb_bufflen(b));
+    s = lpb_toslice(L, -1);
+    tables = lpbD_newtable(L, m->LS, m->t);
+    e.L = L, e.LS = m->LS, e.b = NULL, e.s = &s;
+    return lpbD_message(&e, m->t, tables);
+}
+
+static int Lpb_new(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    lpb_Message *m;
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    m = lpbM_new(L, t, NULL);
+    if (lua_istable(L, 2)) {
+        lpb_Env e;
+        e.L = L, e.LS = LS, e.b = &LS->buffer, e.s = NULL;
+        pb_bufflen(e.b) = 0;
+        if (LS->use_enc_hooks) lpb_useenchooks(&e, 2, t);
+        lpbE_encode(&e, 2, t);
+        lpbM_parse(L, m, pb_result(e.b));
+    }
+    return 1;
+}
+
+static int Lpb_parse(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    const pb_Type *t = lpb_type(L, LS, lpb_checkslice(L, 1));
+    pb_Slice s = lua_isnoneornil(L, 2) ?
+        pb_lslice(NULL, 0) : lpb_checkslice(L, 2);
+    argcheck(L, t!=NULL, 1, "type '%s' does not exists", lua_tostring(L, 1));
+    lpbM_parse(L, lpbM_new(L, t, NULL), s);
+    return 1;
+}
+
 /* pb module interface */
 
 static int Lpb_option(lua_State *L) {
@@ -2041,6 +5120,14 @@ static int Lpb_option(lua_State *L) {
     X(18, disable_hooks,        LS->use_dec_hooks = 0)               \
     X(19, enable_enchooks,      LS->use_enc_hooks = 1)               \
     X(20, disable_enchooks,     LS->use_enc_hooks = 0)               \
+    X(21, decode_two_pass,      LS->decode_two_pass = 1)             \
+    X(22, no_decode_two_pass,   LS->decode_two_pass = 0)             \
+    X(23, lazy_load,            LS->lazy_load = 1)                   \
+    X(24, no_lazy_load,         LS->lazy_load = 0)                   \
+    X(25, decode_recycle,       LS->decode_recycle = 1)              \
+    X(26, no_decode_recycle,    LS->decode_recycle = 0)              \
+    X(27, encode_getters,       LS->encode_getters = 1)              \
+    X(28, no_encode_getters,    LS->encode_getters = 0)              \
 
     static const char *opts[] = {
 #define X(ID,NAME,CODE) #NAME,
@@ -2054,6 +5141,7 @@ static int Lpb_option(lua_State *L) {
         OPTS(X)
 #undef  X
     }
+    lpb_dropcache(L, LS);
     return 0;
 #undef  OPTS
 }
@@ -2062,19 +5150,33 @@ LUALIB_API int luaopen_pb(lua_State *L) {
     luaL_Reg libs[] = {
 #define ENTRY(name) { #name, Lpb_##name }
         ENTRY(clear),
+        ENTRY(reload),
+        ENTRY(freeze),
+        ENTRY(prune),
         ENTRY(load),
         ENTRY(loadfile),
+        ENTRY(save_snapshot),
+        ENTRY(load_snapshot),
+        ENTRY(save_image),
+        ENTRY(load_image),
         ENTRY(encode),
         ENTRY(decode),
+        ENTRY(decode_batch),
+        ENTRY(get),
         ENTRY(types),
         ENTRY(fields),
         ENTRY(type),
         ENTRY(field),
+        ENTRY(method),
         ENTRY(typefmt),
         ENTRY(enum),
         ENTRY(defaults),
+        ENTRY(warmup),
         ENTRY(hook),
+        ENTRY(batch_hook),
+        ENTRY(bind),
         ENTRY(encode_hook),
+        ENTRY(wellknown),
         ENTRY(tohex),
         ENTRY(fromhex),
         ENTRY(result),
@@ -2082,6 +5184,8 @@ LUALIB_API int luaopen_pb(lua_State *L) {
         ENTRY(state),
         ENTRY(pack),
         ENTRY(unpack),
+        ENTRY(new),
+        ENTRY(parse),
 #undef  ENTRY
         { NULL, NULL }
     };
@@ -2090,13 +5194,34 @@ LUALIB_API int luaopen_pb(lua_State *L) {
         { "setdefault", Lpb_state },
         { NULL, NULL }
     };
+    luaL_Reg msgmeta[] = {
+        { "__gc",       Lmsg_delete   },
+        { "__tostring", Lmsg_tostring },
+        { "__newindex", Lmsg_newindex },
+        { NULL, NULL }
+    };
+    luaL_Reg msgmethods[] = {
+        { "encode",  Lmsg_encode  },
+        { "totable", Lmsg_totable },
+        { NULL, NULL }
+    };
     if (luaL_newmetatable(L, PB_STATE)) {
         luaL_setfuncs(L, meta, 0);
         lua_pushvalue(L, -1);
         lua_setfield(L, -2, "__index");
     }
-    lua_pop(L, 1);
-    return luaL_newlib(L, libs), 1;
+    if (luaL_newmetatable(L, PB_MESSAGE)) {
+        luaL_setfuncs(L, msgmeta, 0);
+        luaL_setfuncs(L, msgmethods, 0); /* for messages with such fields */
+        luaL_newlib(L, msgmethods);
+        lua_pushcclosure(L, Lmsg_index, 1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 2);
+    luaL_newlib(L, libs);
+    lua_pushlightuserdata(L, NULL); /* google.protobuf.Value null */
+    lua_setfield(L, -2, "null");
+    return 1;
 }
 
 static int Lpb_decode_unsafe(lua_State *L) {
@@ -2120,15 +5245,47 @@ static int Lpb_touserdata(lua_State *L) {
     return 2;
 }
 
+static int Lpb_publish(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    lpb_Shared **box;
+    lpbS_checkmutable(L, LS);
+    lpb_loadall(L, LS);
+    lpbS_freeze(L, &LS->local);
+    box = lpbS_newbox(L);
+    lpb_checkmem(L, (*box = (lpb_Shared*)calloc(1, sizeof(lpb_Shared))) != NULL);
+    (*box)->state = LS->local, (*box)->refs = 1;
+    pb_init(&LS->local), ++LS->local_version;
+    lpbS_lock();
+    shared_state = *box;
+    lpbS_unlock();
+    lpbS_setshared(L, LS);
+    return 0;
+}
+
+static int Lpb_attach(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    lpb_Shared **box = lpbS_newbox(L);
+    lpbS_lock();
+    if ((*box = shared_state) != NULL) ++shared_state->refs;
+    lpbS_unlock();
+    if (*box == NULL) return lua_pushboolean(L, 0), 1;
+    lpbS_setshared(L, LS);
+    return lua_pushboolean(L, 1), 1;
+}
+
+static int Lpb_detach(lua_State *L) {
+    lpb_State *LS = lpb_lstate(L);
+    int attached = LS->shared != NULL;
+    lpbS_newbox(L);
+    lpbS_setshared(L, LS);
+    return lua_pushboolean(L, attached), 1;
+}
+
 static int Lpb_use(lua_State *L) {
     const char *opts[] = { "global", "local", NULL };
-    lpb_State *LS = lpb_lstate(L);
-    const pb_State *GS = global_state;
-    switch (luaL_checkoption(L, 1, NULL, opts)) {
-    case 0: if (GS) LS->state = GS; break;
-    case 1: LS->state = &LS->local; break;
-    }
-    return lua_pushboolean(L, GS != NULL), 1;
+    if (luaL_checkoption(L, 1, NULL, opts) == 0)
+        return Lpb_attach(L);
+    return Lpb_detach(L);
 }
 
 LUALIB_API int luaopen_pb_unsafe(lua_State *L) {
@@ -2138,6 +5295,9 @@ LUALIB_API int luaopen_pb_unsafe(lua_State *L) {
         { "slice",      Lpb_slice_unsafe  },
         { "touserdata", Lpb_touserdata    },
         { "use",        Lpb_use           },
+        { "publish",    Lpb_publish       },
+        { "attach",     Lpb_attach        },
+        { "detach",     Lpb_detach        },
         { NULL, NULL }
     };
     return luaL_newlib(L, libs), 1;
@@ -202,8 +202,10 @@ PB_API const pb_Name *pb_name (const pb_State *S, pb_Slice s, pb_Cache *cache);
 
 /* type info */
 
-typedef struct pb_Type  pb_Type;
-typedef struct pb_Field pb_Field;
+typedef struct pb_Type   pb_Type;
+typedef struct pb_Field  pb_Field;
+typedef struct pb_Method pb_Method;
+typedef struct pb_Default pb_Default;
 
 #define PB_OK     0
 #define PB_ERROR  1
@@ -211,6 +213,27 @@ typedef struct pb_Field pb_Field;
 
 PB_API int pb_load (pb_State *S, pb_Slice *s);
 
+#define PB_FLOADED   1 /* file status of the last load, see pb_nextfile() */
+#define PB_FSKIPPED  2
+#define PB_FREPLACED 3
+
+PB_API int pb_nextfile (const pb_State *S, const pb_Name **pname, int *pstatus);
+
+PB_API int pb_savesnapshot (const pb_State *S, pb_Buffer *b);
+PB_API int pb_loadsnapshot (pb_State *S, pb_Slice *s);
+
+PB_API int pb_freeze (pb_State *D, const pb_State *S);
+PB_API int pb_prune  (pb_State *S, const pb_Type **roots, size_t count);
+
+PB_API int pb_saveimage  (const pb_State *S, pb_Buffer *b);
+PB_API int pb_imageinfo  (pb_Slice s, const char **paddr, size_t *palign);
+PB_API int pb_relocimage (char *image, size_t size);
+PB_API int pb_useimage   (pb_State *S, const char *image, size_t size);
+
+PB_API int            pb_loadlazy (pb_State *S, pb_Slice *s);
+PB_API const pb_Type *pb_loadtype (pb_State *S, const pb_Name *tname);
+PB_API int            pb_loadall  (pb_State *S);
+
 PB_API pb_Type  *pb_newtype  (pb_State *S, pb_Name *tname);
 PB_API void      pb_deltype  (pb_State *S, pb_Type *t);
 PB_API pb_Field *pb_newfield (pb_State *S, pb_Type *t, pb_Name *fname, int32_t number);
@@ -221,6 +244,13 @@ PB_API const pb_Field *pb_fname (const pb_Type *t,  const pb_Name *tname);
 PB_API const pb_Field *pb_field (const pb_Type *t,  int32_t number);
 
 PB_API const pb_Name *pb_oneofname (const pb_Type *t, int oneof_index);
+/* replaces pb_Field.default_value, which is removed: read
+ * `pb_defaultvalue(t, f)` where `f->default_value` was read before, t is
+ * the type that has the field f */
+PB_API const pb_Name    *pb_defaultvalue (const pb_Type *t, const pb_Field *f);
+PB_API const pb_Default *pb_default      (const pb_Type *t, const pb_Field *f);
+
+PB_API const pb_Method *pb_method (const pb_State *S, const pb_Name *mname);
 
 PB_API int pb_nexttype  (const pb_State *S, const pb_Type **ptype);
 PB_API int pb_nextfield (const pb_Type *t, const pb_Field **pfield);
@@ -278,9 +308,9 @@ struct pb_Entry {
 
 typedef struct pb_NameEntry {
     struct pb_NameEntry *next;
-    unsigned hash     : 32;
-    unsigned length   : 16;
-    unsigned refcount : 16;
+    uint32_t hash;
+    uint32_t length;
+    uint32_t refcount; /* PB_MAX_REFCOUNT makes the name immortal */
 } pb_NameEntry;
 
 typedef struct pb_NameTable {
@@ -304,19 +334,29 @@ struct pb_State {
     pb_Table     types;
     pb_Pool      typepool;
     pb_Pool      fieldpool;
+    pb_Table     files;     /* file name -> hash of its loaded content */
+    unsigned     loads;     /* serial of the last load */
+    pb_Table     lazytypes; /* type name -> index of lazyunits */
+    pb_Buffer    lazyunits; /* descriptors of types not built yet */
+    void        *lazydata;  /* copies of lazily loaded schema data */
+    void        *frozen;    /* the block of a read only state, see pb_freeze() */
+    size_t       frozen_size;
+    int          frozen_image; /* the block is not owned, see pb_useimage() */
+    pb_Table     methods;   /* ".pkg.Service/Method" -> pb_Method */
 };
 
-struct pb_Field {
-    pb_Name *name;
+struct pb_Field { /* members read by the decoder first, the default value
+                    * is in pb_Type.defaults, see pb_defaultvalue() */
     pb_Type *type;
-    pb_Name *default_value;
+    pb_Name *name;
     int32_t  number;
-    uint32_t sorted_idx;
+    unsigned type_id     : 5; /* PB_T* enum */
+    unsigned repeated    : 1;
+    unsigned packed      : 1;
+    unsigned scalar      : 1;
+    unsigned default_idx : 23; /* 1 + its index in pb_Type.defaults, or 0 */
     uint32_t oneof_idx;
-    unsigned type_id    : 5; /* PB_T* enum */
-    unsigned repeated   : 1;
-    unsigned packed     : 1;
-    unsigned scalar     : 1;
+    uint32_t sorted_idx;
 };
 
 struct pb_Type {
@@ -326,6 +366,8 @@ struct pb_Type {
     pb_Table    field_tags;
     pb_Table    field_names;
     pb_Table    oneof_index;
+    pb_Default *defaults;    /* of the fields with a default, see pb_default() */
+    unsigned    default_count;
     unsigned    oneof_count; /* extra field count from oneof entries */
     unsigned    oneof_field; /* extra field in oneof declarations */
     unsigned    field_count : 28;
@@ -333,6 +375,25 @@ struct pb_Type {
     unsigned    is_map      : 1;
     unsigned    is_proto3   : 1;
     unsigned    is_dead     : 1;
+    unsigned    is_defined  : 1; /* not only referenced by a field */
+    unsigned    is_dense    : 1; /* frozen, numbers without holes, no field_tags */
+};
+
+struct pb_Default {
+    pb_Name *text;     /* as written in the schema */
+    union {
+        int64_t i;     /* integers, the bit pattern for unsigned types, bool */
+        double  d;     /* double and float */
+    } value;           /* parsed by the field type when loaded */
+    unsigned is_valid : 1; /* value holds a parsed number or bool */
+};
+
+struct pb_Method {
+    pb_Name *name;   /* ".pkg.Service/Method" */
+    pb_Type *input;  /* request type, may be not defined yet */
+    pb_Type *output; /* response type */
+    unsigned client_streaming : 1;
+    unsigned server_streaming : 1;
 };
 
 
@@ -348,6 +409,8 @@ PB_NS_END
 #define PB_MAX_HASHSIZE       ((unsigned)~0 - 100)
 #define PB_MIN_STRTABLE_SIZE  16
 #define PB_MIN_HASHTABLE_SIZE 8
+#define PB_MAX_REFCOUNT       (~(uint32_t)0)
+#define PB_MAX_DEFAULTS       ((1u<<23) - 1) /* see pb_Field.default_idx */
 #define PB_HASHLIMIT          5
 
 #include <assert.h>
@@ -881,7 +944,10 @@ PB_API size_t pb_resizetable(pb_Table *t, size_t size) {
     nt.hash->dead = 1;
     for (i = 0; i < rawsize; i += t->entry_size) {
         pb_Entry *olde = (pb_Entry*)((char*)t->hash + i);
-        pb_Entry *newe = pbT_newkey(&nt, olde->key);
+        pb_Entry *newe;
+        /* key 0 lives only in slot 0, elsewhere it is an empty slot */
+        if (olde->dead || (olde->key == 0 && i != 0)) continue;
+        newe = pbT_newkey(&nt, olde->key);
         if (nt.entry_size > sizeof(pb_Entry))
             memcpy(newe+1, olde+1, nt.entry_size - sizeof(pb_Entry));
     }
@@ -923,8 +989,13 @@ PB_API int pb_nextentry(const pb_Table *t, const pb_Entry **pentry) {
 static void pbN_init(pb_State *S)
 { memset(&S->nametable, 0, sizeof(pb_NameTable)); }
 
-PB_API pb_Name *pb_usename(pb_Name *name)
-{ if (name != NULL) ++((pb_NameEntry*)name-1)->refcount; return name; }
+PB_API pb_Name *pb_usename(pb_Name *name) {
+    if (name != NULL) {
+        pb_NameEntry *ne = (pb_NameEntry*)name - 1;
+        if (ne->refcount != PB_MAX_REFCOUNT) ++ne->refcount;
+    }
+    return name;
+}
 
 static void pbN_free(pb_State *S) {
     pb_NameTable *nt = &S->nametable;
@@ -978,12 +1049,13 @@ static pb_NameEntry *pbN_newname(pb_State *S, pb_Slice s, unsigned hash) {
     pb_NameTable *nt = &S->nametable;
     pb_NameEntry **list, *newobj;
     size_t len = pb_len(s);
+    if (len > PB_MAX_SIZET) return NULL;
     if (nt->count >= nt->size && !pbN_resize(S, nt->size * 2)) return NULL;
     list = &nt->hash[hash & (nt->size - 1)];
     newobj = (pb_NameEntry*)malloc(sizeof(pb_NameEntry) + len + 1);
     if (newobj == NULL) return NULL;
     newobj->next     = *list;
-    newobj->length   = (unsigned)len;
+    newobj->length   = (uint32_t)len;
     newobj->refcount = 0;
     newobj->hash     = hash;
     memcpy(newobj+1, s.p, len);
@@ -1025,7 +1097,7 @@ PB_API void pb_delname(pb_State *S, pb_Name *name) {
     if (name != NULL) {
         pb_NameEntry *ne = (pb_NameEntry*)name - 1;
         if (ne->refcount <= 1) { pbN_delname(S, ne); return; }
-        --ne->refcount;
+        if (ne->refcount != PB_MAX_REFCOUNT) --ne->refcount;
     }
 }
 
@@ -1072,6 +1144,15 @@ PB_API const pb_Name *pb_name(const pb_State *S, pb_Slice s, pb_Cache *cache) {
 
 typedef struct pb_TypeEntry { pb_Entry entry; pb_Type *value; } pb_TypeEntry;
 typedef struct pb_FieldEntry { pb_Entry entry; pb_Field *value; } pb_FieldEntry;
+typedef struct pb_LazyEntry { pb_Entry entry; size_t unit; } pb_LazyEntry;
+
+typedef struct pb_FileEntry {
+    pb_Entry entry;
+    uint64_t hash;
+    size_t   size;
+    unsigned serial; /* load that last met this file */
+    int      status;
+} pb_FileEntry;
 
 typedef struct pb_OneofEntry {
     pb_Entry entry;
@@ -1079,23 +1160,50 @@ typedef struct pb_OneofEntry {
     unsigned index;
 } pb_OneofEntry;
 
+typedef struct pb_MethodEntry {
+    pb_Entry  entry;
+    pb_Method value; /* name first, the entry is empty if it is NULL */
+} pb_MethodEntry;
+
 PB_API void pb_init(pb_State *S) {
     memset(S, 0, sizeof(pb_State));
     S->types.entry_size = sizeof(pb_TypeEntry);
+    S->files.entry_size = sizeof(pb_FileEntry);
+    S->lazytypes.entry_size = sizeof(pb_LazyEntry);
+    S->methods.entry_size = sizeof(pb_MethodEntry);
     pb_initpool(&S->typepool, sizeof(pb_Type));
     pb_initpool(&S->fieldpool, sizeof(pb_Field));
 }
 
+static void pbL_freelazy(pb_State *S) {
+    pb_freetable(&S->lazytypes);
+    pb_resetbuffer(&S->lazyunits);
+    while (S->lazydata != NULL) {
+        void *next = *(void**)S->lazydata;
+        free(S->lazydata);
+        S->lazydata = next;
+    }
+}
+
 PB_API void pb_free(pb_State *S) {
     const pb_Entry *e = NULL;
     if (S == NULL) return;
-    while (pb_nextentry(&S->types, &e)) {
+    while (S->frozen == NULL && pb_nextentry(&S->types, &e)) {
         pb_TypeEntry *te = (pb_TypeEntry*)e;
         if (te->value != NULL) pb_deltype(S, te->value);
     }
+    if (S->frozen != NULL) { /* names, types and tables are all in it */
+        if (!S->frozen_image) free(S->frozen);
+        pb_inittable(&S->types, sizeof(pb_TypeEntry));
+        pb_inittable(&S->methods, sizeof(pb_MethodEntry));
+        pbN_init(S);
+    }
     pb_freetable(&S->types);
+    pb_freetable(&S->methods);
     pb_freepool(&S->typepool);
     pb_freepool(&S->fieldpool);
+    pb_freetable(&S->files);
+    pbL_freelazy(S);
     pbN_free(S);
 }
 
@@ -1115,6 +1223,10 @@ PB_API const pb_Field *pb_fname(const pb_Type *t, const pb_Name *name) {
 
 PB_API const pb_Field *pb_field(const pb_Type *t, int32_t number) {
     pb_FieldEntry *fe = NULL;
+    if (t != NULL && t->is_dense) {
+        uint32_t i = (uint32_t)number - (uint32_t)t->sorted_fields[0]->number;
+        return i < t->field_count ? t->sorted_fields[i] : NULL;
+    }
     if (t != NULL) fe = (pb_FieldEntry*)pb_gettable(&t->field_tags, number);
     return fe ? fe->value : NULL;
 }
@@ -1125,6 +1237,26 @@ PB_API const pb_Name *pb_oneofname(const pb_Type *t, int idx) {
     return oe ? oe->name : NULL;
 }
 
+PB_API const pb_Default *pb_default(const pb_Type *t, const pb_Field *f) {
+    const pb_Default *d;
+    if (t == NULL || f == NULL || f->default_idx == 0
+            || f->default_idx > t->default_count) return NULL;
+    d = &t->defaults[f->default_idx - 1];
+    return d->text ? d : NULL;
+}
+
+PB_API const pb_Name *pb_defaultvalue(const pb_Type *t, const pb_Field *f) {
+    const pb_Default *d = pb_default(t, f);
+    return d ? d->text : NULL;
+}
+
+PB_API const pb_Method *pb_method(const pb_State *S, const pb_Name *mname) {
+    const pb_MethodEntry *me = NULL;
+    if (S != NULL && mname != NULL)
+        me = (const pb_MethodEntry*)pb_gettable(&S->methods, (pb_Key)mname);
+    return me && me->value.name ? &me->value : NULL;
+}
+
 PB_API int pb_nexttype(const pb_State *S, const pb_Type **ptype) {
     if (S != NULL) {
         const pb_Entry *ent = NULL;
@@ -1144,6 +1276,10 @@ PB_API int pb_nexttype(const pb_State *S, const pb_Type **ptype) {
 }
 
 PB_API int pb_nextfield(const pb_Type *t, const pb_Field **pfield) {
+    if (t != NULL && t->is_dense) {
+        uint32_t i = *pfield ? (*pfield)->sorted_idx : 0;
+        return (*pfield = i < t->field_count ? t->sorted_fields[i] : NULL) != NULL;
+    }
     if (t != NULL) {
         const pb_Entry *ent = NULL;
         if (*pfield != NULL) {
@@ -1161,19 +1297,29 @@ PB_API int pb_nextfield(const pb_Type *t, const pb_Field **pfield) {
     return 0;
 }
 
-static int pb_cmpfield(const void* a, const void* b)
-{ return (*(const pb_Field**)a)->number - (*(const pb_Field**)b)->number; }
+static int pb_cmpfield(const void* a, const void* b) {
+    int32_t x = (*(const pb_Field**)a)->number, y = (*(const pb_Field**)b)->number;
+    return (x > y) - (x < y); /* enum values may be far apart */
+}
 
 PB_API pb_Field** pb_sortedfields(const pb_Type* t) {
     if (t == NULL) return NULL;
     if (!t->sorted_fields && t->field_count) {
         unsigned i = 0;
         const pb_Field* f = NULL;
+        const pb_Entry* e = NULL;
         pb_Field** list =
             (pb_Field**)malloc(sizeof(pb_Field*) * t->field_count);
         if (list == NULL) return NULL;
         while (pb_nextfield(t, &f))
             list[i++] = (pb_Field*)f;
+        while (i < t->field_count && pb_nextentry(&t->field_names, &e)) {
+            /* enum aliases share a number, only the last one has the tag */
+            f = ((const pb_FieldEntry*)e)->value;
+            if (f != NULL && pb_field(t, f->number) != f)
+                list[i++] = (pb_Field*)f;
+        }
+        assert(i == t->field_count);
         qsort(list, i, sizeof(pb_Field*), pb_cmpfield);
         for (i = 0; i < t->field_count; i++)
             list[i]->sorted_idx = i + 1;
@@ -1201,8 +1347,74 @@ static void pbT_inittype(pb_Type *t) {
     pb_inittable(&t->oneof_index, sizeof(pb_OneofEntry));
 }
 
-static void pbT_freefield(pb_State *S, pb_Field *f) {
-    pb_delname(S, f->default_value);
+static int pbT_parseint(const char *s, int64_t *pv) {
+    const char *p;
+    uint64_t u = 0;
+    int neg = 0;
+    if (*s == '-' || *s == '+') neg = (*s++ == '-');
+    for (p = s; *p >= '0' && *p <= '9'; ++p)
+        u = u * 10 + (uint64_t)(*p - '0');
+    *pv = (int64_t)(neg ? ~u + 1 : u);
+    return p != s;
+}
+
+static void pbT_parsedefault(pb_Default *d, unsigned type_id) {
+    const char *s = (const char*)d->text;
+    char *end;
+    d->value.i = 0, d->is_valid = 0;
+    switch (type_id) {
+    case PB_Tenum: case PB_Tmessage: case PB_Tbytes: case PB_Tstring:
+        break;
+    case PB_Tbool:
+        if (strcmp(s, "true") == 0)
+            d->value.i = 1, d->is_valid = 1;
+        else if (strcmp(s, "false") == 0)
+            d->is_valid = 1;
+        break;
+    case PB_Tdouble: case PB_Tfloat:
+        d->value.d = strtod(s, &end);
+        d->is_valid = (end != s);
+        break;
+    default:
+        d->is_valid = pbT_parseint(s, &d->value.i);
+    }
+}
+
+static int pbT_setdefault(pb_State *S, pb_Type *t, pb_Field *f, pb_Name *value) {
+    /* defaults are rare, so they live in an array of the type that has f,
+     * reusing freed slots; the text is parsed for f->type_id here, set it
+     * before */
+    pb_Default *d;
+    unsigned i;
+    if (f->default_idx != 0) {
+        d = &t->defaults[f->default_idx - 1];
+        pb_delname(S, d->text), d->text = NULL;
+        f->default_idx = 0;
+    }
+    if (value == NULL) return PB_OK;
+    for (i = 0; i < t->default_count && t->defaults[i].text != NULL; ++i)
+        ;
+    if (i == t->default_count) {
+        d = i == PB_MAX_DEFAULTS ? NULL :
+            (pb_Default*)realloc(t->defaults, (i + 1) * sizeof(pb_Default));
+        if (d == NULL) return pb_delname(S, value), PB_ENOMEM;
+        t->defaults = d, ++t->default_count;
+    }
+    d = &t->defaults[i];
+    d->text = value, f->default_idx = i + 1;
+    pbT_parsedefault(d, f->type_id);
+    return PB_OK;
+}
+
+static void pbT_freefiles(pb_State *S) {
+    const pb_Entry *e = NULL; /* records keep their names */
+    while (pb_nextentry(&S->files, &e))
+        pb_delname(S, (pb_Name*)e->key);
+    pb_freetable(&S->files);
+}
+
+static void pbT_freefield(pb_State *S, pb_Type *t, pb_Field *f) {
+    pbT_setdefault(S, t, f, NULL);
     pb_delname(S, f->name);
     pb_poolfree(&S->fieldpool, f);
 }
@@ -1224,6 +1436,7 @@ PB_API pb_Type *pb_newtype(pb_State *S, pb_Name *tname) {
 PB_API void pb_deltype(pb_State *S, pb_Type *t) {
     const pb_Entry *e = NULL;
     if (S == NULL || t == NULL) return;
+    pbT_freefiles(S); /* loading a file again must rebuild it */
     while (pb_nextentry(&t->field_names, &e)) {
         const pb_FieldEntry *nf = (const pb_FieldEntry*)e;
         if (nf->value != NULL) {
@@ -1231,12 +1444,12 @@ PB_API void pb_deltype(pb_State *S, pb_Type *t) {
                     &t->field_tags, nf->value->number);
             if (of && of->value == nf->value)
                 of->entry.dead = 1, of->value = NULL;
-            pbT_freefield(S, nf->value);
+            pbT_freefield(S, t, nf->value);
         }
     }
     while (pb_nextentry(&t->field_tags, &e)) {
         pb_FieldEntry *nf = (pb_FieldEntry*)e;
-        if (nf->value != NULL) pbT_freefield(S, nf->value);
+        if (nf->value != NULL) pbT_freefield(S, t, nf->value);
     }
     while (pb_nextentry(&t->oneof_index, &e)) {
         pb_OneofEntry *oe = (pb_OneofEntry*)e;
@@ -1245,11 +1458,12 @@ PB_API void pb_deltype(pb_State *S, pb_Type *t) {
     pb_freetable(&t->field_tags);
     pb_freetable(&t->field_names);
     pb_freetable(&t->oneof_index);
+    free(t->defaults), t->defaults = NULL, t->default_count = 0;
     pb_invalidsort(t);
     /*pb_delname(S, t->name); */
     /*pb_poolfree(&S->typepool, t); */
     t->oneof_field = 0, t->field_count = 0;
-    t->is_dead = 1;
+    t->is_dead = 1, t->is_defined = 0;
 }
 
 PB_API pb_Field *pb_newfield(pb_State *S, pb_Type *t, pb_Name *fname, int32_t number) {
@@ -1260,8 +1474,7 @@ PB_API pb_Field *pb_newfield(pb_State *S, pb_Type *t, pb_Name *fname, int32_t nu
     tf = (pb_FieldEntry*)pb_settable(&t->field_tags, number);
     if (nf == NULL || tf == NULL) return NULL;
     if ((f = nf->value) != NULL && tf->value == f) {
-        pb_delname(S, f->default_value);
-        f->default_value = NULL;
+        pbT_setdefault(S, t, f, NULL);
         return f;
     }
     if (!(f = (pb_Field*)pb_poolalloc(&S->fieldpool))) return NULL;
@@ -1270,9 +1483,9 @@ PB_API pb_Field *pb_newfield(pb_State *S, pb_Type *t, pb_Name *fname, int32_t nu
     f->type   = t;
     f->number = number;
     if (nf->value && pb_field(t, nf->value->number) != nf->value)
-        pbT_freefield(S, nf->value), --t->field_count;
+        pbT_freefield(S, t, nf->value), --t->field_count;
     if (tf->value && pb_fname(t, tf->value->name) != tf->value)
-        pbT_freefield(S, tf->value), --t->field_count;
+        pbT_freefield(S, t, tf->value), --t->field_count;
     pb_invalidsort(t);
     ++t->field_count;
     return nf->value = tf->value = f;
@@ -1282,6 +1495,7 @@ PB_API void pb_delfield(pb_State *S, pb_Type *t, pb_Field *f) {
     pb_FieldEntry *nf, *tf;
     int count = 0;
     if (S == NULL || t == NULL || f == NULL) return;
+    pbT_freefiles(S);
     nf = (pb_FieldEntry*)pb_gettable(&t->field_names, (pb_Key)f->name);
     tf = (pb_FieldEntry*)pb_gettable(&t->field_tags, (pb_Key)f->number);
     if (nf && nf->value == f)
@@ -1290,7 +1504,7 @@ PB_API void pb_delfield(pb_State *S, pb_Type *t, pb_Field *f) {
         tf->entry.dead = 1, tf->value = NULL, ++count;
     if (count) {
         if (f->oneof_idx) --t->oneof_field; 
-        pbT_freefield(S, f), --t->field_count;
+        pbT_freefield(S, t, f), --t->field_count;
         pb_invalidsort(t);
     }
 }
@@ -1303,6 +1517,8 @@ typedef struct pbL_EnumValueInfo pbL_EnumValueInfo;
 typedef struct pbL_EnumInfo      pbL_EnumInfo;
 typedef struct pbL_TypeInfo      pbL_TypeInfo;
 typedef struct pbL_FileInfo      pbL_FileInfo;
+typedef struct pbL_ServiceInfo   pbL_ServiceInfo;
+typedef struct pbL_MethodInfo    pbL_MethodInfo;
 
 #define pbC(e)  do { int r = (e); if (r != PB_OK) return r; } while (0)
 #define pbCM(e) do { if ((e) == NULL) return PB_ENOMEM; } while (0)
@@ -1314,15 +1530,28 @@ typedef struct pb_ArrayHeader {
 } pb_ArrayHeader;
 
 #define pbL_rawh(A)   ((pb_ArrayHeader*)(A) - 1)
-#define pbL_delete(A) ((A) ? (void)free(pbL_rawh(A)) : (void)0)
 #define pbL_count(A)  ((A) ? pbL_rawh(A)->count    : 0)
-#define pbL_add(A)    (pbL_grow((void*)&(A),sizeof(*(A)))==PB_OK ?\
+#define pbL_add(L,A)  (pbL_grow((L),(void*)&(A),sizeof(*(A)))==PB_OK ?\
                        &(A)[pbL_rawh(A)->count++] : NULL)
+#define pbL_presize(L,A) pbL_resize((L),(void*)&(A),sizeof(*(A)),pbL_take(L))
+
+#define PBL_BLOCKSIZE 4096
+
+typedef union pbL_Align { void *p; double d; size_t s; } pbL_Align;
 
 struct pb_Loader {
     pb_Slice  s;
     pb_Buffer b;
     int       is_proto3;
+    pb_Buffer skips;   /* for each file: skip it, it is loaded already */
+    pb_Buffer counts;  /* array sizes from the sizing pass, in parse order */
+    size_t    next;    /* next count to take */
+    size_t    bytes;   /* arena bytes the arrays will use */
+    size_t    names;   /* estimated new names */
+    size_t    types;   /* new types */
+    void     *arena;   /* blocks of scratch memory, freed by pbL_free() */
+    size_t    used, size;
+    pb_Buffer *refs;   /* lazy builds: types referred to, see pbL_lazybuild */
 };
 
 /* parsers */
@@ -1359,12 +1588,26 @@ struct pbL_TypeInfo {
     pb_Slice      *oneof_decl;
 };
 
+struct pbL_MethodInfo {
+    pb_Slice name;
+    pb_Slice input_type;
+    pb_Slice output_type;
+    int32_t  client_streaming;
+    int32_t  server_streaming;
+};
+
+struct pbL_ServiceInfo {
+    pb_Slice        name;
+    pbL_MethodInfo *method;
+};
+
 struct pbL_FileInfo {
-    pb_Slice       package;
-    pb_Slice       syntax;
-    pbL_EnumInfo  *enum_type;
-    pbL_TypeInfo  *message_type;
-    pbL_FieldInfo *extension;
+    pb_Slice         package;
+    pb_Slice         syntax;
+    pbL_EnumInfo    *enum_type;
+    pbL_TypeInfo    *message_type;
+    pbL_FieldInfo   *extension;
+    pbL_ServiceInfo *service;
 };
 
 static int pbL_readbytes(pb_Loader *L, pb_Slice *pv)
@@ -1376,23 +1619,78 @@ static int pbL_beginmsg(pb_Loader *L, pb_Slice *pv)
 static void pbL_endmsg(pb_Loader *L, pb_Slice *pv)
 { L->s = *pv; }
 
-static int pbL_grow(void *p, size_t objs) {
+static void pbL_init(pb_Loader *L, pb_Slice s) {
+    memset(L, 0, sizeof(pb_Loader));
+    pb_initbuffer(&L->b);
+    pb_initbuffer(&L->skips);
+    pb_initbuffer(&L->counts);
+    L->s = s;
+}
+
+static void pbL_free(pb_Loader *L) {
+    while (L->arena != NULL) {
+        void *next = ((pbL_Align*)L->arena)->p;
+        free(L->arena);
+        L->arena = next;
+    }
+    pb_resetbuffer(&L->b);
+    pb_resetbuffer(&L->skips);
+    pb_resetbuffer(&L->counts);
+}
+
+static int pbL_skipped(pb_Loader *L, size_t i)
+{ return i < pb_bufflen(&L->skips) && pb_buffer(&L->skips)[i]; }
+
+static size_t pbL_alignsize(size_t size)
+{ return (size + sizeof(pbL_Align) - 1) / sizeof(pbL_Align) * sizeof(pbL_Align); }
+
+static int pbL_newblock(pb_Loader *L, size_t size) {
+    pbL_Align *block = (pbL_Align*)malloc(sizeof(pbL_Align) + size);
+    if (block == NULL) return PB_ENOMEM;
+    block->p = L->arena, L->arena = block;
+    L->used = 0, L->size = size;
+    return PB_OK;
+}
+
+static void *pbL_alloc(pb_Loader *L, size_t size) {
+    size = pbL_alignsize(size);
+    if (L->arena == NULL || L->size - L->used < size) {
+        if (pbL_newblock(L, size > PBL_BLOCKSIZE ? size : PBL_BLOCKSIZE))
+            return NULL;
+    }
+    L->used += size;
+    return (char*)((pbL_Align*)L->arena + 1) + (L->used - size);
+}
+
+static unsigned pbL_take(pb_Loader *L) {
+    size_t count = pb_bufflen(&L->counts) / sizeof(unsigned);
+    return L->next < count ? ((unsigned*)pb_buffer(&L->counts))[L->next++] : 0;
+}
+
+static int pbL_resize(pb_Loader *L, void *p, size_t objs, size_t nsize) {
     union { void *p; void **pp; } up;
     pb_ArrayHeader *nh, *h = (up.p = p, *up.pp) ? pbL_rawh(*up.pp) : NULL;
-    if (h == NULL || h->capacity <= h->count) {
-        size_t used = (h ? h->count : 0);
-        size_t size = used + 4, nsize = size + (size >> 1);
-        nh = nsize < size ? NULL :
-            (pb_ArrayHeader*)realloc(h, sizeof(pb_ArrayHeader)+nsize*objs);
-        if (nh == NULL) return PB_ENOMEM;
-        nh->count    = (unsigned)used;
-        nh->capacity = (unsigned)nsize;
-        *up.pp = nh + 1;
-        memset((char*)*up.pp + used*objs, 0, (nsize - used)*objs);
-    }
+    size_t used = (h ? h->count : 0);
+    if (nsize <= (h ? h->capacity : 0)) return PB_OK;
+    nh = nsize > (PB_MAX_SIZET - sizeof(pb_ArrayHeader))/objs ? NULL :
+        (pb_ArrayHeader*)pbL_alloc(L, sizeof(pb_ArrayHeader)+nsize*objs);
+    if (nh == NULL) return PB_ENOMEM;
+    nh->count    = (unsigned)used;
+    nh->capacity = (unsigned)nsize;
+    if (used != 0) memcpy(nh + 1, *up.pp, used*objs);
+    *up.pp = nh + 1;
+    memset((char*)*up.pp + used*objs, 0, (nsize - used)*objs);
     return PB_OK;
 }
 
+static int pbL_grow(pb_Loader *L, void *p, size_t objs) {
+    union { void *p; void **pp; } up;
+    pb_ArrayHeader *h = (up.p = p, *up.pp) ? pbL_rawh(*up.pp) : NULL;
+    size_t size = (h ? h->count : 0) + 4;
+    if (h != NULL && h->capacity > h->count) return PB_OK;
+    return pbL_resize(L, p, objs, size + (size >> 1));
+}
+
 static int pbL_readint32(pb_Loader *L, int32_t *pv) {
     uint32_t v;
     if (pb_readvarint32(&L->s, &v) == 0) return PB_ERROR;
@@ -1469,12 +1767,13 @@ static int pbL_EnumDescriptorProto(pb_Loader *L, pbL_EnumInfo *info) {
     pb_Slice s;
     uint32_t tag;
     pbCM(info); pbC(pbL_beginmsg(L, &s));
+    pbC(pbL_presize(L, info->value));
     while (pb_readvarint32(&L->s, &tag)) {
         switch (tag) {
         case pb_pair(1, PB_TBYTES): /* string name */
             pbC(pbL_readbytes(L, &info->name)); break;
         case pb_pair(2, PB_TBYTES): /* EnumValueDescriptorProto value */
-            pbC(pbL_EnumValueDescriptorProto(L, pbL_add(info->value))); break;
+            pbC(pbL_EnumValueDescriptorProto(L, pbL_add(L, info->value))); break;
         default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
         }
     }
@@ -1504,7 +1803,7 @@ static int pbL_OneofDescriptorProto(pb_Loader *L, pbL_TypeInfo *info) {
     while (pb_readvarint32(&L->s, &tag)) {
         switch (tag) {
         case pb_pair(1, PB_TBYTES): /* string name */
-            pbC(pbL_readbytes(L, pbL_add(info->oneof_decl))); break;
+            pbC(pbL_readbytes(L, pbL_add(L, info->oneof_decl))); break;
         default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
         }
     }
@@ -1516,18 +1815,23 @@ static int pbL_DescriptorProto(pb_Loader *L, pbL_TypeInfo *info) {
     pb_Slice s;
     uint32_t tag;
     pbCM(info); pbC(pbL_beginmsg(L, &s));
+    pbC(pbL_presize(L, info->field));
+    pbC(pbL_presize(L, info->extension));
+    pbC(pbL_presize(L, info->nested_type));
+    pbC(pbL_presize(L, info->enum_type));
+    pbC(pbL_presize(L, info->oneof_decl));
     while (pb_readvarint32(&L->s, &tag)) {
         switch (tag) {
         case pb_pair(1, PB_TBYTES): /* string name */
             pbC(pbL_readbytes(L, &info->name)); break;
         case pb_pair(2, PB_TBYTES): /* FieldDescriptorProto field */
-            pbC(pbL_FieldDescriptorProto(L, pbL_add(info->field))); break;
+            pbC(pbL_FieldDescriptorProto(L, pbL_add(L, info->field))); break;
         case pb_pair(6, PB_TBYTES): /* FieldDescriptorProto extension */
-            pbC(pbL_FieldDescriptorProto(L, pbL_add(info->extension))); break;
+            pbC(pbL_FieldDescriptorProto(L, pbL_add(L, info->extension))); break;
         case pb_pair(3, PB_TBYTES): /* DescriptorProto nested_type */
-            pbC(pbL_DescriptorProto(L, pbL_add(info->nested_type))); break;
+            pbC(pbL_DescriptorProto(L, pbL_add(L, info->nested_type))); break;
         case pb_pair(4, PB_TBYTES): /* EnumDescriptorProto enum_type */
-            pbC(pbL_EnumDescriptorProto(L, pbL_add(info->enum_type))); break;
+            pbC(pbL_EnumDescriptorProto(L, pbL_add(L, info->enum_type))); break;
         case pb_pair(8, PB_TBYTES): /* OneofDescriptorProto oneof_decl */
             pbC(pbL_OneofDescriptorProto(L, info)); break;
         case pb_pair(7, PB_TBYTES): /* MessageOptions options */
@@ -1539,20 +1843,67 @@ static int pbL_DescriptorProto(pb_Loader *L, pbL_TypeInfo *info) {
     return PB_OK;
 }
 
+static int pbL_MethodDescriptorProto(pb_Loader *L, pbL_MethodInfo *info) {
+    pb_Slice s;
+    uint32_t tag;
+    pbCM(info); pbC(pbL_beginmsg(L, &s));
+    while (pb_readvarint32(&L->s, &tag)) {
+        switch (tag) {
+        case pb_pair(1, PB_TBYTES): /* string name */
+            pbC(pbL_readbytes(L, &info->name)); break;
+        case pb_pair(2, PB_TBYTES): /* string input_type */
+            pbC(pbL_readbytes(L, &info->input_type)); break;
+        case pb_pair(3, PB_TBYTES): /* string output_type */
+            pbC(pbL_readbytes(L, &info->output_type)); break;
+        case pb_pair(5, PB_TVARINT): /* bool client_streaming */
+            pbC(pbL_readint32(L, &info->client_streaming)); break;
+        case pb_pair(6, PB_TVARINT): /* bool server_streaming */
+            pbC(pbL_readint32(L, &info->server_streaming)); break;
+        default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+        }
+    }
+    pbL_endmsg(L, &s);
+    return PB_OK;
+}
+
+static int pbL_ServiceDescriptorProto(pb_Loader *L, pbL_ServiceInfo *info) {
+    pb_Slice s;
+    uint32_t tag;
+    pbCM(info); pbC(pbL_beginmsg(L, &s));
+    pbC(pbL_presize(L, info->method));
+    while (pb_readvarint32(&L->s, &tag)) {
+        switch (tag) {
+        case pb_pair(1, PB_TBYTES): /* string name */
+            pbC(pbL_readbytes(L, &info->name)); break;
+        case pb_pair(2, PB_TBYTES): /* MethodDescriptorProto method */
+            pbC(pbL_MethodDescriptorProto(L, pbL_add(L, info->method))); break;
+        default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+        }
+    }
+    pbL_endmsg(L, &s);
+    return PB_OK;
+}
+
 static int pbL_FileDescriptorProto(pb_Loader *L, pbL_FileInfo *info) {
     pb_Slice s;
     uint32_t tag;
     pbCM(info); pbC(pbL_beginmsg(L, &s));
+    pbC(pbL_presize(L, info->message_type));
+    pbC(pbL_presize(L, info->enum_type));
+    pbC(pbL_presize(L, info->extension));
+    pbC(pbL_presize(L, info->service));
     while (pb_readvarint32(&L->s, &tag)) {
         switch (tag) {
         case pb_pair(2, PB_TBYTES): /* string package */
             pbC(pbL_readbytes(L, &info->package)); break;
         case pb_pair(4, PB_TBYTES): /* DescriptorProto message_type */
-            pbC(pbL_DescriptorProto(L, pbL_add(info->message_type))); break;
+            pbC(pbL_DescriptorProto(L, pbL_add(L, info->message_type))); break;
         case pb_pair(5, PB_TBYTES): /* EnumDescriptorProto enum_type */
-            pbC(pbL_EnumDescriptorProto(L, pbL_add(info->enum_type))); break;
+            pbC(pbL_EnumDescriptorProto(L, pbL_add(L, info->enum_type))); break;
         case pb_pair(7, PB_TBYTES): /* FieldDescriptorProto extension */
-            pbC(pbL_FieldDescriptorProto(L, pbL_add(info->extension))); break;
+            pbC(pbL_FieldDescriptorProto(L, pbL_add(L, info->extension))); break;
+        case pb_pair(6, PB_TBYTES): /* ServiceDescriptorProto service */
+            pbC(pbL_ServiceDescriptorProto(L, pbL_add(L, info->service))); break;
         case pb_pair(12, PB_TBYTES): /* string syntax */
             pbC(pbL_readbytes(L, &info->syntax)); break;
         default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
@@ -1564,45 +1915,231 @@ static int pbL_FileDescriptorProto(pb_Loader *L, pbL_FileInfo *info) {
 
 static int pbL_FileDescriptorSet(pb_Loader *L, pbL_FileInfo **pfiles) {
     uint32_t tag;
+    size_t i = 0;
+    pbC(pbL_presize(L, *pfiles));
+    while (pb_readvarint32(&L->s, &tag)) {
+        if (tag == pb_pair(1, PB_TBYTES) && !pbL_skipped(L, i++))
+            /* FileDescriptorProto file */
+            pbC(pbL_FileDescriptorProto(L, pbL_add(L, *pfiles)));
+        else if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+    }
+    return PB_OK;
+}
+
+/* sizing pass: count arrays first, so the parsers never grow them */
+
+#define pbL_slot(L,i) (((unsigned*)pb_buffer(&(L)->counts))[i])
+
+static size_t pbL_arraysize(unsigned n, size_t objs)
+{ return n ? pbL_alignsize(sizeof(pb_ArrayHeader) + n*objs) : 0; }
+
+static int pbL_slots(pb_Loader *L, size_t n, size_t *pi) {
+    char *p = pb_prepbuffsize(&L->counts, n*sizeof(unsigned));
+    pbCM(p);
+    memset(p, 0, n*sizeof(unsigned));
+    *pi = pb_bufflen(&L->counts) / sizeof(unsigned);
+    pb_addsize(&L->counts, n*sizeof(unsigned));
+    return PB_OK;
+}
+
+static int pbL_sizeEnum(pb_Loader *L) {
+    pb_Slice s;
+    uint32_t tag;
+    size_t i;
+    pbC(pbL_slots(L, 1, &i)); /* value */
+    pbC(pbL_beginmsg(L, &s));
+    while (pb_readvarint32(&L->s, &tag)) {
+        if (tag == pb_pair(2, PB_TBYTES)) ++pbL_slot(L, i);
+        if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+    }
+    L->bytes += pbL_arraysize(pbL_slot(L, i), sizeof(pbL_EnumValueInfo));
+    L->names += pbL_slot(L, i) + 1;
+    L->types += 1;
+    pbL_endmsg(L, &s);
+    return PB_OK;
+}
+
+static int pbL_sizeType(pb_Loader *L) {
+    pb_Slice s;
+    uint32_t tag;
+    size_t i;
+    pbC(pbL_slots(L, 5, &i)); /* field, extension, nested, enum, oneof */
+    pbC(pbL_beginmsg(L, &s));
     while (pb_readvarint32(&L->s, &tag)) {
         switch (tag) {
-        case pb_pair(1, PB_TBYTES): /* FileDescriptorProto file */
-            pbC(pbL_FileDescriptorProto(L, pbL_add(*pfiles))); break;
-        default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+        case pb_pair(2, PB_TBYTES): ++pbL_slot(L, i);   break;
+        case pb_pair(6, PB_TBYTES): ++pbL_slot(L, i+1); break;
+        case pb_pair(3, PB_TBYTES): ++pbL_slot(L, i+2); break;
+        case pb_pair(4, PB_TBYTES): ++pbL_slot(L, i+3); break;
+        case pb_pair(8, PB_TBYTES): ++pbL_slot(L, i+4); break;
         }
+        if (tag == pb_pair(3, PB_TBYTES)) pbC(pbL_sizeType(L));
+        else if (tag == pb_pair(4, PB_TBYTES)) pbC(pbL_sizeEnum(L));
+        else if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
     }
+    L->bytes += pbL_arraysize(pbL_slot(L, i),   sizeof(pbL_FieldInfo));
+    L->bytes += pbL_arraysize(pbL_slot(L, i+1), sizeof(pbL_FieldInfo));
+    L->bytes += pbL_arraysize(pbL_slot(L, i+2), sizeof(pbL_TypeInfo));
+    L->bytes += pbL_arraysize(pbL_slot(L, i+3), sizeof(pbL_EnumInfo));
+    L->bytes += pbL_arraysize(pbL_slot(L, i+4), sizeof(pb_Slice));
+    L->names += 1 + pbL_slot(L, i)*2 + pbL_slot(L, i+1)*3 + pbL_slot(L, i+4);
+    L->types += 1;
+    pbL_endmsg(L, &s);
     return PB_OK;
 }
 
-/* loader */
+static int pbL_sizeService(pb_Loader *L) {
+    pb_Slice s;
+    uint32_t tag;
+    size_t i;
+    pbC(pbL_slots(L, 1, &i)); /* method */
+    pbC(pbL_beginmsg(L, &s));
+    while (pb_readvarint32(&L->s, &tag)) {
+        if (tag == pb_pair(2, PB_TBYTES)) ++pbL_slot(L, i);
+        if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+    }
+    L->bytes += pbL_arraysize(pbL_slot(L, i), sizeof(pbL_MethodInfo));
+    L->names += pbL_slot(L, i) * 3;
+    pbL_endmsg(L, &s);
+    return PB_OK;
+}
 
-static void pbL_delTypeInfo(pbL_TypeInfo *info) {
-    size_t i, count;
-    for (i = 0, count = pbL_count(info->nested_type); i < count; ++i)
-        pbL_delTypeInfo(&info->nested_type[i]);
-    for (i = 0, count = pbL_count(info->enum_type); i < count; ++i)
-        pbL_delete(info->enum_type[i].value);
-    pbL_delete(info->nested_type);
-    pbL_delete(info->enum_type);
-    pbL_delete(info->field);
-    pbL_delete(info->extension);
-    pbL_delete(info->oneof_decl);
+static int pbL_sizeFile(pb_Loader *L) {
+    pb_Slice s;
+    uint32_t tag;
+    size_t i;
+    pbC(pbL_slots(L, 4, &i)); /* message_type, enum_type, extension, service */
+    pbC(pbL_beginmsg(L, &s));
+    while (pb_readvarint32(&L->s, &tag)) {
+        switch (tag) {
+        case pb_pair(4, PB_TBYTES): ++pbL_slot(L, i);   break;
+        case pb_pair(5, PB_TBYTES): ++pbL_slot(L, i+1); break;
+        case pb_pair(7, PB_TBYTES): ++pbL_slot(L, i+2); break;
+        case pb_pair(6, PB_TBYTES): ++pbL_slot(L, i+3); break;
+        }
+        if (tag == pb_pair(4, PB_TBYTES)) pbC(pbL_sizeType(L));
+        else if (tag == pb_pair(5, PB_TBYTES)) pbC(pbL_sizeEnum(L));
+        else if (tag == pb_pair(6, PB_TBYTES)) pbC(pbL_sizeService(L));
+        else if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+    }
+    L->bytes += pbL_arraysize(pbL_slot(L, i),   sizeof(pbL_TypeInfo));
+    L->bytes += pbL_arraysize(pbL_slot(L, i+1), sizeof(pbL_EnumInfo));
+    L->bytes += pbL_arraysize(pbL_slot(L, i+2), sizeof(pbL_FieldInfo));
+    L->bytes += pbL_arraysize(pbL_slot(L, i+3), sizeof(pbL_ServiceInfo));
+    L->names += 1 + pbL_slot(L, i+2)*3;
+    pbL_endmsg(L, &s);
+    return PB_OK;
+}
+
+static int pbL_sizeFileSet(pb_Loader *L) {
+    uint32_t tag;
+    size_t i, file = 0;
+    pbC(pbL_slots(L, 1, &i)); /* file */
+    while (pb_readvarint32(&L->s, &tag)) {
+        if (tag == pb_pair(1, PB_TBYTES) && !pbL_skipped(L, file++)) {
+            ++pbL_slot(L, i);
+            pbC(pbL_sizeFile(L));
+        } else if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+    }
+    L->bytes += pbL_arraysize(pbL_slot(L, i), sizeof(pbL_FileInfo));
+    return PB_OK;
+}
+
+static int pbL_prepare(pb_State *S, pb_Loader *L, int (*size)(pb_Loader *L)) {
+    pb_Slice s = L->s;
+    pb_NameTable *nt = &S->nametable;
+    if (size(L) != PB_OK) { /* let the parsers report the error */
+        pb_bufflen(&L->counts) = 0;
+        L->s = s;
+        return PB_OK;
+    }
+    L->s = s;
+    if (L->bytes != 0) pbC(pbL_newblock(L, L->bytes));
+    if (nt->count + L->names > nt->size && !pbN_resize(S, nt->count + L->names))
+        return PB_ENOMEM;
+    if (S->types.size < L->types && !pb_resizetable(&S->types, L->types))
+        return PB_ENOMEM;
+    return PB_OK;
+}
+
+/* file records: files loaded with the same content are skipped */
+
+static uint64_t pbL_hash(pb_Slice s) { /* FNV-1a */
+    uint64_t h = (uint64_t)0xCBF29CE4U << 32 | 0x84222325U;
+    uint64_t prime = (uint64_t)0x100U << 32 | 0x1B3U;
+    const char *p;
+    for (p = s.p; p < s.end; ++p)
+        h = (h ^ (unsigned char)*p) * prime;
+    return h;
+}
+
+static int pbL_checkfile(pb_State *S, pb_Slice body, int *pskip) {
+    pb_Slice v = body, name = pb_slice(NULL);
+    const pb_Name *n;
+    pb_FileEntry *e = NULL;
+    uint64_t hash;
+    uint32_t tag;
+    int same;
+    while (name.p == NULL && pb_readvarint32(&v, &tag)) {
+        if (tag == pb_pair(1, PB_TBYTES)) { /* string name */
+            if (pb_readbytes(&v, &name) == 0) return PB_OK;
+        } else if (pb_skipvalue(&v, tag) == 0) return PB_OK;
+    }
+    if (name.p == NULL) return PB_OK; /* no name, always load it */
+    hash = pbL_hash(body);
+    if ((n = pb_name(S, name, NULL)) != NULL)
+        e = (pb_FileEntry*)pb_gettable(&S->files, (pb_Key)n);
+    if (e == NULL) {
+        pbCM(n = pb_newname(S, name, NULL)); /* kept by the record */
+        pbCM(e = (pb_FileEntry*)pb_settable(&S->files, (pb_Key)n));
+        e->status = PB_FLOADED, e->serial = S->loads, same = 0;
+    } else {
+        same = (e->hash == hash && e->size == pb_len(body));
+        if (e->serial != S->loads) /* met first time in this load */
+            e->status = same ? PB_FSKIPPED : PB_FREPLACED;
+    }
+    e->hash = hash, e->size = pb_len(body), e->serial = S->loads;
+    *pskip = same;
+    return PB_OK;
 }
 
-static void pbL_delFileInfo(pbL_FileInfo *files) {
-    size_t i, count, j, jcount;
-    for (i = 0, count = pbL_count(files); i < count; ++i) {
-        for (j = 0, jcount = pbL_count(files[i].message_type); j < jcount; ++j)
-            pbL_delTypeInfo(&files[i].message_type[j]);
-        for (j = 0, jcount = pbL_count(files[i].enum_type); j < jcount; ++j)
-            pbL_delete(files[i].enum_type[j].value);
-        pbL_delete(files[i].message_type);
-        pbL_delete(files[i].enum_type);
-        pbL_delete(files[i].extension);
+static int pbL_checkfiles(pb_State *S, pb_Loader *L) {
+    pb_Slice s = L->s, v;
+    uint32_t tag;
+    ++S->loads;
+    while (pb_readvarint32(&L->s, &tag)) {
+        int skip = 0;
+        char *p;
+        if (tag != pb_pair(1, PB_TBYTES)) {
+            if (pb_skipvalue(&L->s, tag) == 0) break;
+            continue;
+        }
+        if (pb_readbytes(&L->s, &v) == 0) break; /* the parser reports it */
+        pbC(pbL_checkfile(S, v, &skip));
+        pbCM(p = pb_prepbuffsize(&L->skips, 1));
+        *p = (char)skip, pb_addsize(&L->skips, 1);
     }
-    pbL_delete(files);
+    L->s = s;
+    return PB_OK;
 }
 
+PB_API int pb_nextfile(const pb_State *S, const pb_Name **pname, int *pstatus) {
+    const pb_Entry *ent = NULL;
+    if (S == NULL) return 0;
+    if (*pname != NULL) ent = pb_gettable(&S->files, (pb_Key)*pname);
+    while (pb_nextentry(&S->files, &ent)) {
+        const pb_FileEntry *e = (const pb_FileEntry*)ent;
+        if (e->serial == S->loads) {
+            *pname = (const pb_Name*)e->entry.key, *pstatus = e->status;
+            return 1;
+        }
+    }
+    *pname = NULL;
+    return 0;
+}
+
+/* loader */
+
 static int pbL_prefixname(pb_State *S, pb_Slice s, size_t *ps, pb_Loader *L, pb_Name **out) {
     char *buff;
     *ps = pb_bufflen(&L->b);
@@ -1619,7 +2156,7 @@ static int pbL_loadEnum(pb_State *S, pbL_EnumInfo *info, pb_Loader *L) {
     pb_Type *t;
     pbC(pbL_prefixname(S, info->name, &curr, L, &name));
     pbCM(t = pb_newtype(S, name));
-    t->is_enum = 1;
+    t->is_enum = t->is_defined = 1;
     for (i = 0, count = pbL_count(info->value); i < count; ++i) {
         pbL_EnumValueInfo *ev = &info->value[i];
         pbCE(pb_newfield(S, t, pb_newname(S, ev->name, NULL), ev->number));
@@ -1628,15 +2165,24 @@ static int pbL_loadEnum(pb_State *S, pbL_EnumInfo *info, pb_Loader *L) {
     return PB_OK;
 }
 
+static int pbL_addref(pb_Loader *L, const pb_Type *t) {
+    if (L->refs == NULL || t == NULL || t->is_defined) return PB_OK;
+    return pb_addslice(L->refs, pb_lslice((const char*)&t, sizeof(t))) ?
+        PB_OK : PB_ENOMEM;
+}
+
 static int pbL_loadField(pb_State *S, pbL_FieldInfo *info, pb_Loader *L, pb_Type *t) {
     pb_Type  *ft = NULL;
     pb_Field *f;
-    if (info->type == PB_Tmessage || info->type == PB_Tenum)
+    if (info->type == PB_Tmessage || info->type == PB_Tenum) {
         pbCE(ft = pb_newtype(S, pb_newname(S, info->type_name, NULL)));
-    if (t == NULL)
+        pbC(pbL_addref(L, ft));
+    }
+    if (t == NULL) {
         pbCE(t = pb_newtype(S, pb_newname(S, info->extendee, NULL)));
+        pbC(pbL_addref(L, t));
+    }
     pbCE(f = pb_newfield(S, t, pb_newname(S, info->name, NULL), info->number));
-    f->default_value = pb_newname(S, info->default_value, NULL);
     f->type      = ft;
     if ((f->oneof_idx = info->oneof_index)) ++t->oneof_field;
     f->type_id   = info->type;
@@ -1644,7 +2190,7 @@ static int pbL_loadField(pb_State *S, pbL_FieldInfo *info, pb_Loader *L, pb_Type
     f->packed    = info->packed >= 0 ? info->packed : L->is_proto3 && f->repeated;
     if (f->type_id >= 9 && f->type_id <= 12) f->packed = 0;
     f->scalar = (f->type == NULL);
-    return PB_OK;
+    return pbT_setdefault(S, t, f, pb_newname(S, info->default_value, NULL));
 }
 
 static int pbL_loadType(pb_State *S, pbL_TypeInfo *info, pb_Loader *L) {
@@ -1654,6 +2200,7 @@ static int pbL_loadType(pb_State *S, pbL_TypeInfo *info, pb_Loader *L) {
     pbC(pbL_prefixname(S, info->name, &curr, L, &name));
     pbCM(t = pb_newtype(S, name));
     t->is_map = info->is_map, t->is_proto3 = L->is_proto3;
+    t->is_defined = 1;
     for (i = 0, count = pbL_count(info->oneof_decl); i < count; ++i) {
         pb_OneofEntry *e = (pb_OneofEntry*)pb_settable(&t->oneof_index, i+1);
         pbCM(e); pbCE(e->name = pb_newname(S, info->oneof_decl[i], NULL));
@@ -1672,6 +2219,36 @@ static int pbL_loadType(pb_State *S, pbL_TypeInfo *info, pb_Loader *L) {
     return PB_OK;
 }
 
+static int pbL_loadService(pb_State *S, pbL_ServiceInfo *info, pb_Loader *L) {
+    size_t i, count, curr, scurr;
+    pbC(pbL_prefixname(S, info->name, &curr, L, NULL));
+    for (i = 0, count = pbL_count(info->method); i < count; ++i) {
+        pbL_MethodInfo *mi = &info->method[i];
+        pb_MethodEntry *me;
+        pb_Type *input, *output;
+        pb_Name *name;
+        char *p;
+        pbCE(input = pb_newtype(S, pb_newname(S, mi->input_type, NULL)));
+        pbCE(output = pb_newtype(S, pb_newname(S, mi->output_type, NULL)));
+        scurr = pb_bufflen(&L->b);
+        pbCM(p = pb_prepbuffsize(&L->b, pb_len(mi->name) + 1));
+        *p = '/', pb_addsize(&L->b, 1);
+        if (pb_addslice(&L->b, mi->name) == 0) return PB_ENOMEM;
+        pbCM(name = pb_newname(S, pb_result(&L->b), NULL));
+        pb_bufflen(&L->b) = (unsigned)scurr;
+        me = (pb_MethodEntry*)pb_settable(&S->methods, (pb_Key)name);
+        if (me == NULL) return pb_delname(S, name), PB_ENOMEM;
+        if (me->value.name != NULL) pb_delname(S, name); /* loaded again */
+        me->value.name   = name;
+        me->value.input  = input;
+        me->value.output = output;
+        me->value.client_streaming = mi->client_streaming != 0;
+        me->value.server_streaming = mi->server_streaming != 0;
+    }
+    pb_bufflen(&L->b) = (unsigned)curr;
+    return PB_OK;
+}
+
 static int pbL_loadFile(pb_State *S, pbL_FileInfo *info, pb_Loader *L) {
     size_t i, count, j, jcount, curr = 0;
     pb_Name *syntax;
@@ -1686,6 +2263,8 @@ static int pbL_loadFile(pb_State *S, pbL_FileInfo *info, pb_Loader *L) {
             pbC(pbL_loadType(S, &info[i].message_type[j], L));
         for (j = 0, jcount = pbL_count(info[i].extension); j < jcount; ++j)
             pbC(pbL_loadField(S, &info[i].extension[j], L, NULL));
+        for (j = 0, jcount = pbL_count(info[i].service); j < jcount; ++j)
+            pbC(pbL_loadService(S, &info[i].service[j], L));
         pb_bufflen(&L->b) = (unsigned)curr;
     }
     return PB_OK;
@@ -1695,17 +2274,1016 @@ PB_API int pb_load(pb_State *S, pb_Slice *s) {
     pbL_FileInfo *files = NULL;
     pb_Loader L;
     int r;
-    pb_initbuffer(&L.b);
-    L.s         = *s;
-    L.is_proto3 = 0;
-    if ((r = pbL_FileDescriptorSet(&L, &files)) == PB_OK)
+    pbL_init(&L, *s);
+    if ((r = pbL_checkfiles(S, &L)) == PB_OK
+            && (r = pbL_prepare(S, &L, pbL_sizeFileSet)) == PB_OK
+            && (r = pbL_FileDescriptorSet(&L, &files)) == PB_OK)
         r = pbL_loadFile(S, files, &L);
-    pbL_delFileInfo(files);
-    pb_resetbuffer(&L.b);
+    if (r != PB_OK) pbT_freefiles(S); /* not sure what is loaded */
     s->p = L.s.p;
+    pbL_free(&L);
     return r;
 }
 
+/* lazy loader: index type names, build types on first use */
+
+typedef struct pbL_LazyUnit {
+    pb_Slice s;       /* top level descriptor, with its length prefix */
+    pb_Slice package;
+    unsigned is_enum   : 1;
+    unsigned is_proto3 : 1;
+    unsigned loaded    : 1;
+} pbL_LazyUnit;
+
+#define pbL_units(S) ((pbL_LazyUnit*)pb_buffer(&(S)->lazyunits))
+
+static int pbL_unbuilt(const pb_State *S, const pb_LazyEntry *e) {
+    /* a failed load may leave names of a unit that was never added */
+    return e != NULL && e->unit < pb_bufflen(&S->lazyunits)/sizeof(pbL_LazyUnit)
+        && !pbL_units(S)[e->unit].loaded;
+}
+
+static int pbL_lazyname(pb_State *S, pb_Loader *L, pb_Slice name, size_t unit, size_t *ps) {
+    pb_Name *tname;
+    pb_LazyEntry *e;
+    pbC(pbL_prefixname(S, name, ps, L, &tname));
+    pbCM(tname);
+    pbCM(e = (pb_LazyEntry*)pb_settable(&S->lazytypes, (pb_Key)tname));
+    e->unit = unit;
+    return PB_OK;
+}
+
+static int pbL_lazyenum(pb_State *S, pb_Loader *L, size_t unit) {
+    pb_Slice s, name = pb_slice(NULL);
+    size_t curr;
+    uint32_t tag;
+    pbC(pbL_beginmsg(L, &s));
+    while (pb_readvarint32(&L->s, &tag)) {
+        if (tag == pb_pair(1, PB_TBYTES)) /* string name */
+            pbC(pbL_readbytes(L, &name));
+        else if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+    }
+    pbC(pbL_lazyname(S, L, name, unit, &curr));
+    pb_bufflen(&L->b) = (unsigned)curr;
+    pbL_endmsg(L, &s);
+    return PB_OK;
+}
+
+static int pbL_lazytype(pb_State *S, pb_Loader *L, size_t unit, int *eager) {
+    pb_Slice s, body, name = pb_slice(NULL);
+    size_t curr;
+    uint32_t tag;
+    pbC(pbL_beginmsg(L, &s));
+    body = L->s; /* name first, nested names are prefixed by it */
+    while (pb_readvarint32(&L->s, &tag)) {
+        if (tag == pb_pair(1, PB_TBYTES)) /* string name */
+            pbC(pbL_readbytes(L, &name));
+        else if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+    }
+    pbC(pbL_lazyname(S, L, name, unit, &curr));
+    L->s = body;
+    while (pb_readvarint32(&L->s, &tag)) {
+        switch (tag) {
+        case pb_pair(3, PB_TBYTES): /* DescriptorProto nested_type */
+            pbC(pbL_lazytype(S, L, unit, eager)); break;
+        case pb_pair(4, PB_TBYTES): /* EnumDescriptorProto enum_type */
+            pbC(pbL_lazyenum(S, L, unit)); break;
+        case pb_pair(6, PB_TBYTES): /* FieldDescriptorProto extension */
+            *eager = 1; /* FALLTHROUGH */
+        default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+        }
+    }
+    pb_bufflen(&L->b) = (unsigned)curr;
+    pbL_endmsg(L, &s);
+    return PB_OK;
+}
+
+static int pbL_lazyload(pb_State *S, size_t unit, pb_Buffer *refs) {
+    pbL_LazyUnit *u = &pbL_units(S)[unit];
+    pb_Loader L;
+    size_t curr;
+    int r = PB_OK;
+    if (u->loaded) return PB_OK;
+    u->loaded = 1;
+    pbL_init(&L, u->s);
+    L.is_proto3 = u->is_proto3;
+    L.refs = refs;
+    r = pbL_prepare(S, &L, u->is_enum ? pbL_sizeEnum : pbL_sizeType);
+    if (r == PB_OK && u->package.p)
+        r = pbL_prefixname(S, u->package, &curr, &L, NULL);
+    if (r == PB_OK && u->is_enum) {
+        pbL_EnumInfo info;
+        memset(&info, 0, sizeof(info));
+        if ((r = pbL_EnumDescriptorProto(&L, &info)) == PB_OK)
+            r = pbL_loadEnum(S, &info, &L);
+    } else if (r == PB_OK) {
+        pbL_TypeInfo info;
+        memset(&info, 0, sizeof(info));
+        if ((r = pbL_DescriptorProto(&L, &info)) == PB_OK)
+            r = pbL_loadType(S, &info, &L);
+    }
+    pbL_free(&L);
+    return r;
+}
+
+static int pbL_lazybuild(pb_State *S, size_t unit) {
+    /* build a unit and every lazy type it refers to, only the types met
+     * by these builds are looked at */
+    pb_Buffer refs;
+    size_t i;
+    int r;
+    pb_initbuffer(&refs);
+    r = pbL_lazyload(S, unit, &refs);
+    for (i = 0; r == PB_OK && i < pb_bufflen(&refs)/sizeof(pb_Type*); ++i) {
+        const pb_Type *t = ((const pb_Type**)pb_buffer(&refs))[i];
+        const pb_LazyEntry *le;
+        if (t->is_defined || t->is_dead) continue;
+        le = (const pb_LazyEntry*)pb_gettable(&S->lazytypes, (pb_Key)t->name);
+        if (pbL_unbuilt(S, le)) r = pbL_lazyload(S, le->unit, &refs);
+    }
+    pb_resetbuffer(&refs);
+    return r;
+}
+
+static int pbL_lazyclosure(pb_State *S) {
+    /* after a load, build the lazy types that built types refer to */
+    const pb_Entry *e = NULL;
+    pb_Buffer pending;
+    size_t i, count;
+    int r = PB_OK;
+    if (pb_bufflen(&S->lazyunits) == 0) return PB_OK;
+    pb_initbuffer(&pending);
+    while (r == PB_OK && pb_nextentry(&S->types, &e)) {
+        const pb_Type *t = ((const pb_TypeEntry*)e)->value;
+        const pb_LazyEntry *le;
+        if (t == NULL || t->is_defined || t->is_dead) continue;
+        le = (const pb_LazyEntry*)pb_gettable(&S->lazytypes, (pb_Key)t->name);
+        if (!pbL_unbuilt(S, le)) continue;
+        if (pb_addslice(&pending,
+                    pb_lslice((const char*)&le->unit, sizeof(size_t))) == 0)
+            r = PB_ENOMEM;
+    }
+    count = pb_bufflen(&pending) / sizeof(size_t);
+    for (i = 0; r == PB_OK && i < count; ++i)
+        r = pbL_lazybuild(S, ((size_t*)pb_buffer(&pending))[i]);
+    pb_resetbuffer(&pending);
+    return r;
+}
+
+static int pbL_lazyunit(pb_State *S, pb_Loader *L, pb_Slice package, int is_enum) {
+    size_t unit = pb_bufflen(&S->lazyunits) / sizeof(pbL_LazyUnit);
+    const char *p = L->s.p;
+    pbL_LazyUnit *u;
+    int eager = 0;
+    if (is_enum) pbC(pbL_lazyenum(S, L, unit));
+    else pbC(pbL_lazytype(S, L, unit, &eager));
+    pbCM(u = (pbL_LazyUnit*)pb_prepbuffsize(&S->lazyunits, sizeof(pbL_LazyUnit)));
+    memset(u, 0, sizeof(pbL_LazyUnit));
+    u->s         = pb_lslice(p, L->s.p - p);
+    u->package   = package;
+    u->is_enum   = is_enum;
+    u->is_proto3 = L->is_proto3;
+    pb_addsize(&S->lazyunits, sizeof(pbL_LazyUnit));
+    /* extensions nested in a message change their extendee at load */
+    return eager ? pbL_lazyload(S, unit, NULL) : PB_OK;
+}
+
+static int pbL_lazyext(pb_State *S, pb_Loader *L) {
+    pbL_FieldInfo info;
+    memset(&info, 0, sizeof(info));
+    pbC(pbL_FieldDescriptorProto(L, &info));
+    return pbL_loadField(S, &info, L, NULL);
+}
+
+static int pbL_lazyservice(pb_State *S, pb_Loader *L) {
+    pbL_ServiceInfo info; /* services are small, build them at once */
+    memset(&info, 0, sizeof(info));
+    pbC(pbL_ServiceDescriptorProto(L, &info));
+    return pbL_loadService(S, &info, L);
+}
+
+static int pbL_lazyfile(pb_State *S, pb_Loader *L) {
+    pb_Slice s, body, package = pb_slice(NULL), syntax = pb_slice(NULL);
+    pb_Name *proto3;
+    size_t curr = 0;
+    uint32_t tag;
+    pbC(pbL_beginmsg(L, &s));
+    body = L->s;
+    while (pb_readvarint32(&L->s, &tag)) {
+        switch (tag) {
+        case pb_pair(2, PB_TBYTES): /* string package */
+            pbC(pbL_readbytes(L, &package)); break;
+        case pb_pair(12, PB_TBYTES): /* string syntax */
+            pbC(pbL_readbytes(L, &syntax)); break;
+        default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+        }
+    }
+    pbCM(proto3 = pb_newname(S, pb_slice("proto3"), NULL));
+    L->is_proto3 = (pb_name(S, syntax, NULL) == proto3);
+    if (package.p) pbC(pbL_prefixname(S, package, &curr, L, NULL));
+    L->s = body;
+    while (pb_readvarint32(&L->s, &tag)) {
+        switch (tag) {
+        case pb_pair(4, PB_TBYTES): /* DescriptorProto message_type */
+            pbC(pbL_lazyunit(S, L, package, 0)); break;
+        case pb_pair(5, PB_TBYTES): /* EnumDescriptorProto enum_type */
+            pbC(pbL_lazyunit(S, L, package, 1)); break;
+        case pb_pair(7, PB_TBYTES): /* FieldDescriptorProto extension */
+            pbC(pbL_lazyext(S, L)); break;
+        case pb_pair(6, PB_TBYTES): /* ServiceDescriptorProto service */
+            pbC(pbL_lazyservice(S, L)); break;
+        default: if (pb_skipvalue(&L->s, tag) == 0) return PB_ERROR;
+        }
+    }
+    pb_bufflen(&L->b) = (unsigned)curr;
+    pbL_endmsg(L, &s);
+    return PB_OK;
+}
+
+PB_API int pb_loadlazy(pb_State *S, pb_Slice *s) {
+    size_t len = pb_len(*s);
+    char *data = (char*)malloc(sizeof(void*) + len);
+    pb_Loader L;
+    uint32_t tag;
+    size_t i = 0;
+    int r;
+    if (data == NULL) return PB_ENOMEM;
+    *(void**)data = S->lazydata, S->lazydata = data; /* keep the bytes */
+    data += sizeof(void*);
+    memcpy(data, s->p, len);
+    pbL_init(&L, pb_lslice(data, len));
+    r = pbL_checkfiles(S, &L);
+    while (r == PB_OK && pb_readvarint32(&L.s, &tag)) {
+        if (tag == pb_pair(1, PB_TBYTES) && !pbL_skipped(&L, i++))
+            r = pbL_lazyfile(S, &L); /* FileDescriptorProto file */
+        else if (pb_skipvalue(&L.s, tag) == 0)
+            r = PB_ERROR;
+    }
+    if (r == PB_OK) r = pbL_lazyclosure(S);
+    if (r != PB_OK) pbT_freefiles(S);
+    s->p += L.s.p - data;
+    pbL_free(&L);
+    return r;
+}
+
+PB_API const pb_Type *pb_loadtype(pb_State *S, const pb_Name *tname) {
+    const pb_Type *t = pb_type(S, tname);
+    const pb_LazyEntry *e;
+    if (tname == NULL || (t != NULL && t->is_defined)) return t;
+    e = (const pb_LazyEntry*)pb_gettable(&S->lazytypes, (pb_Key)tname);
+    if (!pbL_unbuilt(S, e)) return t;
+    if (pbL_lazybuild(S, e->unit) != PB_OK) return NULL;
+    return pb_type(S, tname);
+}
+
+PB_API int pb_loadall(pb_State *S) {
+    size_t i, count = pb_bufflen(&S->lazyunits) / sizeof(pbL_LazyUnit);
+    for (i = 0; i < count; ++i)
+        pbC(pbL_lazyload(S, i, NULL));
+    return PB_OK;
+}
+
+/* state snapshot: resolved types, without descriptor parsing */
+
+#define PB_SNAPSHOT_MAGIC "\33pbS2"
+
+typedef struct pbS_TypeIndex { pb_Entry entry; uint32_t index; } pbS_TypeIndex;
+
+#define pbS_add(e)     do { if ((e) == 0) return PB_ENOMEM; } while (0)
+#define pbS_read(s,pv) do { if (!pb_readvarint32((s),(pv))) return PB_ERROR; } while (0)
+
+static int pbS_addname(pb_Buffer *b, const pb_Name *name) {
+    pb_Slice s = pb_slice((const char*)name); /* 0 for NULL, len+1 else */
+    pbS_add(pb_addvarint32(b, name ? (uint32_t)pb_len(s)+1 : 0));
+    if (pb_len(s) != 0) pbS_add(pb_addslice(b, s));
+    return PB_OK;
+}
+
+static int pbS_readname(pb_State *S, pb_Slice *s, pb_Name **pname) {
+    uint32_t len;
+    *pname = NULL;
+    pbS_read(s, &len);
+    if (len-- == 0) return PB_OK;
+    if (pb_len(*s) < len) return PB_ERROR;
+    pbCM(*pname = pb_newname(S, pb_lslice(s->p, len), NULL));
+    s->p += len;
+    return PB_OK;
+}
+
+static int pbS_savetype(pb_Buffer *b, const pb_Table *index, const pb_Type *t) {
+    const pb_Field *f = NULL;
+    uint32_t i, count = 0;
+    pbS_add(pb_addvarint32(b, t->is_enum | t->is_map<<1 | t->is_proto3<<2
+                | t->is_dead<<3 | t->is_defined<<4));
+    pbS_add(pb_addvarint32(b, t->oneof_count));
+    for (i = 1; i <= t->oneof_count; ++i)
+        pbC(pbS_addname(b, pb_oneofname(t, (int)i)));
+    while (pb_nextfield(t, &f)) ++count;
+    pbS_add(pb_addvarint32(b, count));
+    while (pb_nextfield(t, &f)) {
+        const pbS_TypeIndex *ti = f->type == NULL ? NULL :
+            (const pbS_TypeIndex*)pb_gettable(index, (pb_Key)f->type);
+        pbC(pbS_addname(b, f->name));
+        pbS_add(pb_addvarint32(b, (uint32_t)f->number));
+        pbS_add(pb_addvarint32(b, ti ? ti->index : 0));
+        pbC(pbS_addname(b, pb_defaultvalue(t, f)));
+        pbS_add(pb_addvarint32(b, f->oneof_idx));
+        pbS_add(pb_addvarint32(b, f->type_id | f->repeated<<5
+                    | f->packed<<6 | f->scalar<<7));
+    }
+    return PB_OK;
+}
+
+static int pbS_savemethods(const pb_State *S, pb_Buffer *b, const pb_Table *index) {
+    const pb_Entry *e = NULL;
+    uint32_t count = 0;
+    while (pb_nextentry(&S->methods, &e))
+        count += ((const pb_MethodEntry*)e)->value.name != NULL;
+    pbS_add(pb_addvarint32(b, count));
+    while (pb_nextentry(&S->methods, &e)) {
+        const pb_Method *m = &((const pb_MethodEntry*)e)->value;
+        const pbS_TypeIndex *in, *out;
+        if (m->name == NULL) continue;
+        in  = (const pbS_TypeIndex*)pb_gettable(index, (pb_Key)m->input);
+        out = (const pbS_TypeIndex*)pb_gettable(index, (pb_Key)m->output);
+        pbC(pbS_addname(b, m->name));
+        pbS_add(pb_addvarint32(b, in ? in->index : 0));
+        pbS_add(pb_addvarint32(b, out ? out->index : 0));
+        pbS_add(pb_addvarint32(b, m->client_streaming | m->server_streaming<<1));
+    }
+    return PB_OK;
+}
+
+static int pbS_save(const pb_State *S, pb_Buffer *b, pb_Table *index) {
+    const pb_Entry *e = NULL;
+    uint32_t count = 0;
+    while (pb_nextentry(&S->types, &e)) {
+        const pb_Type *t = ((const pb_TypeEntry*)e)->value;
+        pbS_TypeIndex *ti;
+        if (t == NULL) continue;
+        pbCM(ti = (pbS_TypeIndex*)pb_settable(index, (pb_Key)t));
+        ti->index = ++count;
+    }
+    pbS_add(pb_addslice(b, pb_slice(PB_SNAPSHOT_MAGIC)));
+    pbS_add(pb_addvarint32(b, count));
+    while (pb_nextentry(&S->types, &e)) /* names first, fields refer them */
+        if (((const pb_TypeEntry*)e)->value != NULL)
+            pbC(pbS_addname(b, ((const pb_TypeEntry*)e)->value->name));
+    while (pb_nextentry(&S->types, &e)) {
+        const pb_Type *t = ((const pb_TypeEntry*)e)->value;
+        if (t != NULL) pbC(pbS_savetype(b, index, t));
+    }
+    return pbS_savemethods(S, b, index);
+}
+
+PB_API int pb_savesnapshot(const pb_State *S, pb_Buffer *b) {
+    pb_Table index;
+    int r;
+    pb_inittable(&index, sizeof(pbS_TypeIndex));
+    r = pbS_save(S, b, &index);
+    pb_freetable(&index);
+    return r;
+}
+
+static int pbS_loadfield(pb_State *S, pb_Slice *s, pb_Type **types, uint32_t count, pb_Type *t) {
+    pb_Name *name, *defvalue;
+    uint32_t number, type, oneof, flags;
+    pb_Field *f;
+    pbC(pbS_readname(S, s, &name));
+    pbS_read(s, &number);
+    pbS_read(s, &type);
+    pbC(pbS_readname(S, s, &defvalue));
+    pbS_read(s, &oneof);
+    pbS_read(s, &flags);
+    if (name == NULL || type > count || (type == 0
+                && ((flags & 31) == PB_Tmessage || (flags & 31) == PB_Tenum))
+            || (number == 0 && !t->is_enum) || oneof > t->oneof_count) {
+        pb_delname(S, name), pb_delname(S, defvalue);
+        return PB_ERROR;
+    }
+    pbCE(f = pb_newfield(S, t, name, (int32_t)number));
+    f->type      = type ? types[type-1] : NULL;
+    if ((f->oneof_idx = oneof)) ++t->oneof_field;
+    f->type_id   = flags & 31;
+    f->repeated  = (flags >> 5) & 1;
+    f->packed    = (flags >> 6) & 1;
+    f->scalar    = (flags >> 7) & 1;
+    return pbT_setdefault(S, t, f, defvalue);
+}
+
+static int pbS_loadtype(pb_State *S, pb_Slice *s, pb_Type **types, uint32_t count, pb_Type *t) {
+    uint32_t i, flags, n;
+    pbS_read(s, &flags);
+    pbS_read(s, &n);
+    for (i = 1; i <= n; ++i) {
+        pb_OneofEntry *e;
+        pb_Name *name;
+        pbC(pbS_readname(S, s, &name));
+        if (name == NULL) continue;
+        pbCM(e = (pb_OneofEntry*)pb_settable(&t->oneof_index, i));
+        e->name = name, e->index = (int)i;
+    }
+    t->oneof_count = n;
+    t->is_enum     = flags & 1; /* field checks need it */
+    pbS_read(s, &n);
+    if (t->field_count == 0 && n != 0) { /* presize fresh types */
+        pbS_add(pb_resizetable(&t->field_tags, n));
+        pbS_add(pb_resizetable(&t->field_names, n));
+    }
+    for (i = 0; i < n; ++i)
+        pbC(pbS_loadfield(S, s, types, count, t));
+    t->is_enum    = flags & 1;
+    t->is_map     = (flags >> 1) & 1;
+    t->is_proto3  = (flags >> 2) & 1;
+    t->is_dead    = (flags >> 3) & 1;
+    t->is_defined = (flags >> 4) & 1;
+    return PB_OK;
+}
+
+static int pbS_loadmethods(pb_State *S, pb_Slice *s, pb_Type **types, uint32_t count) {
+    uint32_t i, n, in, out, flags;
+    pbS_read(s, &n);
+    for (i = 0; i < n; ++i) {
+        pb_MethodEntry *me;
+        pb_Name *name;
+        pbC(pbS_readname(S, s, &name));
+        pbS_read(s, &in);
+        pbS_read(s, &out);
+        pbS_read(s, &flags);
+        if (name == NULL || in == 0 || in > count || out == 0 || out > count)
+            return PB_ERROR;
+        me = (pb_MethodEntry*)pb_settable(&S->methods, (pb_Key)name);
+        if (me == NULL) return pb_delname(S, name), PB_ENOMEM;
+        if (me->value.name != NULL) pb_delname(S, name);
+        me->value.name   = name;
+        me->value.input  = types[in-1];
+        me->value.output = types[out-1];
+        me->value.client_streaming = flags & 1;
+        me->value.server_streaming = (flags >> 1) & 1;
+    }
+    return PB_OK;
+}
+
+static int pbS_load(pb_State *S, pb_Slice *s, pb_Buffer *b, uint32_t count) {
+    pb_Type **types = NULL;
+    uint32_t i;
+    if (count > pb_len(*s)) return PB_ERROR;
+    if (count != 0)
+        pbCM(types = (pb_Type**)pb_prepbuffsize(b, count*sizeof(pb_Type*)));
+    for (i = 0; i < count; ++i) {
+        pb_Name *name;
+        pbC(pbS_readname(S, s, &name));
+        pbCE(name);
+        pbCM(types[i] = pb_newtype(S, name));
+    }
+    for (i = 0; i < count; ++i)
+        pbC(pbS_loadtype(S, s, types, count, types[i]));
+    return pbS_loadmethods(S, s, types, count);
+}
+
+PB_API int pb_loadsnapshot(pb_State *S, pb_Slice *s) {
+    pb_Slice magic = pb_slice(PB_SNAPSHOT_MAGIC);
+    pb_Buffer b;
+    uint32_t count;
+    int r;
+    if (pb_len(*s) < pb_len(magic)
+            || memcmp(s->p, magic.p, pb_len(magic)) != 0)
+        return PB_ERROR;
+    s->p += pb_len(magic);
+    pbS_read(s, &count);
+    pbT_freefiles(S), ++S->loads; /* types may differ from files */
+    pb_initbuffer(&b);
+    r = pbS_load(S, s, &b, count);
+    pb_resetbuffer(&b);
+    return r;
+}
+
+/* frozen state: every name, type, field and table in one block */
+
+typedef struct pbF_Map { pb_Entry entry; void *value; } pbF_Map;
+
+typedef struct pbF_Freezer {
+    pb_Table names;  /* old name -> new name */
+    pb_Table types;  /* old type -> new type */
+    size_t   nnames, ntypes, nmethods;
+    size_t   size;   /* bytes of the block */
+    char    *p;      /* next free byte in the block */
+} pbF_Freezer;
+
+static size_t pbF_hashsize(size_t count) { /* see pbT_newkey() */
+    size_t size = 2; /* no room left for growing, unlike pb_resizetable() */
+    if (count == 0) return 0;
+    while (size < count + 1) size <<= 1; /* slot 0 is only for key 0 */
+    return size;
+}
+
+static int pbF_isdense(pb_Field **fields, size_t count) {
+    size_t i; /* sorted, but aliased enum values share numbers */
+    for (i = 1; i < count; ++i)
+        if ((uint32_t)fields[i]->number - (uint32_t)fields[i-1]->number != 1)
+            return 0;
+    return count != 0;
+}
+
+static void *pbF_alloc(pbF_Freezer *F, size_t size)
+{ void *p = F->p; F->p += pbL_alignsize(size); return p; }
+
+static void pbF_table(pbF_Freezer *F, pb_Table *t, size_t count) {
+    size_t size = pbF_hashsize(count);
+    pb_inittable(t, t->entry_size);
+    if (size == 0) return;
+    t->size     = (unsigned)size;
+    t->lastfree = (unsigned)(size * t->entry_size);
+    t->hash     = (pb_Entry*)pbF_alloc(F, t->lastfree);
+    t->hash->dead = 1;
+}
+
+static int pbF_addname(pbF_Freezer *F, const pb_Name *name) {
+    pbF_Map *m;
+    if (name == NULL) return PB_OK;
+    pbCM(m = (pbF_Map*)pb_settable(&F->names, (pb_Key)name));
+    if (m->value == NULL) {
+        size_t len = ((const pb_NameEntry*)name - 1)->length;
+        m->value = (void*)name, ++F->nnames;
+        F->size += pbL_alignsize(sizeof(pb_NameEntry) + len + 1);
+    }
+    return PB_OK;
+}
+
+static int pbF_measure(pbF_Freezer *F, const pb_State *S) {
+    const pb_Entry *e = NULL;
+    size_t i;
+    while (pb_nextentry(&S->types, &e)) {
+        const pb_Type *t = ((const pb_TypeEntry*)e)->value;
+        const pb_Entry *fe = NULL;
+        size_t count = t ? t->field_count : 0, oneofs = 0, defaults = 0;
+        pb_Field **fields = NULL;
+        if (t == NULL) continue;
+        pbCM(pb_settable(&F->types, (pb_Key)t));
+        ++F->ntypes;
+        pbC(pbF_addname(F, t->name));
+        if (count != 0) pbCM(fields = pb_sortedfields(t));
+        for (i = 0; i < count; ++i) {
+            const pb_Name *dv = pb_defaultvalue(t, fields[i]);
+            defaults += (dv != NULL);
+            pbC(pbF_addname(F, fields[i]->name));
+            pbC(pbF_addname(F, dv));
+        }
+        while (pb_nextentry(&t->oneof_index, &fe)) {
+            ++oneofs;
+            pbC(pbF_addname(F, ((const pb_OneofEntry*)fe)->name));
+        }
+        F->size += pbL_alignsize(count * sizeof(pb_Field));
+        F->size += pbL_alignsize(count * sizeof(pb_Field*));
+        F->size += pbL_alignsize(pbF_hashsize(count) * sizeof(pb_FieldEntry));
+        if (!pbF_isdense(fields, count))
+            F->size += pbL_alignsize(pbF_hashsize(count) * sizeof(pb_FieldEntry));
+        F->size += pbL_alignsize(pbF_hashsize(oneofs) * sizeof(pb_OneofEntry));
+        F->size += pbL_alignsize(defaults * sizeof(pb_Default));
+    }
+    F->size += pbL_alignsize(F->ntypes * sizeof(pb_Type));
+    F->size += pbL_alignsize(pbF_hashsize(F->ntypes) * sizeof(pb_TypeEntry));
+    while (pb_nextentry(&S->methods, &e)) {
+        const pb_Method *m = &((const pb_MethodEntry*)e)->value;
+        if (m->name == NULL) continue;
+        ++F->nmethods;
+        pbC(pbF_addname(F, m->name));
+    }
+    F->size += pbL_alignsize(pbF_hashsize(F->nmethods) * sizeof(pb_MethodEntry));
+    for (i = PB_MIN_STRTABLE_SIZE; i < F->nnames; i <<= 1)
+        ;
+    F->nnames = i;
+    F->size += pbL_alignsize(F->nnames * sizeof(pb_NameEntry*));
+    return PB_OK;
+}
+
+#define pbF_map(tab,old) \
+    ((old) ? ((pbF_Map*)pb_gettable((tab), (pb_Key)(old)))->value : NULL)
+
+static void pbF_names(pbF_Freezer *F, pb_State *D) {
+    pb_NameTable *nt = &D->nametable;
+    const pb_Entry *e = NULL;
+    nt->size = F->nnames;
+    nt->hash = (pb_NameEntry**)pbF_alloc(F, nt->size * sizeof(pb_NameEntry*));
+    while (pb_nextentry(&F->names, &e)) {
+        const pb_NameEntry *on = (const pb_NameEntry*)((pbF_Map*)e)->value;
+        pb_NameEntry *ne, **list;
+        if (on-- == NULL) continue; /* the key 0 slot after a resize */
+        list = &nt->hash[on->hash & (nt->size - 1)];
+        ne = (pb_NameEntry*)pbF_alloc(F, sizeof(pb_NameEntry) + on->length + 1);
+        *ne = *on, ne->refcount = PB_MAX_REFCOUNT; /* never freed alone */
+        memcpy(ne + 1, on + 1, on->length + 1);
+        ne->next = *list, *list = ne, ++nt->count;
+        ((pbF_Map*)e)->value = ne + 1;
+    }
+}
+
+static void pbF_type(pbF_Freezer *F, const pb_Type *t, pb_Type *nt) {
+    size_t i, count = t->field_count, oneofs = 0, defaults = 0;
+    pb_Field **fields = count ? t->sorted_fields : NULL, *nf;
+    const pb_Entry *e = NULL;
+    pb_FieldEntry *fe;
+    nf = (pb_Field*)pbF_alloc(F, count * sizeof(pb_Field));
+    nt->sorted_fields = count ? (pb_Field**)pbF_alloc(F, count * sizeof(pb_Field*)) : NULL;
+    nt->is_dense = pbF_isdense(fields, count);
+    pbF_table(F, &nt->field_tags, nt->is_dense ? 0 : count);
+    pbF_table(F, &nt->field_names, count);
+    for (i = 0; i < count; ++i)
+        defaults += (pb_defaultvalue(t, fields[i]) != NULL);
+    nt->defaults = (pb_Default*)pbF_alloc(F, defaults * sizeof(pb_Default));
+    nt->default_count = 0;
+    for (i = 0; i < count; ++i) { /* fields together, in number order */
+        const pb_Name *dv = pb_defaultvalue(t, fields[i]);
+        nf[i] = *fields[i];
+        nf[i].name       = (pb_Name*)pbF_map(&F->names, fields[i]->name);
+        nf[i].type       = (pb_Type*)pbF_map(&F->types, fields[i]->type);
+        nf[i].sorted_idx = (uint32_t)i + 1;
+        nf[i].default_idx = 0;
+        nt->sorted_fields[i] = &nf[i];
+        if (!nt->is_dense && pb_field(t, fields[i]->number) == fields[i]) {
+            fe = (pb_FieldEntry*)pbT_newkey(&nt->field_tags, nf[i].number);
+            fe->value = &nf[i];
+        }
+        if (dv != NULL) {
+            pb_Default *d = &nt->defaults[nt->default_count++];
+            *d = *pb_default(t, fields[i]);
+            d->text = (pb_Name*)pbF_map(&F->names, dv);
+            nf[i].default_idx = nt->default_count;
+        }
+    }
+    while (pb_nextentry(&t->field_names, &e)) {
+        const pb_Field *f = ((const pb_FieldEntry*)e)->value;
+        if (f == NULL || f->sorted_idx == 0 || f->sorted_idx > count
+                || fields[f->sorted_idx - 1] != f) continue;
+        fe = (pb_FieldEntry*)pbT_newkey(&nt->field_names,
+                (pb_Key)nf[f->sorted_idx - 1].name);
+        fe->value = &nf[f->sorted_idx - 1];
+    }
+    while (pb_nextentry(&t->oneof_index, &e)) ++oneofs;
+    pbF_table(F, &nt->oneof_index, oneofs);
+    while (pb_nextentry(&t->oneof_index, &e)) {
+        const pb_OneofEntry *oe = (const pb_OneofEntry*)e;
+        pb_OneofEntry *ne = (pb_OneofEntry*)pbT_newkey(&nt->oneof_index, oe->entry.key);
+        ne->name  = (pb_Name*)pbF_map(&F->names, oe->name);
+        ne->index = oe->index;
+    }
+}
+
+static void pbF_build(pbF_Freezer *F, pb_State *D, const pb_State *S) {
+    pb_Type *types;
+    const pb_Entry *e = NULL;
+    size_t i = 0;
+    pbF_names(F, D);
+    types = (pb_Type*)pbF_alloc(F, F->ntypes * sizeof(pb_Type));
+    pbF_table(F, &D->types, F->ntypes);
+    while (pb_nextentry(&S->types, &e)) {
+        const pb_Type *t = ((const pb_TypeEntry*)e)->value;
+        pb_Type *nt = &types[i++];
+        pb_TypeEntry *te;
+        if (t == NULL) { --i; continue; }
+        *nt = *t; /* tables and sorted_fields are rebuilt by pbF_type() */
+        nt->name     = (pb_Name*)pbF_map(&F->names, t->name);
+        nt->basename = (const char*)nt->name + (t->basename - (const char*)t->name);
+        te = (pb_TypeEntry*)pbT_newkey(&D->types, (pb_Key)nt->name);
+        te->value = nt;
+        ((pbF_Map*)pb_gettable(&F->types, (pb_Key)t))->value = nt;
+    }
+    while (pb_nextentry(&S->types, &e)) {
+        const pb_Type *t = ((const pb_TypeEntry*)e)->value;
+        if (t != NULL) pbF_type(F, t, (pb_Type*)pbF_map(&F->types, t));
+    }
+    pbF_table(F, &D->methods, F->nmethods);
+    while (pb_nextentry(&S->methods, &e)) {
+        const pb_Method *m = &((const pb_MethodEntry*)e)->value;
+        pb_MethodEntry *me;
+        if (m->name == NULL) continue;
+        me = (pb_MethodEntry*)pbT_newkey(&D->methods,
+                (pb_Key)pbF_map(&F->names, m->name));
+        me->value        = *m;
+        me->value.name   = (pb_Name*)pbF_map(&F->names, m->name);
+        me->value.input  = (pb_Type*)pbF_map(&F->types, m->input);
+        me->value.output = (pb_Type*)pbF_map(&F->types, m->output);
+    }
+}
+
+PB_API int pb_freeze(pb_State *D, const pb_State *S) {
+    pbF_Freezer F;
+    char *block = NULL;
+    int r;
+    memset(&F, 0, sizeof(F));
+    pb_inittable(&F.names, sizeof(pbF_Map));
+    pb_inittable(&F.types, sizeof(pbF_Map));
+    if ((r = pbF_measure(&F, S)) == PB_OK
+            && (block = (char*)malloc(F.size)) == NULL)
+        r = PB_ENOMEM;
+    if (r == PB_OK) {
+        pb_free(D), pb_init(D);
+        memset(block, 0, F.size);
+        F.p = block;
+        pbF_build(&F, D, S);
+        assert(F.p == block + F.size);
+        D->frozen = block, D->frozen_size = F.size;
+    }
+    pb_freetable(&F.names);
+    pb_freetable(&F.types);
+    return r;
+}
+
+/* frozen image: the block of a frozen state, used in place where it lands
+ * at the address it was written from, or moved by fixing its pointers */
+
+#define PB_IMAGE_MAGIC "\33pbImg1" /* 8 bytes with the ending zero */
+#define PB_IMAGE_PAGE  65536u      /* no target has larger pages */
+
+typedef struct pbI_Header {
+    char         magic[8];
+    unsigned     check[4]; /* layout of this build, see pbI_check() */
+    char        *base;     /* address of the block when written */
+    size_t       offset;   /* of the block in the image */
+    size_t       size;     /* of the block */
+    size_t       align;    /* moves by a multiple keep every hash slot */
+    pb_NameTable nametable;
+    pb_Table     types;
+    pb_Table     methods;
+} pbI_Header;
+
+static void pbI_check(unsigned *check) {
+    check[0] = 0x01020304; /* byte order */
+    check[1] = (unsigned)sizeof(pbI_Header);
+    check[2] = (unsigned)sizeof(pb_Type);
+    check[3] = (unsigned)sizeof(pb_Field);
+}
+
+static size_t pbI_align(const pb_State *S) {
+    /* pointer keys find their slots by the low bits, see pbT_hash() */
+    size_t align = PB_IMAGE_PAGE, size = S->types.size;
+    const pb_Entry *e = NULL;
+    if (size < S->methods.size) size = S->methods.size;
+    while (pb_nextentry(&S->types, &e)) { /* dead types too */
+        const pb_Type *t = ((const pb_TypeEntry*)e)->value;
+        if (t != NULL && size < t->field_names.size)
+            size = t->field_names.size;
+    }
+    while (align < size) align <<= 1;
+    return align;
+}
+
+static int pbI_header(pbI_Header *h, const char *image, size_t size) {
+    unsigned check[4];
+    if (size < sizeof(pbI_Header)) return PB_ERROR;
+    memcpy(h, image, sizeof(pbI_Header));
+    pbI_check(check);
+    if (memcmp(h->magic, PB_IMAGE_MAGIC, sizeof(h->magic)) != 0
+            || memcmp(h->check, check, sizeof(check)) != 0
+            || h->offset < sizeof(pbI_Header) || h->offset > size
+            || h->size > size - h->offset
+            || (uintptr_t)h->base % PB_IMAGE_PAGE != h->offset % PB_IMAGE_PAGE
+            || h->align < PB_IMAGE_PAGE || (h->align & (h->align - 1)) != 0)
+        return PB_ERROR;
+    return PB_OK;
+}
+
+static void pbI_fix(void *pp, ptrdiff_t d) {
+    char *p; /* any object pointer, NULL stays NULL */
+    memcpy(&p, pp, sizeof(p));
+    if (p != NULL) p += d, memcpy(pp, &p, sizeof(p));
+}
+
+static void pbI_fixtable(pb_Table *t, ptrdiff_t d, int keys) {
+    const pb_Entry *e = NULL;
+    pbI_fix(&t->hash, d); /* entries link by offsets */
+    while (pb_nextentry(t, &e)) {
+        pb_Entry *me = (pb_Entry*)e;
+        if (keys) me->key += d;
+        pbI_fix(me + 1, d); /* the first pointer of every entry */
+    }
+}
+
+static void pbI_fixtype(pb_Type *t, ptrdiff_t d) {
+    unsigned i;
+    pbI_fix(&t->name, d);
+    pbI_fix(&t->basename, d);
+    pbI_fix(&t->sorted_fields, d);
+    pbI_fix(&t->defaults, d);
+    pbI_fixtable(&t->field_tags, d, 0);
+    pbI_fixtable(&t->field_names, d, 1);
+    pbI_fixtable(&t->oneof_index, d, 0);
+    for (i = 0; i < t->field_count; ++i) {
+        pb_Field *f;
+        pbI_fix(&t->sorted_fields[i], d);
+        f = t->sorted_fields[i];
+        pbI_fix(&f->type, d);
+        pbI_fix(&f->name, d);
+    }
+    for (i = 0; i < t->default_count; ++i)
+        pbI_fix(&t->defaults[i].text, d);
+}
+
+static void pbI_relocate(pbI_Header *h, ptrdiff_t d) {
+    pb_NameTable *nt = &h->nametable;
+    const pb_Entry *e = NULL;
+    size_t i;
+    pbI_fix(&h->base, d);
+    pbI_fix(&nt->hash, d);
+    for (i = 0; i < nt->size; ++i) {
+        pb_NameEntry **list = &nt->hash[i];
+        for (pbI_fix(list, d); *list != NULL; pbI_fix(list, d))
+            list = &(*list)->next;
+    }
+    pbI_fixtable(&h->types, d, 1);
+    while (pb_nextentry(&h->types, &e))
+        pbI_fixtype(((const pb_TypeEntry*)e)->value, d);
+    pbI_fixtable(&h->methods, d, 1);
+    while (pb_nextentry(&h->methods, &e)) {
+        pb_Method *m = &((pb_MethodEntry*)e)->value;
+        pbI_fix(&m->input, d);
+        pbI_fix(&m->output, d);
+    }
+}
+
+PB_API int pb_saveimage(const pb_State *S, pb_Buffer *b) {
+    pbI_Header h;
+    size_t pad;
+    if (S->frozen == NULL) return PB_ERROR;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PB_IMAGE_MAGIC, sizeof(h.magic));
+    pbI_check(h.check);
+    h.base   = (char*)S->frozen;
+    h.size   = S->frozen_size;
+    h.align  = pbI_align(S);
+    h.offset = (size_t)((uintptr_t)h.base % PB_IMAGE_PAGE);
+    if (h.offset < sizeof(h)) h.offset += PB_IMAGE_PAGE; /* maps by pages */
+    h.nametable = S->nametable;
+    h.types     = S->types;
+    h.methods   = S->methods;
+    pbS_add(pb_addslice(b, pb_lslice((const char*)&h, sizeof(h))));
+    pad = h.offset - sizeof(h);
+    pbS_add(pb_prepbuffsize(b, pad));
+    memset(pb_buffer(b) + pb_bufflen(b), 0, pad);
+    pb_addsize(b, pad);
+    pbS_add(pb_addslice(b, pb_lslice(h.base, h.size)));
+    return PB_OK;
+}
+
+PB_API int pb_imageinfo(pb_Slice s, const char **paddr, size_t *palign) {
+    pbI_Header h; /* where the image is used in place, and how it moves */
+    pbC(pbI_header(&h, s.p, pb_len(s)));
+    *paddr  = (const char*)((uintptr_t)h.base - h.offset);
+    *palign = h.align;
+    return PB_OK;
+}
+
+PB_API int pb_relocimage(char *image, size_t size) {
+    pbI_Header h;
+    ptrdiff_t d;
+    pbC(pbI_header(&h, image, size));
+    d = (ptrdiff_t)((uintptr_t)(image + h.offset) - (uintptr_t)h.base);
+    if (d % (ptrdiff_t)h.align != 0) return PB_ERROR;
+    if (d != 0) pbI_relocate(&h, d), memcpy(image, &h, sizeof(h));
+    return PB_OK;
+}
+
+PB_API int pb_useimage(pb_State *S, const char *image, size_t size) {
+    pbI_Header h; /* nothing writes to the block, it may be read only */
+    pbC(pbI_header(&h, image, size));
+    if (image + h.offset != h.base) return PB_ERROR; /* see pb_relocimage() */
+    pb_free(S), pb_init(S);
+    S->nametable    = h.nametable;
+    S->types        = h.types;
+    S->methods      = h.methods;
+    S->frozen       = h.base;
+    S->frozen_size  = h.size;
+    S->frozen_image = 1;
+    return PB_OK;
+}
+
+/* pruning: keep only the types reachable from some roots */
+
+static int pbP_mark(pb_Table *reach, pb_Buffer *stack, const pb_Type *t) {
+    if (t == NULL || pb_gettable(reach, (pb_Key)t) != NULL) return PB_OK;
+    pbCM(pb_settable(reach, (pb_Key)t));
+    if (pb_addslice(stack, pb_lslice((const char*)&t, sizeof(t))) == 0)
+        return PB_ENOMEM;
+    return PB_OK;
+}
+
+static int pbP_reach(pb_Table *reach, const pb_Type **roots, size_t count) {
+    pb_Buffer stack;
+    size_t i;
+    int r = PB_OK;
+    pb_initbuffer(&stack);
+    for (i = 0; r == PB_OK && i < count; ++i)
+        r = pbP_mark(reach, &stack, roots[i]);
+    while (r == PB_OK && pb_bufflen(&stack) != 0) {
+        const pb_Type *t;
+        const pb_Field *f = NULL;
+        pb_bufflen(&stack) -= sizeof(t);
+        memcpy(&t, pb_buffer(&stack) + pb_bufflen(&stack), sizeof(t));
+        while (r == PB_OK && pb_nextfield(t, &f)) /* extensions included */
+            r = pbP_mark(reach, &stack, f->type);
+    }
+    pb_resetbuffer(&stack);
+    return r;
+}
+
+static void pbP_compact(pb_Table *t) {
+    /* rebuild a table of pointer values without dead or NULL entries */
+    pb_Table nt;
+    const pb_Entry *e = NULL;
+    size_t count = 0;
+    while (pb_nextentry(t, &e)) count += ((const pbF_Map*)e)->value != NULL;
+    pb_inittable(&nt, t->entry_size);
+    if (count != 0 && pb_resizetable(&nt, count + 1) == 0) return;
+    while (pb_nextentry(t, &e)) {
+        if (((const pbF_Map*)e)->value != NULL) {
+            pb_Entry *ne = pbT_newkey(&nt, e->key);
+            memcpy(ne + 1, e + 1, t->entry_size - sizeof(pb_Entry));
+        }
+    }
+    pb_freetable(t);
+    *t = nt;
+}
+
+static void pbP_names(pb_State *S) {
+    /* recount the uses of every name, and free the unused ones */
+    pb_NameTable *nt = &S->nametable;
+    const pb_Type *t = NULL;
+    const pb_Entry *e = NULL;
+    size_t i;
+    for (i = 0; i < nt->size; ++i) {
+        pb_NameEntry *ne;
+        for (ne = nt->hash[i]; ne != NULL; ne = ne->next)
+            ne->refcount = 0;
+    }
+    while (pb_nextentry(&S->types, &e)) {
+        const pb_Entry *oe = NULL;
+        const pb_Field *f = NULL;
+        if ((t = ((const pb_TypeEntry*)e)->value) == NULL) continue;
+        pb_usename(t->name);
+        while (pb_nextfield(t, &f)) {
+            pb_usename(f->name);
+            pb_usename((pb_Name*)pb_defaultvalue(t, f));
+        }
+        while (pb_nextentry(&t->field_names, &oe)) { /* enum aliases */
+            f = ((const pb_FieldEntry*)oe)->value;
+            if (f != NULL && pb_field(t, f->number) != f) {
+                pb_usename(f->name);
+                pb_usename((pb_Name*)pb_defaultvalue(t, f));
+            }
+        }
+        while (pb_nextentry(&t->oneof_index, &oe))
+            pb_usename(((const pb_OneofEntry*)oe)->name);
+    }
+    while (pb_nextentry(&S->methods, &e))
+        pb_usename(((pb_MethodEntry*)e)->value.name);
+    for (i = 0; i < nt->size; ++i) {
+        pb_NameEntry **list = &nt->hash[i];
+        while (*list != NULL) {
+            pb_NameEntry *ne = *list;
+            if (ne->refcount != 0) { list = &ne->next; continue; }
+            *list = ne->next, --nt->count;
+            free(ne);
+        }
+    }
+    for (i = PB_MIN_STRTABLE_SIZE; i < nt->count; i <<= 1)
+        ;
+    if (i < nt->size) pbN_resize(S, i);
+}
+
+PB_API int pb_prune(pb_State *S, const pb_Type **roots, size_t count) {
+    pb_Table reach;
+    const pb_Entry *e = NULL;
+    int r;
+    if (S->frozen != NULL) return PB_ERROR;
+    pbC(pb_loadall(S)); /* roots may refer to types not built yet */
+    pb_inittable(&reach, sizeof(pb_Entry));
+    if ((r = pbP_reach(&reach, roots, count)) != PB_OK)
+        return pb_freetable(&reach), r;
+    while (pb_nextentry(&S->types, &e)) {
+        pb_TypeEntry *te = (pb_TypeEntry*)e;
+        if (te->value == NULL || pb_gettable(&reach, (pb_Key)te->value))
+            continue;
+        pb_deltype(S, te->value);
+        pb_poolfree(&S->typepool, te->value);
+        te->entry.dead = 1, te->value = NULL;
+    }
+    while (pb_nextentry(&S->methods, &e)) { /* names are freed below */
+        pb_MethodEntry *me = (pb_MethodEntry*)e;
+        if (me->value.name == NULL
+                || (pb_gettable(&reach, (pb_Key)me->value.input)
+                    && pb_gettable(&reach, (pb_Key)me->value.output)))
+            continue;
+        me->entry.dead = 1, me->value.name = NULL;
+    }
+    pb_freetable(&reach);
+    pbT_freefiles(S);
+    pbL_freelazy(S); /* every unit is built now */
+    pbP_compact(&S->types);
+    pbP_compact(&S->methods);
+    pbP_names(S);
+    return PB_OK;
+}
+
 
 PB_NS_END
 
@@ -458,7 +458,7 @@ function _G.test_default()
    table_eq(dt.array, {})
    table_eq(pb.decode "TestDefault", pb.decode("TestDefault", ""))
 
-   pb.option "use_default_values"
+   pb.option "auto_default_values"
    dt = pb.decode("TestDefault", "")
    eq(getmetatable(dt), nil)
    table_eq(dt, {
@@ -479,6 +479,13 @@ function _G.test_default()
    eq(dt.bool1, false)
    eq(dt.bool2, false)
    table_eq(dt.array, {})
+   table_eq(pb.decode("TestDefault", "\144\1\1\144\1\2").array, { 1, 2 })
+   table_eq(pb.decode("TestDefault", "").array, {})
+   pb.option "enum_as_name"
+   eq(pb.decode("TestDefault", "").color, "RED")
+   pb.clear("TestDefault", "color")
+   eq(pb.decode("TestDefault", "").color, nil)
+   pb.option "enum_as_value"
 
    pb.option "no_default_values"
    pb.option "encode_default_values"
@@ -508,6 +515,46 @@ function _G.test_default()
    end)
 end
 
+function _G.test_warmup()
+   withstate(function()
+   protoc.reload()
+   check_load [[
+      message Warm {
+         message Inner { optional sint32 x = 1 [default = -7]; }
+         optional int64  neg   = 1 [default = -5];
+         optional double num   = 2 [default = -1.5];
+         optional bool   flag  = 3 [default = true];
+         optional Inner  inner = 4;
+      }
+      message Cold { optional int32 x = 1; } ]]
+   assert(pb.load(pb.encode(".google.protobuf.FileDescriptorSet", {
+      file = { { name = "big.proto", message_type = { { name = "Big",
+         field = { { name = "big", number = 1, label = 1, type = 4,
+                     default_value = "18446744073709551615" } } } } } } })))
+   pb.option "int64_as_string"
+   eq(pb.warmup { "Warm" }, 2)
+   fail("type 'Nope' does not exists", function() pb.warmup { "Nope" } end)
+   fail("type name expected at index 1", function() pb.warmup { 1 } end)
+   assert(pb.warmup() >= 3)
+   local defs = pb.defaults "Warm"
+   eq(defs.neg, -5)
+   eq(defs.num, -1.5)
+   eq(defs.flag, true)
+   eq(pb.defaults "Warm.Inner".x, -7)
+   pb.option "use_default_metatable"
+   eq(getmetatable(pb.decode("Warm", "")), defs)
+   eq(pb.defaults "Big".big, "#18446744073709551615")
+   pb.freeze()
+   pb.defaults("Big", nil)
+   pb.defaults("Warm", nil)
+   eq(pb.defaults "Big".big, "#18446744073709551615")
+   eq(pb.defaults "Warm".num, -1.5)
+   eq(pb.warmup { "Warm", "Cold" }, 3)
+   pb.option "int64_as_number"
+   pb.option "no_default_values"
+   end)
+end
+
 function _G.test_enum()
    check_load [[
       enum Color {
@@ -566,6 +613,28 @@ function _G.test_enum()
    check_msg("TestAlias",
              { aliased_enumf = { "ZERO", "FIRST", "TWO", 23, "ONE" } },
              { aliased_enumf = { "ZERO", "FIRST", "TWO", 23, "FIRST" } })
+   eq(pb.decode("TestAlias", "\18\2\1\3").aliased_enumf, { "FIRST", 3 })
+
+   check_load [[
+      syntax = "proto3";
+      enum Level { DEBUG = 0; INFO = 1; FATAL = -1; }
+      message TestLevels { repeated Level levels = 1; } ]]
+   check_msg("TestLevels", { levels = { "INFO", "DEBUG", 7, "FATAL" } })
+   -- packed and unpacked values of one field
+   eq(pb.decode("TestLevels", "\10\2\1\0\8\7\10\1\1", { levels = { 1 } }),
+      { levels = { 1, "INFO", "DEBUG", 7, "INFO" } })
+   pb.option "enum_as_value"
+   eq(pb.decode("TestLevels", "\10\2\1\0").levels, { 1, 0 })
+   pb.option "enum_as_name"
+   pb.clear "TestLevels"
+   pb.clear "Level"
+   check_load [[
+      syntax = "proto3";
+      enum Level { TRACE = 0; INFO = 1; }
+      message TestLevels { repeated Level levels = 1; } ]]
+   eq(pb.decode("TestLevels", "\10\2\1\0").levels, { "INFO", "TRACE" })
+   pb.clear "TestLevels"
+   pb.clear "Level"
    assert(pb.type ".google.protobuf.FileDescriptorSet")
    check_load [[
    enum Common {
@@ -648,7 +717,7 @@ function _G.test_packed()
       {
           repeated MessageA messageValue = 1;
       } ]]
-   pb.option "use_default_values"
+   pb.option "auto_default_values"
    check_msg("MessageB", { messageValue = { { intValue = 0 } } })
    pb.option "no_default_values"
    check_msg("MessageB", { messageValue = { {} } })
@@ -676,6 +745,13 @@ function _G.test_packed()
    eq(pb.decode("Message3", bytes), t)
    bytes = pb.encode("Message3", t)
    eq(pb.decode("Message2", bytes), t)
+   -- packed and unpacked elements mixed with other fields
+   pb.option "auto_default_values"
+   bytes = "\8\1\10\2\2\3\24\9\8\4\10\1\5"
+   eq(pb.decode("Message3", bytes), t)
+   eq(pb.decode("Message2", bytes), t)
+   eq(pb.decode("Message3", bytes, { v1 = { 0 } }), { v1 = { 0,1,2,3,4,5 } })
+   eq(pb.decode("Message3", ""), { v1 = {} })
    pb.clear "Message2"
    pb.clear "Message3"
    pb.option "auto_default_values"
@@ -1086,6 +1162,366 @@ function _G.test_slice()
    assert(pb.type ".google.protobuf.FileDescriptorSet")
 end
 
+function _G.test_rope()
+   check_load [[
+      message RopeInner {
+         optional string name = 1;
+         repeated int32 ids = 2 [packed=true];
+      }
+      message Rope {
+         optional int64   i64 = 1;
+         optional fixed32 f32 = 2;
+         optional double  d   = 3;
+         optional string  s   = 4;
+         optional RopeInner inner = 5;
+         repeated RopeInner list = 6;
+      } ]]
+   local data = {
+      i64 = -1, f32 = 123456, d = 0.5, s = ("x"):rep(300),
+      inner = { name = "inner", ids = {1, 300, 70000} },
+      list = { { name = "a" }, { ids = {5} } },
+   }
+   local bin = pb.encode("Rope", data)
+   local r = pb.decode("Rope", bin)
+   eq(pb.decode("Rope", { bin }), r)
+   eq(pb.decode("Rope", {}), pb.decode("Rope", ""))
+   for n = 1, 17 do
+      local chunks = {}
+      for i = 1, #bin, n do
+         chunks[#chunks+1] = bin:sub(i, i+n-1)
+      end
+      eq(pb.decode("Rope", chunks), r)
+   end
+   local head, tail = bin:sub(1, 7), bin:sub(8)
+   eq(pb.decode("Rope", { buffer(head), "", slice(tail) }), r)
+   local t = {}
+   eq(pb.decode("Rope", { head, tail }, t), r)
+   eq(t, r)
+
+   local s = slice.new { head, buffer(tail) }
+   eq(#s, #bin)
+   eq(s:result(), bin)
+   eq(#s:reset { "\1", "\2\3" }, 3)
+
+   fail("string/buffer/slice expected at chunk #2, got boolean",
+      function() pb.decode("Rope", { head, true }) end)
+   eq(pcall(pb.decode, "Rope", bin:sub(1, -2)), false)
+   eq(pcall(pb.decode, "Rope", { bin:sub(1, 9), bin:sub(10, -2) }), false)
+
+   -- messages that straddle chunks are read from the chunks
+   check_load [[
+      message RopeTree {
+         optional string name = 1;
+         optional RopeTree child = 2;
+         repeated RopeTree kids = 3;
+         oneof v { RopeTree on = 4; int32 n = 5; }
+      } ]]
+   local tree = {
+      name = "root", child = { name = "c", child = { name = ("d"):rep(100) } },
+      kids = { { name = "k1" }, { kids = { { name = "k2" }, { n = 2 } } } },
+      on = { child = { n = 1 } },
+   }
+   bin = pb.encode("RopeTree", tree) .. pb.encode("RopeTree", { child = { n = 3 } })
+   r = pb.decode("RopeTree", bin)
+   eq(r.child, { n = 3, v = "n" })
+   for n = 1, 9 do
+      local chunks = {}
+      for i = 1, #bin, n do
+         chunks[#chunks+1] = bin:sub(i, i+n-1)
+      end
+      eq(pb.decode("RopeTree", chunks), r)
+   end
+   -- past the end of the rope, or of the message it is in
+   fail("unfinished bytes", function() pb.decode("RopeTree", { "\18\4\10", "\1" }) end)
+   fail("invalid bytes length", function()
+      pb.decode("RopeTree", { "\18\4\18", "\9\10\1x" })
+   end)
+end
+
+function _G.test_two_pass()
+   check_load [[
+      message TwoPassInner {
+         optional string name = 1;
+         repeated int32 ids = 2 [packed=true];
+      }
+      message TwoPass {
+         optional int32 id = 1;
+         repeated TwoPassInner list = 2;
+         map<string, TwoPassInner> dict = 3;
+         repeated string tags = 4;
+         oneof v { int32 a = 5; string b = 6; }
+      } ]]
+   local data = {
+      id = 1, b = "b", tags = { "x", "y" },
+      list = { { name = "a", ids = { 1, 2 } }, { ids = {} } },
+      dict = { k = { name = "v", ids = { 3 } } },
+   }
+   local bin = pb.encode("TwoPass", data)
+   local r = pb.decode("TwoPass", bin)
+   pb.option "decode_two_pass"
+   eq(pb.decode("TwoPass", bin), r)
+   eq(pb.decode("TwoPass", bin .. pb.encode("TwoPass", { tags = { "z" } })).tags,
+      { "x", "y", "z" })
+   local t = { tags = { "w" } }
+   eq(pb.decode("TwoPass", bin, t), t)
+   eq(t.tags, { "w", "x", "y" })
+
+   -- invalid data is found before any table is touched
+   t = {}
+   fail("invalid varint value at offset",
+      function() pb.decode("TwoPass", bin .. "\8", t) end)
+   eq(t, {})
+   fail("type mismatch for field 'id'",
+      function() pb.decode("TwoPass", "\13\0\0\0\0") end)
+
+   pb.option "enable_hooks"
+   pb.hook("TwoPassInner", function(v)
+      v.outer = pb.decode("TwoPass", pb.encode("TwoPass", { tags = { v.name } }))
+      return v
+   end)
+   eq(pb.decode("TwoPass", bin).list[1].outer, { tags = { "a" } })
+   pb.hook("TwoPassInner", nil)
+   pb.option "disable_hooks"
+   pb.option "no_decode_two_pass"
+end
+
+function _G.test_recycle()
+   check_load [[
+      message RecycleInner {
+         optional string name = 1;
+         repeated int32 ids = 2;
+      }
+      message Recycle {
+         optional int32 id = 1;
+         optional RecycleInner one = 2;
+         repeated RecycleInner list = 3;
+         map<string, RecycleInner> dict = 4;
+         oneof v { int32 a = 5; RecycleInner b = 6; }
+      } ]]
+   local bin = pb.encode("Recycle", {
+      id = 1, one = { name = "x", ids = { 1, 2, 3 } }, a = 1,
+      list = { { name = "a" }, { name = "b" }, { name = "c" } },
+      dict = { k = { name = "v" } },
+   })
+   local small = pb.encode("Recycle", {
+      one = { ids = { 4 } }, list = { { name = "d" } }, b = { name = "e" } })
+   local want = pb.decode("Recycle", small)
+   pb.option "decode_recycle"
+   local t = pb.decode("Recycle", bin)
+   local one, list, first, second = t.one, t.list, t.list[1], t.list[2]
+   t.extra = true
+   eq(pb.decode("Recycle", small, t), t)
+   eq(t, want)
+   eq(t.one, one)
+   eq(t.list, list)
+   eq(t.list[1], first)
+   -- dropped messages are reused by later decodes of their type
+   local r = pb.decode("Recycle", small)
+   assert(r.one == second or r.list[1] == second or r.b == second)
+   eq(pb.decode("Recycle", bin, t), t)
+   eq(t.one, one)
+   pb.option "no_decode_recycle"
+   eq(t, pb.decode("Recycle", bin))
+   eq(pb.decode("Recycle", small, t).list[4].name, "d")
+
+   -- pooled tables go with their types
+   withstate(function()
+      local schema = "message RecyclePool { optional RecyclePool next = 1; }"
+      local data
+      for _, drop in ipairs { pb.clear, function() pb.prune {} end } do
+         protoc.reload()
+         check_load(schema)
+         local A, B = {}, {}
+         pb.bind("RecyclePool", A)
+         pb.option "decode_recycle"
+         data = pb.encode("RecyclePool", { next = { next = {} } })
+         local old = pb.decode("RecyclePool", data)
+         pb.decode("RecyclePool", "", old) -- old.next goes to the pool
+         drop()
+         protoc.reload()
+         check_load(schema)
+         pb.bind("RecyclePool", B)
+         eq(getmetatable(pb.decode("RecyclePool", data).next), B)
+         pb.clear()
+      end
+   end)
+end
+
+function _G.test_decode_batch()
+   check_load [[
+      message BatchInner { optional string name = 1; }
+      message Batch {
+         optional int32 id = 1;
+         repeated BatchInner list = 2;
+         map<string, int32> dict = 3;
+      } ]]
+   local list, expected = {}, {}
+   for i = 1, 100 do
+      local data = { id = i, list = { { name = "n" .. i } }, dict = { k = i } }
+      list[i] = pb.encode("Batch", data)
+      expected[i] = pb.decode("Batch", list[i])
+   end
+   list[50] = slice.new(list[50])
+   eq(pb.decode_batch("Batch", list), expected)
+   eq(pb.decode_batch("Batch", list, 1), expected)
+   eq(pb.decode_batch("Batch", list, 3), expected)
+   eq(pb.decode_batch("Batch", {}), {})
+
+   list[70] = list[70] .. "\8"
+   fail("invalid varint value at offset 18 in message #70",
+      function() pb.decode_batch("Batch", list) end)
+   fail("string/buffer/slice expected at #2, got boolean",
+      function() pb.decode_batch("Batch", { "", true }) end)
+   fail("type 'Nope' does not exists",
+      function() pb.decode_batch("Nope", {}) end)
+
+   -- parsing without the Lua stack limits the nesting
+   check_load [[ message BatchDeep { optional BatchDeep next = 1; } ]]
+   local function deep(n)
+      local s = ""
+      for _ = 1, n do s = "\10" .. buffer.pack("v", #s) .. s end
+      return s
+   end
+   eq(#pb.decode_batch("BatchDeep", { deep(99), deep(99) }, 2), 2)
+   fail("message nested too deeply at offset 237 in message #2",
+      function() pb.decode_batch("BatchDeep", { deep(99), deep(100) }, 2) end)
+   pb.option "decode_two_pass"
+   fail("message nested too deeply",
+      function() pb.decode("BatchDeep", deep(100)) end)
+   pb.option "no_decode_two_pass"
+   assert(pb.decode("BatchDeep", deep(100)).next)
+end
+
+function _G.test_message()
+   check_load [[
+      syntax = "proto3";
+      message MsgInner { string name = 1; }
+      message Msg {
+         int32 id = 1;
+         string name = 2;
+         MsgInner inner = 3;
+         repeated int32 list = 4;
+         map<string, int32> dict = 5;
+         repeated MsgInner items = 6;
+         oneof v { int32 a = 7; string b = 8; }
+      } ]]
+   local data = {
+      id = 42, name = "foo", inner = { name = "bar" },
+      list = { 1, 2, 3 }, dict = { x = 1, y = 2 },
+      items = { { name = "a" }, { name = "b" } }, b = "b",
+   }
+   local m = pb.parse("Msg", pb.encode("Msg", data))
+   assert(tostring(m):match "^pb.Message%(.Msg%)")
+   eq(m.id, 42)
+   eq(m.name, "foo")
+   eq(m.inner.name, "bar")
+   eq(m.list, { 1, 2, 3 })
+   eq(m.dict, { x = 1, y = 2 })
+   eq(m.items[2], { name = "b" })
+   eq(m.b, "b")
+   eq(m.a, 0)
+   eq(m.v, "b")
+   eq(m.no_such_field, nil)
+   eq(pb.decode("Msg", m:encode()), pb.decode("Msg", pb.encode("Msg", data)))
+   eq(m:totable(), pb.decode("Msg", pb.encode("Msg", data)))
+
+   m.id = 7
+   m.a = 1
+   eq(m.v, "a")
+   eq(m.b, "")
+   m.list = { 4, 5 }
+   m.name = nil
+   eq(m.name, "")
+   local inner = m.inner
+   inner.name = "baz"
+   eq(m.inner.name, "bar")
+   m.inner = inner
+   eq(m.inner.name, "baz")
+   local t = pb.decode("Msg", m:encode())
+   eq(t.id, 7)
+   eq(t.a, 1)
+   eq(t.b, nil)
+   eq(t.list, { 4, 5 })
+   eq(t.inner, { name = "baz" })
+
+   local b = buffer.new()
+   eq(m:encode(b), b)
+   eq(b:result(), m:encode())
+   eq(pb.encode("Msg", { inner = inner }), pb.encode("Msg", { inner = { name = "baz" } }))
+
+   local n = pb.new("Msg")
+   eq(n:encode(), "")
+   eq(n.id, 0)
+   eq(n.inner, nil)
+   eq(n.list, {})
+   n = pb.new("Msg", { id = 1, items = { { name = "x" } } })
+   eq(n:totable().items, { { name = "x" } })
+   n.items = { inner, { name = "y" } }
+   eq(n.items, { { name = "baz" }, { name = "y" } })
+
+   -- unknown fields are kept, repeated occurrences are merged
+   local raw = pb.encode("Msg", { id = 1 }) .. pb.pack("MsgInner", "x"):gsub("^\10", "\130\1")
+   eq(pb.parse("Msg", raw):encode(), raw)
+   eq(pb.parse("Msg", pb.encode("Msg", { list = {1} }) ..
+      pb.encode("Msg", { id = 3, list = {2} })).list, { 1, 2 })
+
+   -- a message field given twice keeps only its last occurrence, in all
+   -- the decoders, pb.parse() and pb.get() alike
+   local twice = pb.encode("Msg", { id = 1, inner = { name = "x" } }) .. "\26\0"
+   local want = pb.decode("Msg", twice)
+   eq(want.inner, pb.decode("MsgInner", ""))
+   eq(pb.decode("Msg", { twice:sub(1, 4), twice:sub(5) }), want)
+   pb.option "decode_two_pass"
+   eq(pb.decode("Msg", twice), want)
+   pb.option "no_decode_two_pass"
+   pb.option "decode_recycle"
+   eq(pb.decode("Msg", twice, pb.decode("Msg", pb.encode("Msg", data))), want)
+   pb.option "no_decode_recycle"
+   local tm = pb.parse("Msg", twice)
+   eq(tm.inner.name, "")
+   eq(tm.inner:totable(), want.inner)
+   eq(tm:totable(), want)
+   eq(pb.get("Msg", twice, "inner"), want.inner)
+   eq(pb.get("Msg", twice, "inner.name"), nil) -- not in the data
+
+   fail("field 'foo' does not exist in type '.Msg'", function() m.foo = 1 end)
+   fail("expected for field 'id', got string", function() m.id = "x" end)
+   fail("message '.MsgInner' expected for field 'inner', got '.Msg'",
+      function() m.inner = m end)
+   fail("type 'NoSuchType' does not exists", function() pb.new "NoSuchType" end)
+   fail("invalid field at offset 3", function() pb.parse("Msg", "\8\1\8") end)
+   fail("invalid varint value at offset 1", function() pb.parse("Msg", "\255") end)
+
+   -- fields shadow the methods, which the metatable still has
+   check_load [[
+      syntax = "proto3";
+      message MsgShadow { string encode = 1; } ]]
+   local sh = pb.new("MsgShadow", { encode = "e" })
+   eq(sh.encode, "e")
+   eq(getmetatable(sh).encode(sh), pb.encode("MsgShadow", { encode = "e" }))
+
+   -- objects of freed types raise errors instead of reading them
+   withstate(function()
+      protoc.reload()
+      check_load "message MsgStale { optional MsgStale sub = 1; }"
+      local old = pb.new("MsgStale", { sub = {} })
+      local sub = old.sub
+      eq(old:encode(), "\10\0")
+      pb.clear()
+      protoc.reload()
+      check_load "message MsgStale { optional MsgStale sub = 1; }"
+      fail("pb.Message is stale", function() return old.sub end)
+      fail("pb.Message is stale", function() return sub:totable() end)
+      fail("pb.Message is stale", function() old.sub = nil end)
+      fail("pb.Message is stale", function() return tostring(old) end)
+      fail("message for field 'sub' is stale",
+         function() pb.encode("MsgStale", { sub = sub }) end)
+      local m = pb.new "MsgStale"
+      pb.prune { "MsgStale" }
+      fail("pb.Message is stale", function() m:encode() end)
+   end)
+end
+
 function _G.test_typefmt()
    -- load schema from text
    assert(protoc:load [[
@@ -1367,6 +1803,435 @@ function _G.test_hook()
    end)
 end
 
+function _G.test_batch_hook()
+   withstate(function()
+   protoc.reload()
+   check_load [[
+      enum Type { HOME = 1; WORK = 2; }
+      message Phone {
+         optional string name = 1;
+         optional Type   type = 2;
+      }
+      message Person {
+         optional Phone  main     = 1;
+         repeated Phone  contacts = 2;
+         repeated Type   types    = 3;
+      } ]]
+   fail("function expected, got boolean",
+        function() pb.batch_hook("Phone", true) end)
+   fail("type not found",
+      function() pb.batch_hook "-invalid-type-" end)
+   local calls = {}
+   local function batch(list, first)
+      calls[#calls+1] = ("%d+%d"):format(first, #list - first + 1)
+      for i = first, #list do
+         if type(list[i]) == "table" then list[i].batched = true end
+      end
+   end
+   eq(pb.batch_hook("Phone", batch), nil)
+   eq(pb.batch_hook "Phone", batch)
+   local bin = pb.encode("Person", {
+      main = { name = "m" },
+      contacts = { { name = "a" }, { name = "b" }, { name = "c" } },
+      types = { "HOME", "WORK" } })
+
+   -- hooks are disabled by default
+   eq(pb.decode("Person", bin).contacts[1].batched, nil)
+   eq(#calls, 0)
+
+   -- once per array, single messages go to pb.hook only
+   pb.option "enable_hooks"
+   local res = pb.decode("Person", bin)
+   eq(calls, { "1+3" })
+   eq(res.contacts[3].batched, true)
+   eq(res.main.batched, nil)
+   local hooked = 0
+   pb.hook("Phone", function(t) hooked = hooked + 1 end)
+   calls = {}
+   res = pb.decode("Person", bin, { contacts = { { name = "old" } } })
+   eq(calls, { "2+3" })
+   eq(hooked, 4)
+   eq(res.contacts[1].batched, nil)
+   eq(res.contacts[2].batched, true)
+   pb.hook("Phone", nil)
+
+   -- arrays of enums, decoded in two passes or from pb.parse
+   pb.batch_hook("Type", batch)
+   calls = {}
+   pb.option "decode_two_pass"
+   pb.decode("Person", bin)
+   pb.option "no_decode_two_pass"
+   table.sort(calls) -- fields are encoded in pairs() order
+   eq(calls, { "1+2", "1+3" })
+   calls = {}
+   local m = pb.parse("Person", bin)
+   eq(m.types, { "HOME", "WORK" })
+   eq(m.contacts[1].batched, true)
+   eq(calls, { "1+2", "1+3" })
+
+   -- removed hooks are not called anymore
+   eq(pb.batch_hook("Phone", nil), batch)
+   eq(pb.batch_hook("Type", nil), batch)
+   calls = {}
+   pb.decode("Person", bin)
+   eq(#calls, 0)
+   pb.option "disable_hooks"
+   end)
+end
+
+function _G.test_bind()
+   withstate(function()
+   protoc.reload()
+   check_load [[
+      enum Type { HOME = 1; WORK = 2; }
+      message Phone {
+         optional string name = 1;
+         optional Type   type = 2;
+      }
+      message Person {
+         optional Phone  main     = 1;
+         repeated Phone  contacts = 2;
+         repeated string tags     = 3;
+      } ]]
+   fail("table expected, got boolean",
+        function() pb.bind("Phone", true) end)
+   fail("type not found", function() pb.bind "-invalid-type-" end)
+   fail("message type expected", function() pb.bind("Type", {}) end)
+   fail("invalid size", function() pb.bind("Phone", {}, -2) end)
+   local Phone = {}
+   Phone.__index = Phone
+   function Phone:label() return self.name .. "/" .. self.type end
+   local Person = { __index = { tags = "not an array" } }
+   eq(pb.bind("Phone", Phone), nil)
+   eq(pb.bind("Person", Person, 8), nil)
+   eq({ pb.bind "Person" }, { Person, 8 })
+   local msg = {
+      main = { name = "m", type = "HOME" },
+      contacts = { { name = "a", type = "WORK" }, { name = "b" } },
+      tags = { "x", "y" } }
+   local bin = pb.encode("Person", msg)
+
+   -- all decoders make objects of the bound metatables
+   local function check(res)
+      eq(getmetatable(res), Person)
+      eq(getmetatable(res.main), Phone)
+      eq(res.main:label(), "m/HOME")
+      eq(res.contacts[1]:label(), "a/WORK")
+      eq(getmetatable(res.contacts[2]), Phone)
+      eq(rawget(res, "tags"), { "x", "y" })
+   end
+   check(pb.decode("Person", bin))
+   pb.option "decode_two_pass"
+   check(pb.decode("Person", bin))
+   pb.option "no_decode_two_pass"
+   pb.option "decode_recycle"
+   local state = {}
+   check(pb.decode("Person", bin, state))
+   check(state)
+   eq(pb.decode("Person", bin, state), state)
+   pb.option "no_decode_recycle"
+   pb.option "use_default_metatable"
+   check(pb.decode("Person", bin))
+   pb.option "auto_default_values"
+
+   -- objects encode their own fields, not what their metatable adds
+   local res = pb.decode("Person", bin)
+   eq(pb.decode("Person", pb.encode("Person", res)).main:label(), "m/HOME")
+   pb.option "encode_order"
+   eq(pb.encode("Person", res), pb.encode("Person", msg))
+   eq(pb.encode("Person", setmetatable({}, Person)), "")
+   pb.option "no_encode_order"
+
+   -- tables that a class shares by its __index are never filled
+   check_load [[
+      syntax = "proto3";
+      message Group { repeated string tags = 1; map<string, int32> ids = 2; } ]]
+   local Group = { tags = {}, ids = {} }
+   Group.__index = Group
+   pb.bind("Group", Group)
+   local gbin = pb.encode("Group", { tags = { "a", "b" }, ids = { x = 1 } })
+   local function gcheck(res)
+      eq(rawget(res, "tags"), { "a", "b" })
+      eq(rawget(res, "ids"), { x = 1 })
+      eq(Group.tags, {})
+      eq(Group.ids, {})
+   end
+   gcheck(pb.decode("Group", gbin))
+   eq(rawget(pb.decode("Group", ""), "tags"), {})
+   pb.option "decode_two_pass"
+   gcheck(pb.decode("Group", gbin))
+   pb.option "no_decode_two_pass"
+   pb.option "decode_recycle"
+   gcheck(pb.decode("Group", gbin, setmetatable({}, Group)))
+   pb.option "no_decode_recycle"
+   gcheck(pb.decode("Group", { gbin:sub(1, 4), gbin:sub(5) }))
+
+   -- bindings follow frozen schemas and are removed by nil
+   pb.freeze()
+   eq(getmetatable(pb.decode("Person", bin).main), Phone)
+   eq({ pb.bind("Phone", nil) }, { Phone })
+   eq(getmetatable(pb.decode("Person", bin).main), nil)
+   eq(getmetatable(pb.decode("Person", bin)), Person)
+   end)
+end
+
+function _G.test_encode_getters()
+   withstate(function()
+   protoc.reload()
+   check_load [[
+      message Phone {
+         optional string name = 1;
+         optional int32  kind = 2 [default = 3];
+      }
+      message Person {
+         optional string name     = 1;
+         optional Phone  main     = 2;
+         repeated Phone  contacts = 3;
+      } ]]
+   local function proxy(fields)
+      return setmetatable({}, { __index = function(_, k) return fields[k] end })
+   end
+   local msg = { name = "p", main = { name = "m" },
+                 contacts = { { name = "a" }, { name = "b", kind = 1 } } }
+   local obj = proxy { name = "p", main = proxy { name = "m" },
+                       contacts = { proxy { name = "a" }, proxy { name = "b", kind = 1 } } }
+   pb.option "encode_order"
+   local bin = pb.encode("Person", msg)
+   pb.option "no_encode_order"
+
+   -- proxies are empty tables without the option
+   eq(pb.encode("Person", obj), "")
+   fail("table expected", function() pb.encode("Person", io.stdout) end)
+
+   -- fields of objects are read through __index, in field order
+   pb.option "encode_getters"
+   eq(pb.encode("Person", obj), bin)
+   eq(pb.decode("Person", pb.encode("Person", msg)), pb.decode("Person", bin))
+   if newproxy then
+      local u = newproxy(true)
+      getmetatable(u).__index = { name = "u", main = obj.main }
+      eq(pb.decode("Person", pb.encode("Person", u)),
+         { name = "u", main = { name = "m" } })
+      eq(pb.decode("Person", pb.encode("Person", { main = u })).main.name, "u")
+   end
+
+   -- but not for default metatables, nor for bound types
+   pb.option "use_default_metatable"
+   local res = pb.decode("Person", pb.encode("Person", { main = { name = "m" } }))
+   eq(res.main.kind, 3)
+   eq(pb.encode("Phone", res.main), pb.encode("Phone", { name = "m" }))
+   pb.option "auto_default_values"
+   local Phone = { __index = { kind = 9 } }
+   pb.bind("Phone", Phone)
+   eq(pb.encode("Phone", setmetatable({ name = "b" }, Phone)),
+      pb.encode("Phone", { name = "b" }))
+   pb.option "no_encode_getters"
+   end)
+end
+
+function _G.test_get()
+   withstate(function()
+   protoc.reload()
+   check_load [[
+      enum Kind { ROUTE = 1; DROP = 2; }
+      message Header {
+         optional string trace_id = 1;
+         optional Kind   kind     = 2;
+         repeated int32  hops     = 3 [packed = true];
+         map<string, string> tags = 4;
+      }
+      message Envelope {
+         optional Header header  = 1;
+         optional bytes  payload = 2;
+         repeated Header history = 3;
+      } ]]
+   local bin = pb.encode("Envelope", {
+      payload = ("x"):rep(1000),
+      header = { trace_id = "t1", kind = "DROP", hops = { 1, 2, 3 },
+                 tags = { a = "1" } },
+      history = { { trace_id = "old" } } })
+   fail("string or table expected", function() pb.get("Envelope", bin) end)
+   fail("type 'Nope' does not exists", function() pb.get("Nope", bin, "a") end)
+   fail("field 'nope' does not exists in '.Header'",
+        function() pb.get("Envelope", bin, "header.nope") end)
+   fail("field 'history' is not a single message",
+        function() pb.get("Envelope", bin, "history.trace_id") end)
+   fail("field 'payload' is not a single message",
+        function() pb.get("Envelope", bin, { 2, 1 }) end)
+   fail("empty path", function() pb.get("Envelope", bin, {}) end)
+
+   -- by names or numbers, the same as decoding everything
+   eq(pb.get("Envelope", bin, "header.trace_id"), "t1")
+   eq(pb.get("Envelope", bin, "header.trace_id"), "t1") -- cached
+   eq(pb.get("Envelope", bin, { 1, 1 }), "t1")
+   eq(pb.get("Envelope", bin, { "header", 2 }), "DROP")
+   eq(pb.get("Envelope", bin, "header.hops"), { 1, 2, 3 })
+   eq(pb.get("Envelope", bin, "header.tags"), { a = "1" })
+   eq(pb.get("Envelope", bin, "header"), pb.decode("Envelope", bin).header)
+   eq(pb.get("Envelope", bin, "history")[1].trace_id, "old")
+   eq(#pb.get("Envelope", bin, "payload"), 1000)
+
+   -- missing fields, and only the last of messages given in parts, as
+   -- pb.decode() replaces them
+   eq(pb.get("Envelope", "", "header.trace_id"), nil)
+   eq(pb.get("Envelope", "", "header.hops"), {})
+   local parts = pb.encode("Envelope", { header = { trace_id = "a", hops = { 1 } } })
+              .. pb.encode("Envelope", { header = { hops = { 2 } } })
+   eq(pb.get("Envelope", parts, "header.trace_id"), nil)
+   eq(pb.get("Envelope", parts, "header.trace_id"),
+      pb.decode("Envelope", parts).header.trace_id)
+   eq(pb.get("Envelope", parts, "header.hops"), { 2 })
+   parts = parts .. pb.encode("Envelope", { header = { trace_id = "b" },
+                                            history = { {}, {} } })
+   eq(pb.get("Envelope", parts, "header.trace_id"), "b")
+   eq(pb.get("Envelope", parts, "header.hops"), {})
+   eq(#pb.get("Envelope", bin .. parts, "history"), 3)
+   fail("type mismatch", function() pb.get("Envelope", "\8\1", "header.trace_id") end)
+
+   -- cached paths are dropped with the types
+   check_load [[
+      message Envelope { optional string header = 1; } ]]
+   fail("field 'header' is not a single message",
+        function() pb.get("Envelope", bin, "header.trace_id") end)
+   eq(pb.get("Envelope", pb.encode("Envelope", { header = "h" }), "header"), "h")
+   end)
+end
+
+function _G.test_wellknown()
+   withstate(function()
+   protoc.reload()
+   check_load [[
+      syntax = "proto3";
+      package google.protobuf;
+      message Timestamp { int64 seconds = 1; int32 nanos = 2; }
+      message Duration { int64 seconds = 1; int32 nanos = 2; }
+      message Int64Value { int64 value = 1; }
+      message StringValue { string value = 1; }
+      message BoolValue { bool value = 1; }
+      message DoubleValue { double value = 1; }
+      enum NullValue { NULL_VALUE = 0; }
+      message Struct { map<string, Value> fields = 1; }
+      message ListValue { repeated Value values = 1; }
+      message Value {
+         oneof kind {
+            NullValue null_value = 1; double number_value = 2;
+            string string_value = 3; bool bool_value = 4;
+            Struct struct_value = 5; ListValue list_value = 6;
+         }
+      }
+      message Event {
+         Timestamp at = 1; Duration took = 2; Int64Value count = 3;
+         StringValue note = 4; BoolValue ok = 5; Struct attrs = 6;
+         repeated Timestamp history = 7; map<string, DoubleValue> scores = 8;
+         Value any = 9; ListValue list = 10;
+      } ]]
+   local T = "google.protobuf.Event"
+   fail("'google.protobuf.Any' is not a converted well-known type",
+        function() pb.wellknown "google.protobuf.Any" end)
+   fail("invalid mode 'value' for 'google.protobuf.Timestamp'",
+        function() pb.wellknown("google.protobuf.Timestamp", "value") end)
+   fail("invalid mode 'number' for '.google.protobuf.Struct'",
+        function() pb.wellknown(".google.protobuf.Struct", "number") end)
+   eq(pb.decode(T, pb.encode(T, { at = { seconds = 1 } })).at, { seconds = 1, nanos = 0 })
+
+   eq(pb.wellknown("google.protobuf.Timestamp", "number"), nil)
+   eq(pb.wellknown "google.protobuf.Timestamp", "number")
+   pb.wellknown("google.protobuf.Duration", "string")
+   for _, name in ipairs { "Int64Value", "StringValue", "BoolValue",
+                           "DoubleValue", "Struct", "Value", "ListValue" } do
+      pb.wellknown("google.protobuf."..name, "value")
+   end
+   local data = {
+      at = 1.5, took = "-1.5s", count = 0, note = "n", ok = false,
+      attrs = { a = 1, b = { true, "x", pb.null }, c = {} },
+      history = { 0, "1970-01-01T00:00:01.5Z", { seconds = 2 } },
+      scores = { x = 2.5 }, any = "s", list = { 1, { y = false } },
+   }
+   local bin = pb.encode(T, data)
+   data.history, data.took = { 0, 1.5, 2 }, "-1.500s"
+   eq(pb.decode(T, bin), data)
+   pb.option "decode_two_pass"
+   eq(pb.decode(T, bin), data)
+   pb.option "no_decode_two_pass"
+   pb.option "decode_recycle"
+   local old = pb.decode(T, bin)
+   eq(pb.decode(T, bin, old), data)
+   pb.option "no_decode_recycle"
+   local m = pb.parse(T, bin)
+   eq(m.at, 1.5)
+   eq(m.attrs, data.attrs)
+   eq(m.history, data.history)
+   -- a converted field given twice keeps its last occurrence, like any
+   -- message field
+   local split = pb.encode(T, { at = { seconds = 1 }, note = "a" })
+              .. pb.encode(T, { at = { nanos = 500000000 }, ok = true })
+   local want = { at = 0.5, note = "a", ok = true, history = {}, scores = {} }
+   eq(pb.decode(T, split), want)
+   eq(pb.decode(T, { split:sub(1, 3), split:sub(4) }), want)
+   pb.option "decode_two_pass"
+   eq(pb.decode(T, split), want)
+   pb.option "no_decode_two_pass"
+   pb.option "decode_recycle"
+   eq(pb.decode(T, split, pb.decode(T, bin)), want)
+   pb.option "no_decode_recycle"
+   eq(pb.parse(T, split).at, 0.5)
+   eq(pb.get(T, split, "at"), 0.5)
+   pb.option "decode_default_message"
+   local dm = pb.decode(T, "")
+   eq(dm.at, 0)
+   eq(dm.took, "0s")
+   eq(dm.count, 0)
+   eq(dm.attrs, {})
+   pb.option "no_decode_default_message"
+   -- wrappers are there even with zero values, unset ones are not
+   eq(pb.decode(T, pb.encode(T, { note = "" })),
+      { note = "", history = {}, scores = {} })
+   fail("can not encode function as google.protobuf.Value",
+        function() pb.encode(T, { any = print }) end)
+   fail("string key expected for google.protobuf.Struct, got number",
+        function() pb.encode(T, { attrs = { [1.5] = 1 } }) end)
+   fail("number/string expected for field 'at', got boolean",
+        function() pb.encode(T, { at = true }) end)
+   fail("invalid Duration '1.5' for field 'took'",
+        function() pb.encode(T, { took = "1.5" }) end)
+
+   -- timestamps as RFC 3339 strings
+   pb.wellknown("google.protobuf.Timestamp", "string")
+   local function ts(v) return pb.decode(T, pb.encode(T, { at = v })).at end
+   eq(ts(0), "1970-01-01T00:00:00Z")
+   eq(ts(-1.25), "1969-12-31T23:59:58.750Z")
+   eq(ts(951782400), "2000-02-29T00:00:00Z")
+   eq(ts "2024-02-29T12:34:56.000001Z", "2024-02-29T12:34:56.000001Z")
+   eq(ts "2024-03-01t07:30:00.5+08:00", "2024-02-29T23:30:00.500Z")
+   eq(ts "0001-01-01T00:00:00Z", "0001-01-01T00:00:00Z")
+   eq(ts "9999-12-31T23:59:59.999999999Z", "9999-12-31T23:59:59.999999999Z")
+   for _, bad in ipairs { "2023-02-29T00:00:00Z", "2024-01-01T00:00:00",
+         "2024-01-01T24:00:00Z", "2024-1-01T00:00:00Z", "0001-01-01T00:00:00+00:01",
+         "2024-01-01T00:00:00.Z", "2024-01-01T00:00:00.1234567890Z" } do
+      fail("invalid Timestamp '"..bad.."'", function() ts(bad) end)
+   end
+   fail("timestamp out of range", function()
+      pb.decode(T, pb.encode(T, { at = { seconds = -62135596801 } }))
+   end)
+   eq(ts { seconds = 1, nanos = 5 }, "1970-01-01T00:00:01.000000005Z")
+
+   -- durations as numbers
+   pb.wellknown("google.protobuf.Duration", "number")
+   local function du(v) return pb.decode(T, pb.encode(T, { took = v })).took end
+   eq(du "-0.5s", -0.5)
+   eq(du "3s", 3)
+   eq(du(-1.25), -1.25)
+   pb.wellknown("google.protobuf.Duration", "string")
+   eq(du(-1.25), "-1.250s")
+   eq(du(-0.5), "-0.500s")
+   eq(du(0), "0s")
+
+   -- turned off, the messages are tables again
+   pb.wellknown("google.protobuf.Timestamp", nil)
+   eq(pb.decode(T, bin).at, { seconds = 1, nanos = 500000000 })
+   end)
+end
+
 function _G.test_encode_hook()
    withstate(function()
    protoc.reload()
@@ -1465,10 +2330,637 @@ function _G.test_unsafe()
    eq(len, 0)
    table_eq(unsafe.decode("TestType", s, len), {})
    table_eq(pb.decode("TestType", unsafe.slice(s, len)), {})
-   table_eq({unsafe.load(s, len)}, {true , 1})
+   table_eq({unsafe.load(s, len)}, {true , 1, {}})
    pb.clear "TestType"
-   eq((unsafe.use "global"), true)
-   eq((unsafe.use "local"), true)
+   -- use "global" and use "local" are attach() and detach()
+   withstate(function()
+      protoc.reload()
+      check_load "message UseType { optional int32 a = 1; }"
+      unsafe.publish()
+      local owner = pb.state(nil)
+      eq((unsafe.use "global"), true)
+      eq(pb.decode("UseType", "\8\1"), { a = 1 })
+      fail("state is attached to a shared schema", function() pb.load "" end)
+      owner = nil
+      collectgarbage()
+      eq(pb.decode("UseType", "\8\1"), { a = 1 })
+      eq((unsafe.use "local"), true)
+      eq((unsafe.use "local"), false)
+      eq(pb.type "UseType", nil)
+   end)
+end
+
+function _G.test_shared()
+   local unsafe = require "pb.unsafe"
+   local data = { name = "ilse", age = 18 }
+   local bin
+   withstate(function()
+      protoc.reload()
+      check_load [[
+         message SharedPerson {
+            optional string name = 1;
+            optional int32  age  = 2;
+         } ]]
+      bin = pb.encode("SharedPerson", data)
+      unsafe.publish()
+      eq(pb.decode("SharedPerson", bin), data)
+      fail("state is attached to a shared schema",
+         function() pb.load "" end)
+      fail("state is attached to a shared schema", function() pb.clear() end)
+      fail("state is attached to a shared schema", unsafe.publish)
+      local owner = pb.state(nil)
+      eq(pb.type "SharedPerson", nil)
+      eq(unsafe.attach(), true)
+      eq(pb.decode("SharedPerson", bin), data)
+      eq(pb.encode("SharedPerson", data), bin)
+      -- the first state goes away, the attached one keeps the types alive
+      owner = nil
+      collectgarbage()
+      eq(pb.decode("SharedPerson", bin), data)
+      eq(unsafe.detach(), true)
+      eq(unsafe.detach(), false)
+      eq(pb.type "SharedPerson", nil)
+      -- freed with the last user, nothing to attach to any more
+      collectgarbage()
+      eq(unsafe.attach(), false)
+   end)
+end
+
+function _G.test_reload()
+   withstate(function()
+      protoc.reload()
+      check_load [[
+         message Ver { optional int32 a = 1; }
+         message VerList { repeated Ver list = 1; } ]]
+      local p = protoc.new()
+      local v2 = p:compile [[
+         message Ver {
+            optional int32  a = 1;
+            optional string b = 2 [default = "x"];
+         }
+         message VerList { repeated Ver list = 1; } ]]
+      p = protoc.new()
+      p.unknown_type = true
+      local broken = p:compile "message Ver { optional Missing m = 1; }"
+      local hook = function(t) t.hooked = true return t end
+      pb.hook("Ver", hook)
+      local defs = pb.defaults "Ver"
+      local msg = pb.parse("VerList", "\10\2\8\1")
+      eq(pb.reload(v2), true)
+      -- the loaded types are freed, new calls see the new version
+      fail("pb.Message is stale", function() return msg.list end)
+      msg = pb.parse("VerList", "\10\2\8\1")
+      eq(pb.field("Ver", "b"), "b")
+      eq(pb.decode("Ver", "\8\1\18\1y"), { a = 1, b = "y" })
+      -- hooks and default tables are moved by type name
+      eq(pb.hook "Ver", hook)
+      eq(pb.defaults "Ver", defs)
+      eq(defs.b, "x")
+      fail("state is attached to a shared schema", function() pb.load "" end)
+
+      -- a hook reloads in the middle of a decode
+      local bin = pb.encode("VerList", { list = { { a = 1 }, { a = 2 } } })
+      pb.option "enable_hooks"
+      pb.hook("Ver", function(t)
+         assert(pb.reload(v2))
+         collectgarbage()
+         return t
+      end)
+      eq(#pb.decode("VerList", bin).list, 2)
+      pb.option "disable_hooks"
+      collectgarbage()
+      eq(msg.list[1].a, 1)
+
+      -- broken schemas leave the current version in place
+      local ok, err = pb.reload "\10\1"
+      eq(ok, false)
+      eq(err:match "^invalid schema at offset", "invalid schema at offset")
+      ok, err = pb.reload(broken)
+      eq(ok, false)
+      eq(err, "type '.Missing' of field '.Ver.m' is not defined")
+      eq(pb.decode("Ver", "\8\1\18\1y"), { a = 1, b = "y" })
+      -- the loaded types are not kept for unsafe.detach()
+      eq(require "pb.unsafe".detach(), true)
+      eq(pb.type "Ver", nil)
+
+      -- pb.clear() drops a reloaded version, so pb.load works again
+      eq(pb.reload(v2), true)
+      pb.clear()
+      eq(pb.type "Ver", nil)
+      protoc.reload()
+      check_load [[
+         message Ver { optional int32 a = 1; }
+         message VerList { repeated Ver list = 1; } ]]
+      eq(pb.field("Ver", "b"), nil)
+
+      -- a hook reloads while the decode uses the loaded types
+      pb.option "enable_hooks"
+      pb.hook("Ver", function(t)
+         assert(pb.reload(v2))
+         collectgarbage()
+         return t
+      end)
+      eq(pb.decode("VerList", bin).list[2].a, 2)
+      pb.option "disable_hooks"
+   end)
+
+   -- old objects and handles read the defaults of their own version
+   withstate(function()
+      protoc.reload()
+      local function compile(n, s)
+         return protoc.new():compile(([[
+            message Def {
+               optional int32  n = 1 [default = %d];
+               optional string s = 2 [default = "%s"];
+            }
+            service DefSvc { rpc Get(Def) returns (Def); } ]]):format(n, s))
+      end
+      local d1, d2 = compile(1, "one"), compile(2, "two")
+      eq(pb.reload(d1), true)
+      pb.option "use_default_values"
+      local msg = pb.parse("Def", "")
+      local m = assert(pb.method "DefSvc/Get")
+      eq(m.decode_request "", { n = 1, s = "one" })
+      eq(pb.reload(d2), true)
+      collectgarbage()
+      eq(pb.decode("Def", ""), { n = 2, s = "two" })
+      eq(msg.n, 1)
+      eq(msg.s, "one")
+      eq(msg:totable(), { n = 1, s = "one" })
+      eq(m.decode_request "", { n = 1, s = "one" })
+      eq(pb.method "DefSvc/Get".decode_request "", { n = 2, s = "two" })
+   end)
+end
+
+local function dump()
+   local r = {}
+   for name, basename, kind in pb.types() do
+      local fields = {}
+      for fname, number, ftype, default, label, packed, oneof in
+            pb.fields(name) do
+         fields[#fields+1] = { fname, number, ftype, default,
+                               label, packed, oneof }
+      end
+      table.sort(fields, function(a, b) return a[2] < b[2] end)
+      r[name] = { basename, kind, fields }
+   end
+   return r
+end
+
+function _G.test_snapshot()
+   withstate(function()
+      protoc.reload()
+      check_load [[
+         syntax = "proto2";
+         package snap;
+         enum Color { RED = 0; GREEN = -1; }
+         message Item {
+            optional string name  = 1 [default = "none"];
+            optional Color  color = 2 [default = GREEN];
+            repeated int32  ids   = 3 [packed = true];
+            map<string, Item> children = 4;
+            oneof v { int32 a = 5; string b = 6; }
+            message Nested { optional int64 n = 1; }
+            optional Nested nested = 7;
+         } ]]
+      local types = dump()
+      local data = { name = "x", color = "RED", ids = { 1, 2 }, b = "b",
+                     children = { k = { name = "y" } }, nested = { n = 1 } }
+      local bin = pb.encode("snap.Item", data)
+      eq(pb.save_snapshot "snapshot.bin", true)
+
+      pb.state(nil)
+      eq(pb.load_snapshot "snapshot.bin", true)
+      eq(dump(), types)
+      eq(pb.decode("snap.Item", bin), pb.decode("snap.Item", pb.encode("snap.Item", data)))
+      eq(pb.defaults "snap.Item".color, "GREEN")
+      eq(pb.field("snap.Item", "a"), "a")
+
+      -- loading over a state keeps the other types
+      pb.state(nil)
+      protoc.reload()
+      eq(pb.load_snapshot "snapshot.bin", true)
+      assert(pb.type ".google.protobuf.FileDescriptorSet")
+      eq(pb.decode("snap.Item", bin).nested.n, 1)
+      os.remove "snapshot.bin"
+
+      pbio.dump("snapshot.bin", "\27pbS2\1")
+      eq(pb.load_snapshot "snapshot.bin", false)
+      pbio.dump("snapshot.bin", "not a snapshot")
+      eq(pb.load_snapshot "snapshot.bin", false)
+      -- field records are checked
+      local function snap(number, oneof)
+         return "\27pbS2\1\3.Z\16\0\1\2x"..number.."\0\0"..oneof.."\5\0"
+      end
+      pb.state(nil)
+      pbio.dump("snapshot.bin", snap("\0", "\0"))
+      eq(pb.load_snapshot "snapshot.bin", false)
+      pbio.dump("snapshot.bin", snap("\1", "\1"))
+      eq(pb.load_snapshot "snapshot.bin", false)
+      pbio.dump("snapshot.bin", snap("\1", "\0"))
+      eq(pb.load_snapshot "snapshot.bin", true)
+      eq(select(2, pb.field(".Z", "x")), 1)
+      os.remove "snapshot.bin"
+      local ok, err = pb.load_snapshot "snapshot.bin"
+      eq(ok, nil)
+      assert(err:match "snapshot.bin")
+   end)
+end
+
+function _G.test_image()
+   withstate(function()
+      protoc.reload()
+      check_load [[
+         syntax = "proto2";
+         package img;
+         enum Color { option allow_alias = true; RED = 0; GREEN = -1; VERT = -1; }
+         message Item {
+            optional string name  = 1 [default = "none"];
+            optional Color  color = 2 [default = GREEN];
+            repeated int32  ids   = 3 [packed = true];
+            map<string, Item> children = 4;
+            oneof v { int32 a = 5; string b = 6; }
+            message Nested { optional int64 n = 1; }
+            optional Nested nested = 7;
+         }
+         message Sparse { optional int32 a = 1; optional int32 z = 100; }
+         service Svc { rpc Get (Item) returns (Sparse); } ]]
+      local types = dump()
+      local data = { name = "x", color = "RED", ids = { 1, 2 }, b = "b",
+                     children = { k = { name = "y" } }, nested = { n = 1 } }
+      local bin = pb.encode("img.Item", data)
+      local hook = function(t) t.hooked = true return t end
+      local function check()
+         eq(dump(), types)
+         eq(pb.encode("img.Item", data), bin)
+         eq(pb.decode("img.Item", bin).children.k.name, "y")
+         eq(pb.hook "img.Item.Nested", hook)
+         eq(pb.decode("img.Sparse", "\8\1\160\6\2"), { a = 1, z = 2 })
+         eq(pb.defaults "img.Item".color, "GREEN")
+         eq(pb.enum("img.Color", "VERT"), -1)
+         eq(pb.field("img.Item", "a"), "a")
+         eq(pb.method "img.Svc/Get".output, ".img.Sparse")
+         fail("state is attached to a shared schema", function() pb.load "" end)
+      end
+      -- types not frozen yet are frozen for the image
+      eq(pb.save_image "image.bin", true)
+      pb.freeze()
+      eq(pb.save_image "image2.bin", true)
+
+      -- the frozen block is still in use here, so the images are moved
+      pb.state(nil)
+      local ok, how = pb.load_image "image.bin"
+      eq(ok, true)
+      assert(how == "mapped" or how == "moved")
+      pb.hook("img.Item.Nested", hook)
+      check()
+      eq(pb.load_image "image2.bin", true)
+      check()
+      -- an image saved from a moved one
+      eq(pb.save_image "image.bin", true)
+      eq(pb.load_image "image.bin", true)
+      check()
+      eq(require "pb.unsafe".detach(), true)
+      eq(pb.type "img.Item", nil)
+
+      local f = assert(io.open("image.bin", "rb"))
+      local img = f:read "*a"
+      f:close()
+      pbio.dump("image.bin", img:sub(1, 40))
+      local res, err = pb.load_image "image.bin"
+      eq(res, nil)
+      eq(err, "image.bin: invalid schema image")
+      pbio.dump("image.bin", img:sub(1, -2))
+      eq(pb.load_image "image.bin", nil)
+      pbio.dump("image.bin", "not an image")
+      eq(pb.load_image "image.bin", nil)
+      os.remove "image.bin"
+      os.remove "image2.bin"
+      res, err = pb.load_image "image.bin"
+      eq(res, nil)
+      assert(err:match "image.bin")
+      eq(pb.type "img.Item", nil)
+   end)
+end
+
+function _G.test_freeze()
+   withstate(function()
+      protoc.reload()
+      check_load [[
+         syntax = "proto2";
+         package frz;
+         enum Color { RED = 0; GREEN = -1; }
+         message Item {
+            optional string name  = 1 [default = "none"];
+            optional Color  color = 2 [default = GREEN];
+            repeated int32  ids   = 3 [packed = true];
+            map<string, Item> children = 4;
+            oneof v { int32 a = 5; string b = 6; }
+            message Nested { optional int64 n = 1; }
+            optional Nested nested = 7;
+         }
+         message Sparse { optional int32 a = 1; optional int32 z = 100; }
+         enum Mode { option allow_alias = true; OFF = 0; STOP = 0; ON = 1; }
+         enum Gap { option allow_alias = true; A = 0; B = 1; C = 1; D = 3; }
+         message GapMsg { optional Gap e = 1; } ]]
+      local types = dump()
+      local mode = pb.enum("frz.Mode", 0)
+      local data = { name = "x", color = "RED", ids = { 1, 2 }, b = "b",
+                     children = { k = { name = "y" } }, nested = { n = 1 } }
+      local bin = pb.encode("frz.Item", data)
+      local sparse = pb.encode("frz.Sparse", { a = 1, z = 2 })
+      local hook = function(t) t.hooked = true return t end
+      pb.hook("frz.Item.Nested", hook)
+      local defs = pb.defaults "frz.Item"
+
+      pb.freeze()
+      eq(dump(), types)
+      eq(pb.encode("frz.Item", data), bin)
+      eq(pb.decode("frz.Item", bin).children.k.name, "y")
+      eq(pb.field("frz.Item", "a"), "a")
+      eq(pb.enum("frz.Color", -1), "GREEN")
+      eq(pb.enum("frz.Color", 1), nil)
+      eq(pb.enum("frz.Color", "RED"), 0)
+      eq(pb.enum("frz.Mode", "OFF"), 0)
+      eq(pb.enum("frz.Mode", "STOP"), 0)
+      eq(pb.enum("frz.Mode", 0), mode)
+      -- aliases do not make an enum with a hole look dense
+      eq(pb.enum("frz.Gap", 2), nil)
+      eq(pb.enum("frz.Gap", 3), "D")
+      eq(pb.decode("frz.GapMsg", "\8\2").e, 2)
+      eq(pb.decode("frz.Sparse", sparse), { a = 1, z = 2 })
+      eq(pb.field("frz.Sparse", 50), nil)
+      eq(select(4, pb.field("frz.Item", "name")), "none")
+      eq(pb.hook "frz.Item.Nested", hook)
+      eq(pb.defaults "frz.Item", defs)
+      eq(defs.name, "none")
+      fail("state is attached to a shared schema", function() pb.load "" end)
+      -- freezing again, or after a reload, is fine
+      pb.freeze()
+      eq(dump(), types)
+      eq(pb.decode("frz.Item", bin).nested.n, 1)
+      -- the loaded types moved into the frozen state
+      eq(require "pb.unsafe".detach(), true)
+      eq(pb.type "frz.Item", nil)
+   end)
+end
+
+function _G.test_prune()
+   local src = [[
+      syntax = "proto2";
+      package prn;
+      enum Color { option allow_alias = true; RED = 0; GREEN = 1; VERT = 1; }
+      message Leaf { optional string s = 1; }
+      message Inner { optional Inner self = 1; optional int32 v = 2; }
+      message Req {
+         optional Inner in = 1;
+         optional Color c = 2 [default = GREEN];
+         map<string, Leaf> m = 3;
+      }
+      message Other { optional int32 x = 1; }
+      message Unused { optional Other o = 1; } ]]
+   withstate(function()
+      protoc.reload()
+      check_load(src)
+      local hook = function(t) t.hooked = true return t end
+      pb.hook("prn.Req", hook)
+      pb.hook("prn.Unused", hook)
+      local defs = pb.defaults "prn.Req"
+      pb.defaults "prn.Unused"
+      fail("type 'prn.NoSuch' does not exists", function() pb.prune { "prn.NoSuch" } end)
+      fail("type name expected at index 1", function() pb.prune { 1 } end)
+      local data = { ["in"] = { self = { v = 1 } }, c = "RED", m = { k = { s = "s" } } }
+      local bin = pb.encode("prn.Req", data)
+
+      pb.prune { "prn.Req" }
+      eq(pb.type "prn.Unused", nil)
+      eq(pb.type "prn.Other", nil)
+      eq(pb.type ".google.protobuf.FileDescriptorSet", nil)
+      eq(pb.type "prn.Inner", ".prn.Inner")
+      eq(pb.type "prn.Leaf", ".prn.Leaf")
+      eq(pb.type "prn.Color", ".prn.Color")
+      local types = {}
+      for name in pb.types() do types[#types+1] = name end
+      table.sort(types)
+      eq(types, { ".prn.Color", ".prn.Inner", ".prn.Leaf", ".prn.Req", ".prn.Req.MEntry" })
+      eq(pb.encode("prn.Req", data), bin)
+      eq(pb.decode("prn.Req", bin).m.k.s, "s")
+      eq(pb.hook "prn.Req", hook)
+      eq(pb.defaults "prn.Req", defs)
+      eq(defs.c, "GREEN")
+      eq(pb.enum("prn.Color", "VERT"), 1)
+
+      -- pruned types can be loaded again
+      protoc.reload()
+      check_load(src)
+      eq(pb.type "prn.Unused", ".prn.Unused")
+      eq(pb.hook "prn.Unused", nil)
+
+      -- types not built yet by lazy_load are built first
+      pb.state(nil)
+      protoc.reload()
+      local bytes = protoc.new():compile(src)
+      pb.option "lazy_load"
+      assert(pb.load(bytes))
+      pb.prune { "prn.Inner" }
+      eq(pb.type "prn.Req", nil)
+      eq(pb.decode("prn.Inner", "\10\2\16\1"), { self = { v = 1 } })
+   end)
+end
+
+function _G.test_method()
+   local src = [[
+      syntax = "proto3";
+      package svc;
+      message Req { int32 id = 1; string q = 2; }
+      message Resp { repeated string items = 1; }
+      service Search {
+         rpc Find (Req) returns (Resp);
+         rpc Watch (Req) returns (stream Resp);
+         rpc Upload (stream Req) returns (Resp);
+      } ]]
+   withstate(function()
+      protoc.reload()
+      check_load(src)
+      local m = assert(pb.method "svc.Search/Find")
+      eq(m.name, ".svc.Search/Find")
+      eq(m.input, ".svc.Req")
+      eq(m.output, ".svc.Resp")
+      eq(m.client_streaming, false)
+      eq(m.server_streaming, false)
+      eq(pb.method ".svc.Search/Find".name, m.name)
+      eq(pb.method "/svc.Search/Find".name, m.name)
+      eq(pb.method "svc.Search/Watch".server_streaming, true)
+      eq(pb.method "svc.Search/Upload".client_streaming, true)
+      eq(pb.method "svc.Search/Nothing", nil)
+      eq(pb.method "svc.Req", nil)
+      eq(pb.method "", nil)
+
+      local req = { id = 1, q = "q" }
+      local bin = m.encode_request(req)
+      eq(bin, pb.encode("svc.Req", req))
+      eq(m.decode_request(bin), req)
+      local t = {}
+      eq(m.decode_request(bin, t), t)
+      eq(t.q, "q")
+      local b = buffer.new()
+      eq(m.encode_response({ items = { "a", "b" } }, b), b)
+      eq(m.decode_response(b:result()), { items = { "a", "b" } })
+      eq(m.decode_response(), { items = {} })
+      fail("table expected", function() m.encode_request(nil) end)
+
+      -- methods are kept by snapshots and frozen states
+      eq(pb.save_snapshot "method.bin", true)
+      pb.state(nil)
+      eq(pb.load_snapshot "method.bin", true)
+      os.remove "method.bin"
+      eq(pb.method "svc.Search/Watch".server_streaming, true)
+      pb.freeze()
+      m = assert(pb.method "svc.Search/Find")
+      eq(m.decode_request(bin), req)
+
+      -- pruning drops the methods using a removed type
+      pb.state(nil)
+      protoc.reload()
+      check_load(src)
+      pb.prune { "svc.Req" }
+      eq(pb.method "svc.Search/Find", nil)
+
+      -- with lazy_load, methods are loaded with their types
+      pb.state(nil)
+      protoc.reload()
+      pb.option "lazy_load"
+      assert(pb.load(protoc.new():compile(src)))
+      eq(pb.method "svc.Search/Find".decode_request(bin), req)
+
+      -- handles of freed types raise errors, frozen ones keep working
+      m = assert(pb.method "svc.Search/Find")
+      pb.clear()
+      fail("method handle is stale", function() m.decode_request(bin) end)
+      fail("method handle is stale", function() m.encode_response({}) end)
+      protoc.reload()
+      check_load(src)
+      pb.freeze()
+      m = assert(pb.method "svc.Search/Find")
+      pb.clear()
+      collectgarbage()
+      eq(m.decode_request(bin), req)
+   end)
+end
+
+function _G.test_load_files()
+   withstate(function()
+      protoc.reload()
+      local p = protoc.new()
+      local common = assert(p:compile([[
+         syntax = "proto3";
+         package files;
+         enum Color { RED = 0; GREEN = 1; } ]], "common.proto"))
+      local a = assert(p:compile([[
+         syntax = "proto3";
+         message A { int32 x = 1; } ]], "a.proto"))
+      local b = assert(p:compile([[
+         syntax = "proto3";
+         message B { int32 y = 1; } ]], "b.proto"))
+      local common2 = assert(protoc.new():compile([[
+         syntax = "proto3";
+         package files;
+         enum Color { RED = 0; GREEN = 1; BLUE = 2; } ]], "common.proto"))
+
+      local ok, _, files = pb.load(common .. a)
+      eq(ok, true)
+      eq(files, { ["common.proto"] = "loaded", ["a.proto"] = "loaded" })
+      ok, _, files = pb.load(common .. b)
+      eq(files, { ["common.proto"] = "skipped", ["b.proto"] = "loaded" })
+      eq(pb.enum("files.Color", 1), "GREEN")
+      eq(pb.enum("files.Color", 2), nil)
+      eq(select(3, pb.load(common2 .. b .. b)),
+         { ["common.proto"] = "replaced", ["b.proto"] = "skipped" })
+      eq(pb.enum("files.Color", 2), "BLUE")
+
+      -- changing the types forgets the loaded files
+      pb.clear "B"
+      eq(pb.type "B", nil)
+      eq(select(3, pb.load(b)), { ["b.proto"] = "loaded" })
+      eq(pb.type "B", ".B")
+      eq({pb.load "\10\2\10"}, {false, 2})
+      eq(select(3, pb.load(b)), { ["b.proto"] = "loaded" })
+   end)
+end
+
+function _G.test_name_limits()
+   withstate(function()
+      protoc.reload()
+      -- a name used by more than 65535 fields, and one longer than 64KB
+      local long = ("x"):rep(70000)
+      local msgs = {}
+      for i = 1, 70000 do
+         msgs[i] = { name = "M"..i,
+                     field = { { name = "id", number = 1, label = 1, type = 5 } } }
+      end
+      msgs[#msgs+1] = { name = long,
+                        field = { { name = long, number = 1, label = 1, type = 5 } } }
+      assert(pb.load(pb.encode(".google.protobuf.FileDescriptorSet",
+         { file = { { name = "names.proto", message_type = msgs } } })))
+      for i = 1, 10000 do pb.clear("M"..i) end
+      eq(pb.field("M70000", "id"), "id")
+      eq(pb.decode("M70000", "\8\1"), { id = 1 })
+      eq(pb.type(long), "."..long)
+      eq(pb.field(long, long), long)
+   end)
+end
+
+function _G.test_lazy_load()
+   local function count()
+      local n = 0
+      for _ in pb.types() do n = n + 1 end
+      return n
+   end
+   withstate(function()
+      protoc.reload()
+      local bin = assert(protoc.new():compile [[
+         syntax = "proto3";
+         package lazy;
+         enum Kind { NONE = 0; LEAF = 1; }
+         message Leaf { Kind kind = 1; }
+         message Node {
+            message Inner { repeated Leaf leaves = 1; }
+            Inner inner = 1;
+            map<string, Leaf> named = 2;
+         }
+         message Unused { int32 x = 1; }
+         message Other { Unused u = 1; }
+         message Spare { } ]])
+      pb.state(nil)
+      pb.option "lazy_load"
+      eq(pb.load(bin), true)
+      eq(count(), 0)
+      local data = { inner = { leaves = { { kind = "LEAF" } } },
+                     named = { a = { kind = "LEAF" } } }
+      eq(pb.decode("lazy.Node", pb.encode("lazy.Node", data)), data)
+      -- only the closure of lazy.Node has been built
+      assert(pb.type ".lazy.Node.Inner")
+      eq(pb.fields "lazy.Node" ~= nil, true)
+      local used = count()
+      assert(used > 0)
+      eq(pb.field("lazy.Kind", "LEAF"), "LEAF")
+      eq(count(), used)
+      eq(pb.type "lazy.Missing", nil)
+      eq(pb.type "lazy.Other", ".lazy.Other")
+      eq(count(), used + 2)
+
+      -- publishing and snapshots build every type
+      eq(pb.save_snapshot "snapshot.bin", true)
+      os.remove "snapshot.bin"
+      eq(count(), used + 3)
+
+      -- a bad nested type leaves no names of a unit never added
+      pb.state(nil)
+      pb.option "lazy_load"
+      eq(pb.load "\10\15\18\2lz\34\9\10\1A\26\4\10\1B\15", false)
+      eq(pb.type "lz.A", nil)
+      pb.option "no_lazy_load"
+   end)
 end
 
 function _G.test_order()